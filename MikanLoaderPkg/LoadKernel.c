@@ -1,5 +1,6 @@
 #include "LoadKernel.h"
 
+#include <Guid/Acpi.h>
 #include <Guid/FileInfo.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/UefiBootServicesTableLib.h>
@@ -9,12 +10,21 @@
 
 #include "Common.h"
 
-static void CalcLoadAddressRange(Elf64_Ehdr* ehdr, UINT64* first_out, UINT64* last_out) {
-	Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
+// ACPI 2.0以降のRSDPを探す。見つからなければNULL
+static const VOID* FindAcpiTable() {
+	for (UINTN i = 0; i < gST->NumberOfTableEntries; ++i) {
+		if (CompareGuid(&gEfiAcpiTableGuid, &gST->ConfigurationTable[i].VendorGuid)) {
+			return gST->ConfigurationTable[i].VendorTable;
+		}
+	}
+	return NULL;
+}
+
+static void CalcLoadAddressRange(Elf64_Phdr* phdr, Elf64_Half phnum, UINT64* first_out, UINT64* last_out) {
 	UINT64 first = MAX_UINT64;
 	UINT64 last = 0;
 
-	for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
+	for (Elf64_Half i = 0; i < phnum; ++i) {
 		if (phdr[i].p_type == PT_LOAD) {
 			first = MIN(first, phdr[i].p_vaddr);
 			last = MAX(last, phdr[i].p_vaddr + phdr[i].p_memsz);
@@ -25,13 +35,44 @@ static void CalcLoadAddressRange(Elf64_Ehdr* ehdr, UINT64* first_out, UINT64* la
 	*last_out = last;
 }
 
-static void CopyLoadSegments(Elf64_Ehdr* ehdr) {
-	Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
+static UINTN GetFileSize(EFI_FILE_PROTOCOL* file, const CHAR16* name) {
+	UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 32;
+	UINT8 file_info_buffer[file_info_size];
+	EFI_STATUS status = file->GetInfo(file, &gEfiFileInfoGuid, &file_info_size, file_info_buffer);
+	if (EFI_ERROR(status)) {
+		Print(u"Failed to get file infomation of '%s': %r\n", name, status);
+		Halt();
+	}
+
+	EFI_FILE_INFO* file_info = (EFI_FILE_INFO*)file_info_buffer;
+	return file_info->FileSize;
+}
+
+// ファイルのoffsetからsizeバイトをbufに直接読み込む
+static void ReadFileAt(EFI_FILE_PROTOCOL* file, const CHAR16* name, UINT64 offset, UINTN size, VOID* buf) {
+	EFI_STATUS status = file->SetPosition(file, offset);
+	if (EFI_ERROR(status)) {
+		Print(u"Failed to seek '%s' to 0x%lx: %r\n", name, offset, status);
+		Halt();
+	}
 
-	for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
+	UINTN read_size = size;
+	status = file->Read(file, &read_size, buf);
+	if (EFI_ERROR(status)) {
+		Print(u"Failed to read '%s': %r\n", name, status);
+		Halt();
+	}
+	if (read_size != size) {
+		Print(u"'%s' is truncated: read %lu of %lu bytes\n", name, read_size, size);
+		Halt();
+	}
+}
+
+// 一時バッファを経由せず、各セグメントをファイルから最終的なアドレスへ読み込む
+static void LoadSegments(EFI_FILE_PROTOCOL* file, Elf64_Phdr* phdr, Elf64_Half phnum) {
+	for (Elf64_Half i = 0; i < phnum; ++i) {
 		if (phdr[i].p_type == PT_LOAD) {
-			UINT64 segm_in_file = (UINT64)ehdr + phdr[i].p_offset;
-			CopyMem((VOID*)phdr[i].p_vaddr, (VOID*)segm_in_file, phdr[i].p_filesz);
+			ReadFileAt(file, u"\\kernel.elf", phdr[i].p_offset, phdr[i].p_filesz, (VOID*)phdr[i].p_vaddr);
 
 			UINTN remain_bytes = phdr[i].p_memsz - phdr[i].p_filesz;
 			SetMem((VOID*)(phdr[i].p_vaddr + phdr[i].p_filesz), remain_bytes, 0);
@@ -39,35 +80,45 @@ static void CopyLoadSegments(Elf64_Ehdr* ehdr) {
 	}
 }
 
-static void ExitBootServices(EFI_HANDLE image_handle, struct MemoryMap* memmap) {
-	EFI_STATUS status = GetMemoryMap(memmap);
+// nameのファイルをページ単位で確保した領域に読み込む
+static const UINT8* LoadAsset(EFI_FILE_PROTOCOL* root_dir, const CHAR16* name, UINT64* size_out) {
+	EFI_FILE_PROTOCOL* file;
+	EFI_STATUS status = root_dir->Open(root_dir, &file, (CHAR16*)name, EFI_FILE_MODE_READ, 0);
 	if (EFI_ERROR(status)) {
-		Print(u"Failed to get memory map: %r\n", status);
+		Print(u"Failed to open file '%s': %r\n", name, status);
 		Halt();
 	}
 
-	status = gBS->ExitBootServices(image_handle, memmap->map_key);
+	UINTN size = GetFileSize(file, name);
+
+	// カーネルが後から読み取り専用でマップし直せるように、ページ境界から配置する
+	EFI_PHYSICAL_ADDRESS addr;
+	status = gBS->AllocatePages(AllocateAnyPages, EfiLoaderData, (size + 0xfff) / 0x1000, &addr);
 	if (EFI_ERROR(status)) {
-		Print(u"Could not exit boot service: %r\n", status);
+		Print(u"Failed to allocate pages for '%s': %r\n", name, status);
 		Halt();
 	}
+
+	ReadFileAt(file, name, 0, size, (VOID*)addr);
+	file->Close(file);
+
+	Print(u"Asset '%s': 0x%0lx - 0x%0lx\n", name, addr, addr + size);
+	*size_out = size;
+	return (const UINT8*)addr;
 }
 
-static VOID* LoadKernelToTempMemory(EFI_FILE_PROTOCOL* file, UINTN size) {
-	VOID* buf;
-	EFI_STATUS status = gBS->AllocatePool(EfiLoaderData, size, &buf);
+static void ExitBootServices(EFI_HANDLE image_handle, struct MemoryMap* memmap) {
+	EFI_STATUS status = GetMemoryMap(memmap);
 	if (EFI_ERROR(status)) {
-		Print(u"Failed to allocate pool: %r\n", status);
+		Print(u"Failed to get memory map: %r\n", status);
 		Halt();
 	}
 
-	status = file->Read(file, &size, buf);
+	status = gBS->ExitBootServices(image_handle, memmap->map_key);
 	if (EFI_ERROR(status)) {
-		Print(u"Failed to read kernel: %r\n", status);
+		Print(u"Could not exit boot service: %r\n", status);
 		Halt();
 	}
-
-	return buf;
 }
 
 void LoadKernel(EFI_HANDLE image_handle, EFI_FILE_PROTOCOL* root_dir, struct FrameBufferConfig* config) {
@@ -78,31 +129,31 @@ void LoadKernel(EFI_HANDLE image_handle, EFI_FILE_PROTOCOL* root_dir, struct Fra
 		Halt();
 	}
 
-	// kernel.elfのファイルサイズを計算
-	UINTN kernel_filesize;
-	{
-		UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 12;
-		UINT8 file_info_buffer[file_info_size];
-		status = kernel_file->GetInfo(kernel_file, &gEfiFileInfoGuid, &file_info_size, file_info_buffer);
-		if (EFI_ERROR(status)) {
-			Print(u"Failed to get file infomation: %r\n", status);
-			Halt();
-		}
+	UINTN kernel_filesize = GetFileSize(kernel_file, u"\\kernel.elf");
+	Print(u"Size of kernel.elf: %lubytes\n", kernel_filesize);
 
-		EFI_FILE_INFO* file_info = (EFI_FILE_INFO*)file_info_buffer;
-		kernel_filesize = file_info->FileSize;
-		Print(u"Size of kernel.elf: %lubytes\n", kernel_filesize);
+	// ELFヘッダとプログラムヘッダだけを読む
+	Elf64_Ehdr kernel_ehdr;
+	ReadFileAt(kernel_file, u"\\kernel.elf", 0, sizeof(kernel_ehdr), &kernel_ehdr);
+	if (CompareMem(kernel_ehdr.e_ident, ELFMAG, SELFMAG) != 0 || kernel_ehdr.e_ident[EI_CLASS] != ELFCLASS64) {
+		Print(u"kernel.elf is not an ELF64 file\n");
+		Halt();
 	}
 
-	VOID* kernel_buffer = LoadKernelToTempMemory(kernel_file, kernel_filesize);
+	Elf64_Phdr* kernel_phdr;
+	UINTN phdr_size = (UINTN)kernel_ehdr.e_phentsize * kernel_ehdr.e_phnum;
+	status = gBS->AllocatePool(EfiLoaderData, phdr_size, (VOID**)&kernel_phdr);
+	if (EFI_ERROR(status)) {
+		Print(u"Failed to allocate pool: %r\n", status);
+		Halt();
+	}
+	ReadFileAt(kernel_file, u"\\kernel.elf", kernel_ehdr.e_phoff, phdr_size, kernel_phdr);
 
 	UINT64 kernel_first_addr;
 	{
-		Elf64_Ehdr* kernel_ehdr = (Elf64_Ehdr*)kernel_buffer;
-
 		// カーネルを配置するべきアドレスを計算
 		UINT64 kernel_last_addr;
-		CalcLoadAddressRange(kernel_ehdr, &kernel_first_addr, &kernel_last_addr);
+		CalcLoadAddressRange(kernel_phdr, kernel_ehdr.e_phnum, &kernel_first_addr, &kernel_last_addr);
 		UINTN num_pages = (kernel_last_addr - kernel_first_addr + 0xfff) / 0x1000;
 
 		// 計算したアドレスを確保
@@ -113,27 +164,34 @@ void LoadKernel(EFI_HANDLE image_handle, EFI_FILE_PROTOCOL* root_dir, struct Fra
 		}
 
 		// カーネルを配置
-		CopyLoadSegments(kernel_ehdr);
+		LoadSegments(kernel_file, kernel_phdr, kernel_ehdr.e_phnum);
 		Print(u"Kernel: 0x%0lx - 0x%0lx\n", kernel_first_addr, kernel_last_addr);
 	}
 
-	status = gBS->FreePool(kernel_buffer);
+	status = gBS->FreePool(kernel_phdr);
 	if (EFI_ERROR(status)) {
 		Print(u"Failed to free pool: %r\n", status);
 		Halt();
 	}
+	kernel_file->Close(kernel_file);
+
+	struct BootAssets assets;
+	assets.font = LoadAsset(root_dir, u"\\hankaku.bin", &assets.font_size);
+
+	const VOID* acpi_table = FindAcpiTable();
+	if (acpi_table == NULL) {
+		Print(u"ACPI table is not found\n");
+	}
 
 	CHAR8 memmap_buf[4096 * 4];
 	struct MemoryMap memmap = {sizeof(memmap_buf), memmap_buf, 0, 0, 0, 0};
 
 	ExitBootServices(image_handle, &memmap);
 
-	// ELFファイルはエントリポイントアドレスがファイルの先頭から24バイト目から8バイト書かれる
-	UINT64 entry_addr = *(UINT64*)(kernel_first_addr + 24);
-
-	typedef void EntryPointType(const struct FrameBufferConfig*, const struct MemoryMap*);
-	EntryPointType* entry_point = (EntryPointType*)entry_addr;
+	typedef void EntryPointType(
+		const struct FrameBufferConfig*, const struct MemoryMap*, const struct BootAssets*, const VOID*);
+	EntryPointType* entry_point = (EntryPointType*)kernel_ehdr.e_entry;
 
 	// 開始
-	entry_point(config, &memmap);
+	entry_point(config, &memmap, &assets, acpi_table);
 }
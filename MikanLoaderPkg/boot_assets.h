@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+// ローダーが読み込んでカーネルに渡すファイル
+// 各アセットはページ境界から始まり、カーネルからは読み取り専用でマップされる
+struct BootAssets {
+	const uint8_t* font;
+	uint64_t font_size;
+};
@@ -16,4 +16,4 @@ fi
 ninja
 cd ..
 mkdir -p qemu-workdir/input
-cp build-kernel/kernel.elf qemu-workdir/input
+cp build-kernel/kernel.elf build-kernel/hankaku.bin qemu-workdir/input
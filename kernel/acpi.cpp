@@ -0,0 +1,168 @@
+#include "acpi.hpp"
+
+#include <array>
+#include <cstring>
+
+#include "logger.hpp"
+
+namespace {
+	// MADTのInterrupt Controller Structureの種類
+	constexpr std::uint8_t madt_processor_local_apic = 0;
+	constexpr std::uint8_t madt_io_apic = 1;
+	constexpr std::uint8_t madt_interrupt_source_override = 2;
+
+	// Interrupt Source OverrideのFlags。0ならバスの規定(ISAは正極性のエッジ)に従う
+	constexpr std::uint16_t mps_polarity_mask = 0b11;
+	constexpr std::uint16_t mps_polarity_active_low = 0b11;
+	constexpr std::uint16_t mps_trigger_mask = 0b11 << 2;
+	constexpr std::uint16_t mps_trigger_level = 0b11 << 2;
+
+	constexpr std::uint32_t local_apic_enabled = 1u << 0;
+	// 今は無効でもOSが後から有効にできる
+	constexpr std::uint32_t local_apic_online_capable = 1u << 1;
+
+	std::array<std::uint8_t, cpu::max_count> local_apic_ids;
+	int num_local_apic_ids;
+	std::uint64_t first_ioapic_address;
+	std::uint32_t first_ioapic_gsi_base;
+	std::array<acpi::IsaIrqRoute, acpi::num_isa_irqs> isa_irq_routes;
+
+	std::uint8_t sum_bytes(const void* data, std::size_t bytes) {
+		const auto p = reinterpret_cast<const std::uint8_t*>(data);
+		std::uint8_t sum = 0;
+		for (std::size_t i = 0; i < bytes; ++i) {
+			sum += p[i];
+		}
+		return sum;
+	}
+
+	void parse_madt(const acpi::MADT& madt) {
+		const auto begin = reinterpret_cast<const std::uint8_t*>(&madt) + sizeof(madt);
+		const auto end = reinterpret_cast<const std::uint8_t*>(&madt) + madt.header.length;
+
+		for (auto p = begin; p + 2 <= end && p[1] >= 2; p += p[1]) {
+			const auto type = p[0];
+
+			if (type == madt_processor_local_apic) {
+				// ACPI Processor UID, APIC ID, Flags
+				const auto apic_id = p[3];
+				std::uint32_t flags;
+				std::memcpy(&flags, p + 4, sizeof(flags));
+				if ((flags & (local_apic_enabled | local_apic_online_capable)) == 0) {
+					continue;
+				}
+
+				if (num_local_apic_ids == local_apic_ids.size()) {
+					log->error(u8"Too many CPUs in MADT, ignoring APIC ID %u\n", apic_id);
+					continue;
+				}
+				local_apic_ids[num_local_apic_ids++] = apic_id;
+			} else if (type == madt_io_apic && first_ioapic_address == 0) {
+				// I/O APIC ID, Reserved, I/O APIC Address, Global System Interrupt Base
+				std::uint32_t address;
+				std::memcpy(&address, p + 4, sizeof(address));
+				first_ioapic_address = address;
+				std::memcpy(&first_ioapic_gsi_base, p + 8, sizeof(first_ioapic_gsi_base));
+			} else if (type == madt_interrupt_source_override) {
+				// Bus, Source, Global System Interrupt, Flags
+				const auto source = p[3];
+				if (p[2] != 0 || source >= acpi::num_isa_irqs) {
+					continue;
+				}
+
+				std::uint32_t gsi;
+				std::uint16_t flags;
+				std::memcpy(&gsi, p + 4, sizeof(gsi));
+				std::memcpy(&flags, p + 8, sizeof(flags));
+				isa_irq_routes[source] = {
+					gsi,
+					(flags & mps_polarity_mask) == mps_polarity_active_low,
+					(flags & mps_trigger_mask) == mps_trigger_level};
+			}
+		}
+	}
+}
+
+bool acpi::RSDP::is_valid() const {
+	if (std::strncmp(signature, "RSD PTR ", 8) != 0) {
+		log->debug(u8"invalid RSDP signature: %.8s\n", signature);
+		return false;
+	}
+	if (revision != 2) {
+		log->debug(u8"ACPI revision must be 2: %d\n", revision);
+		return false;
+	}
+	if (sum_bytes(this, 20) != 0) {
+		log->debug(u8"sum of 20 bytes of RSDP must be 0\n");
+		return false;
+	}
+	if (sum_bytes(this, 36) != 0) {
+		log->debug(u8"sum of 36 bytes of RSDP must be 0\n");
+		return false;
+	}
+	return true;
+}
+
+bool acpi::DescriptionHeader::is_valid(const char* expected_signature) const {
+	if (std::strncmp(signature, expected_signature, 4) != 0) {
+		return false;
+	}
+	return sum_bytes(this, length) == 0;
+}
+
+const acpi::DescriptionHeader& acpi::XSDT::operator[](std::size_t i) const {
+	// エントリは8バイトアラインされていないので1つずつコピーして読む
+	const auto entries = reinterpret_cast<const std::uint8_t*>(&header) + sizeof(header);
+	std::uint64_t address;
+	std::memcpy(&address, entries + i * sizeof(address), sizeof(address));
+	return *reinterpret_cast<const DescriptionHeader*>(address);
+}
+
+std::size_t acpi::XSDT::count() const {
+	return (header.length - sizeof(header)) / sizeof(std::uint64_t);
+}
+
+Error acpi::initialize(const RSDP* rsdp) {
+	for (std::uint8_t irq = 0; irq < num_isa_irqs; ++irq) {
+		isa_irq_routes[irq] = {irq, false, false};
+	}
+
+	if (rsdp == nullptr || !rsdp->is_valid()) {
+		return Error::Code::InvalidFormat;
+	}
+
+	const auto& xsdt = *reinterpret_cast<const XSDT*>(rsdp->xsdt_address);
+	if (!xsdt.header.is_valid("XSDT")) {
+		return Error::Code::InvalidFormat;
+	}
+
+	for (std::size_t i = 0; i < xsdt.count(); ++i) {
+		const auto& entry = xsdt[i];
+		if (entry.is_valid("APIC")) {
+			parse_madt(reinterpret_cast<const MADT&>(entry));
+			return Error::Code::Success;
+		}
+	}
+
+	return Error::Code::NotFound;
+}
+
+int acpi::num_local_apics() {
+	return num_local_apic_ids;
+}
+
+std::uint8_t acpi::local_apic_id(int index) {
+	return local_apic_ids[index];
+}
+
+std::uint64_t acpi::ioapic_address() {
+	return first_ioapic_address;
+}
+
+std::uint32_t acpi::ioapic_gsi_base() {
+	return first_ioapic_gsi_base;
+}
+
+acpi::IsaIrqRoute acpi::isa_irq_route(std::uint8_t irq) {
+	return isa_irq_routes[irq];
+}
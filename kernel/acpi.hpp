@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu.hpp"
+#include "error.hpp"
+
+// ACPIのテーブルからCPUと割り込みコントローラの構成を読み取る
+namespace acpi {
+	struct RSDP {
+		char signature[8];
+		std::uint8_t checksum;
+		char oem_id[6];
+		std::uint8_t revision;
+		std::uint32_t rsdt_address;
+		std::uint32_t length;
+		std::uint64_t xsdt_address;
+		std::uint8_t extended_checksum;
+		char reserved[3];
+
+		bool is_valid() const;
+	} __attribute__((packed));
+
+	struct DescriptionHeader {
+		char signature[4];
+		std::uint32_t length;
+		std::uint8_t revision;
+		std::uint8_t checksum;
+		char oem_id[6];
+		char oem_table_id[8];
+		std::uint32_t oem_revision;
+		std::uint32_t creator_id;
+		std::uint32_t creator_revision;
+
+		bool is_valid(const char* expected_signature) const;
+	} __attribute__((packed));
+
+	struct XSDT {
+		DescriptionHeader header;
+
+		const DescriptionHeader& operator[](std::size_t i) const;
+		std::size_t count() const;
+	} __attribute__((packed));
+
+	// Multiple APIC Description Table
+	struct MADT {
+		DescriptionHeader header;
+		std::uint32_t lapic_address;
+		std::uint32_t flags;
+		// この後に可変長のInterrupt Controller Structureが並ぶ
+	} __attribute__((packed));
+
+	// RSDPからXSDTとMADTをたどり、CPUとI/O APICの情報を取り出す
+	// テーブルの内容はコピーしておくので、後でテーブルのメモリが再利用されてもよい
+	Error initialize(const RSDP* rsdp);
+
+	// MADTで有効になっているLocal APICの数。BSPも含む
+	int num_local_apics();
+	std::uint8_t local_apic_id(int index);
+	// 最初のI/O APICのレジスタのアドレス。無ければ0
+	std::uint64_t ioapic_address();
+	// 最初のI/O APICの入力0番のGlobal System Interrupt
+	std::uint32_t ioapic_gsi_base();
+
+	// ISAの割り込みがつながっているI/O APICの入力と、その信号の極性とトリガ
+	struct IsaIrqRoute {
+		std::uint32_t gsi;
+		bool active_low;
+		bool level_triggered;
+	};
+
+	inline constexpr int num_isa_irqs = 16;
+
+	// MADTのInterrupt Source Overrideで付け替えられていなければ、irqと同じ番号の入力に正極性のエッジで届く
+	IsaIrqRoute isa_irq_route(std::uint8_t irq);
+}
@@ -2,9 +2,44 @@
 
 extern "C" void io_out_32(std::uint16_t addr, std::uint32_t data);
 extern "C" std::uint32_t io_in_32(std::uint16_t addr);
+extern "C" void io_out_8(std::uint16_t addr, std::uint8_t data);
+extern "C" std::uint8_t io_in_8(std::uint16_t addr);
 extern "C" std::uint16_t get_cs();
 extern "C" void load_idt(std::uint16_t limit, std::uint64_t offset);
 extern "C" void load_gdp(std::uint16_t limit, std::uint64_t offset);
 extern "C" void set_ds_all(std::uint16_t value);
 extern "C" void set_cs_ss(std::uint16_t cs, std::uint16_t ss);
+extern "C" void load_tr(std::uint16_t selector);
 extern "C" void set_cr3(std::uint64_t value);
+extern "C" std::uint64_t get_cr2();
+extern "C" std::uint64_t get_cr3();
+extern "C" void invlpg(std::uint64_t addr);
+extern "C" std::uint64_t get_cr0();
+extern "C" void set_cr0(std::uint64_t value);
+extern "C" std::uint64_t get_cr4();
+extern "C" void set_cr4(std::uint64_t value);
+extern "C" void get_cpuid(
+	std::uint32_t leaf,
+	std::uint32_t subleaf,
+	std::uint32_t* eax,
+	std::uint32_t* ebx,
+	std::uint32_t* ecx,
+	std::uint32_t* edx);
+extern "C" std::uint64_t read_msr(std::uint32_t msr);
+extern "C" void write_msr(std::uint32_t msr, std::uint64_t value);
+extern "C" std::uint64_t read_tsc();
+
+struct TaskContext;
+extern "C" void switch_context(const TaskContext* next, TaskContext* current);
+extern "C" [[noreturn]] void restore_context(const TaskContext* ctx);
+
+// 0x20番以降の割り込みの入口。1つあたり16バイト
+extern "C" std::uint8_t irq_stub_table[];
+
+extern "C" std::uint8_t kernel_main_stack_guard[];
+extern "C" std::uint8_t kernel_main_stack[];
+
+// APの起動コード。ap_trampoline_beginからap_trampoline_endまでをコピーして使う
+extern "C" std::uint8_t ap_trampoline_begin[];
+extern "C" std::uint8_t ap_trampoline_params[];
+extern "C" std::uint8_t ap_trampoline_end[];
@@ -16,6 +16,21 @@ io_in_32:
 	in %dx, %eax
 	ret
 
+# void io_out_8(std::uint16_t addr, std::uint8_t data)
+.global io_out_8
+io_out_8:
+	mov %di, %dx
+	mov %sil, %al
+	out %al, %dx
+	ret
+
+# std::uint8_t io_in_8(std::uint16_t addr)
+.global io_in_8
+io_in_8:
+	mov %di, %dx
+	in %dx, %al
+	ret
+
 # std::uint16_t get_cs()
 .global get_cs
 get_cs:
@@ -62,6 +77,12 @@ set_ds_all:
 	mov %di, %gs
 	ret
 
+# void load_tr(std::uint16_t selector)
+.global load_tr
+load_tr:
+	ltr %di
+	ret
+
 # void set_cs_ss(std::uint16_t cs, std::uint16_t ss)
 .global set_cs_ss
 set_cs_ss:
@@ -84,3 +105,351 @@ set_cs_ss_next:
 set_cr3:
 	mov %rdi, %cr3
 	ret
+
+# std::uint64_t get_cr2()
+.global get_cr2
+get_cr2:
+	mov %cr2, %rax
+	ret
+
+# std::uint64_t get_cr3()
+.global get_cr3
+get_cr3:
+	mov %cr3, %rax
+	ret
+
+# void invlpg(std::uint64_t addr)
+.global invlpg
+invlpg:
+	invlpg (%rdi)
+	ret
+
+# カーネル用のスタック
+# 最下位の1ページはガードページとしてページングで未マップにする
+	.bss
+	.align 4096
+.global kernel_main_stack_guard
+kernel_main_stack_guard:
+	.space 4096
+.global kernel_main_stack
+kernel_main_stack:
+	.space 1024 * 1024
+kernel_main_stack_end:
+
+	.text
+
+# ブートローダのスタックからカーネル用のスタックに切り替えてkernel_mainを呼ぶ
+# 引数のレジスタ(rdi, rsi, rdx, rcx)はそのままkernel_mainに渡す
+.global kernel_entry
+kernel_entry:
+	mov $kernel_main_stack_end, %rsp
+	call kernel_main
+kernel_entry_halt:
+	hlt
+	jmp kernel_entry_halt
+
+# std::uint64_t get_cr4()
+.global get_cr4
+get_cr4:
+	mov %cr4, %rax
+	ret
+
+# void set_cr4(std::uint64_t value)
+.global set_cr4
+set_cr4:
+	mov %rdi, %cr4
+	ret
+
+# void get_cpuid(std::uint32_t leaf, std::uint32_t subleaf, std::uint32_t* eax, std::uint32_t* ebx,
+#                std::uint32_t* ecx, std::uint32_t* edx)
+.global get_cpuid
+get_cpuid:
+	push %rbx
+	mov %rdx, %r10
+	mov %rcx, %r11
+	mov %edi, %eax
+	mov %esi, %ecx
+	cpuid
+	mov %eax, (%r10)
+	mov %ebx, (%r11)
+	mov %ecx, (%r8)
+	mov %edx, (%r9)
+	pop %rbx
+	ret
+
+# std::uint64_t get_cr0()
+.global get_cr0
+get_cr0:
+	mov %cr0, %rax
+	ret
+
+# void set_cr0(std::uint64_t value)
+.global set_cr0
+set_cr0:
+	mov %rdi, %cr0
+	ret
+
+# std::uint64_t read_msr(std::uint32_t msr)
+.global read_msr
+read_msr:
+	mov %edi, %ecx
+	rdmsr
+	shl $32, %rdx
+	or %rdx, %rax
+	ret
+
+# void write_msr(std::uint32_t msr, std::uint64_t value)
+.global write_msr
+write_msr:
+	mov %edi, %ecx
+	mov %esi, %eax
+	mov %rsi, %rdx
+	shr $32, %rdx
+	wrmsr
+	ret
+
+# std::uint64_t read_tsc()
+.global read_tsc
+read_tsc:
+	# 前の命令が終わる前にTSCを読まないようにする
+	lfence
+	rdtsc
+	shl $32, %rdx
+	or %rdx, %rax
+	ret
+
+# 0x20〜0xffの割り込みの入口。ベクタ番号を積んでirq_common_entryに飛ぶ
+# 各スタブは16バイトごとに並べ、irq_stub_table + (vector - 0x20) * 16 に置く
+	.align 16
+.global irq_stub_table
+irq_stub_table:
+	.set irq_vector, 0x20
+	.rept 0x100 - 0x20
+	.align 16
+	pushq $irq_vector
+	jmp irq_common_entry
+	.set irq_vector, irq_vector + 1
+	.endr
+
+irq_common_entry:
+	# task.hppのInterruptContextの並びで積む
+	push %rax
+	push %rbx
+	push %rcx
+	push %rdx
+	push %rsi
+	push %rdi
+	push %rbp
+	push %r8
+	push %r9
+	push %r10
+	push %r11
+	push %r12
+	push %r13
+	push %r14
+	push %r15
+	mov %rsp, %rbp
+
+	# ハンドラがSSEレジスタを使っても壊れないように保存する
+	sub $512, %rsp
+	and $-16, %rsp
+	fxsave (%rsp)
+
+	# irq_dispatch(InterruptContext*, fxsaveの領域)
+	# タスクを切り替える時はirq_dispatchから戻らない
+	mov %rbp, %rdi
+	mov %rsp, %rsi
+	call irq_dispatch
+
+	fxrstor (%rsp)
+	mov %rbp, %rsp
+	pop %r15
+	pop %r14
+	pop %r13
+	pop %r12
+	pop %r11
+	pop %r10
+	pop %r9
+	pop %r8
+	pop %rbp
+	pop %rdi
+	pop %rsi
+	pop %rdx
+	pop %rcx
+	pop %rbx
+	pop %rax
+	# ベクタ番号
+	add $8, %rsp
+	iretq
+
+# void restore_context(const TaskContext* ctx)
+# ctxのレジスタを読み込み、ctxのrip, rspから実行を再開する。戻らない
+.global restore_context
+restore_context:
+	# 同じページテーブルならCR3を書き換えずTLBを残す
+	mov 168(%rdi), %rax
+	mov %cr3, %rdx
+	cmp %rax, %rdx
+	je restore_context_same_cr3
+	mov %rax, %cr3
+restore_context_same_cr3:
+	fxrstor 176(%rdi)
+
+	# iretq用のフレーム(ss, rsp, rflags, cs, rip)は再開するタスクのスタックに作る
+	# ここから先は呼び出し元のスタックに触れないので、呼び出し元のタスクは他のCPUで再開されていてもよい
+	mov 152(%rdi), %rsp
+	pushq 160(%rdi)
+	pushq 152(%rdi)
+	pushq 144(%rdi)
+	pushq 136(%rdi)
+	pushq 128(%rdi)
+
+	mov 0(%rdi), %r15
+	mov 8(%rdi), %r14
+	mov 16(%rdi), %r13
+	mov 24(%rdi), %r12
+	mov 32(%rdi), %r11
+	mov 40(%rdi), %r10
+	mov 48(%rdi), %r9
+	mov 56(%rdi), %r8
+	mov 64(%rdi), %rbp
+	mov 80(%rdi), %rsi
+	mov 88(%rdi), %rdx
+	mov 96(%rdi), %rcx
+	mov 104(%rdi), %rbx
+	mov 112(%rdi), %rax
+	mov 72(%rdi), %rdi
+	iretq
+
+# void switch_context(const TaskContext* next, TaskContext* current)
+# 今の状態をcurrentに保存してnextに切り替える。currentが再開されるとこの関数から戻る
+# 割り込み禁止の状態で呼ぶ(保存したRFLAGSで再開するので、戻った時も割り込み禁止のまま)
+# 保存し終えたらcurrentのon_cpuを0にする
+.global switch_context
+switch_context:
+	mov %r15, 0(%rsi)
+	mov %r14, 8(%rsi)
+	mov %r13, 16(%rsi)
+	mov %r12, 24(%rsi)
+	mov %r11, 32(%rsi)
+	mov %r10, 40(%rsi)
+	mov %r9, 48(%rsi)
+	mov %r8, 56(%rsi)
+	mov %rbp, 64(%rsi)
+	mov %rdi, 72(%rsi)
+	mov %rsi, 80(%rsi)
+	mov %rdx, 88(%rsi)
+	mov %rcx, 96(%rsi)
+	mov %rbx, 104(%rsi)
+	mov %rax, 112(%rsi)
+
+	# 再開した時はswitch_contextからretしたのと同じ状態にする
+	mov (%rsp), %rax
+	mov %rax, 128(%rsi)
+	lea 8(%rsp), %rax
+	mov %rax, 152(%rsi)
+	xor %eax, %eax
+	mov %cs, %ax
+	mov %rax, 136(%rsi)
+	mov %ss, %ax
+	mov %rax, 160(%rsi)
+	pushfq
+	popq 144(%rsi)
+
+	mov %cr3, %rax
+	mov %rax, 168(%rsi)
+	fxsave 176(%rsi)
+
+	# restore_contextはスタックを切り替えるまでスタックに触れないので、ここでcurrentを手放してよい
+	movq $0, 688(%rsi)
+	jmp restore_context
+
+# APの起動コード。ap_trampoline_addrにコピーし、Startup IPIでそこから実行させる
+# リアルモードからプロテクトモードを経てロングモードに入り、ap_trampoline_paramsのentryを呼ぶ
+# コピー先で動くので、アドレスはすべてap_trampoline_addrからの位置で書く
+	.set ap_trampoline_addr, 0x8000
+	.align 16
+	.code16
+.global ap_trampoline_begin
+ap_trampoline_begin:
+	cli
+	xor %ax, %ax
+	mov %ax, %ds
+	lgdtl ap_trampoline_addr + (ap_trampoline_gdtr - ap_trampoline_begin)
+	mov %cr0, %eax
+	or $1, %eax
+	mov %eax, %cr0
+	ljmpl $0x08, $ap_trampoline_addr + (ap_trampoline_32 - ap_trampoline_begin)
+
+	.code32
+ap_trampoline_32:
+	mov $0x10, %ax
+	mov %ax, %ds
+	mov %ax, %es
+	mov %ax, %ss
+	# PAEを有効にしてBSPと同じページテーブルを使う
+	mov %cr4, %eax
+	or $0x20, %eax
+	mov %eax, %cr4
+	mov ap_trampoline_addr + (ap_trampoline_cr3 - ap_trampoline_begin), %eax
+	mov %eax, %cr3
+	# EFERのLMEとNXEをBSPと揃える
+	mov $0xc0000080, %ecx
+	mov ap_trampoline_addr + (ap_trampoline_efer - ap_trampoline_begin), %eax
+	xor %edx, %edx
+	wrmsr
+	# ページングを有効にするとロングモードに入る
+	mov %cr0, %eax
+	or $0x80000000, %eax
+	mov %eax, %cr0
+	ljmp $0x18, $ap_trampoline_addr + (ap_trampoline_64 - ap_trampoline_begin)
+
+	.code64
+ap_trampoline_64:
+	xor %eax, %eax
+	mov %ax, %ds
+	mov %ax, %es
+	mov %ax, %ss
+	# CR0とCR4をBSPと揃える(キャッシュ、書き込み保護、SSE、PGE、PCIDEなど)
+	mov ap_trampoline_addr + (ap_trampoline_cr4 - ap_trampoline_begin), %rax
+	mov %rax, %cr4
+	mov ap_trampoline_addr + (ap_trampoline_cr0 - ap_trampoline_begin), %rax
+	mov %rax, %cr0
+	mov ap_trampoline_addr + (ap_trampoline_stack_end - ap_trampoline_begin), %rsp
+	mov ap_trampoline_addr + (ap_trampoline_entry - ap_trampoline_begin), %rax
+	call *%rax
+ap_trampoline_halt:
+	hlt
+	jmp ap_trampoline_halt
+
+	.align 8
+ap_trampoline_gdt:
+	.quad 0
+	# 32ビットコード
+	.quad 0x00cf9a000000ffff
+	# データ
+	.quad 0x00cf92000000ffff
+	# 64ビットコード
+	.quad 0x00af9a000000ffff
+ap_trampoline_gdtr:
+	.word ap_trampoline_gdtr - ap_trampoline_gdt - 1
+	.long ap_trampoline_addr + (ap_trampoline_gdt - ap_trampoline_begin)
+
+# BSPが書き込む引数。smp.cppのTrampolineParamsと並びを合わせる
+	.align 8
+.global ap_trampoline_params
+ap_trampoline_params:
+ap_trampoline_cr3:
+	.quad 0
+ap_trampoline_efer:
+	.quad 0
+ap_trampoline_cr0:
+	.quad 0
+ap_trampoline_cr4:
+	.quad 0
+ap_trampoline_stack_end:
+	.quad 0
+ap_trampoline_entry:
+	.quad 0
+.global ap_trampoline_end
+ap_trampoline_end:
@@ -0,0 +1,404 @@
+#include "benchmark.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "cpu.hpp"
+#include "graphics/buffer_layer.hpp"
+#include "graphics/compositor.hpp"
+#include "graphics/frame_buffer.hpp"
+#include "graphics/graphics.hpp"
+#include "graphics/layer_ids.hpp"
+#include "graphics/layer_manager.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "message.hpp"
+#include "paging.hpp"
+#include "task.hpp"
+#include "tlb.hpp"
+#include "tsc.hpp"
+
+namespace {
+	constexpr int switch_iterations = 10000;
+	constexpr std::size_t switch_touched_pages = 64;
+
+	void touch_pages(std::uint64_t base, std::size_t num_pages) {
+		for (std::size_t i = 0; i < num_pages; ++i) {
+			*reinterpret_cast<volatile std::uint64_t*>(base + i * page_size_4k);
+		}
+	}
+
+	std::uint64_t measure_switch(std::uint64_t other_table, std::uint64_t pages, bool flush) {
+		const auto kernel_table = kernel_page_table();
+
+		const auto start = tsc::now();
+		for (int i = 0; i < switch_iterations; ++i) {
+			switch_page_table(other_table, 1, flush);
+			touch_pages(pages, switch_touched_pages);
+			switch_page_table(kernel_table, 0, flush);
+			touch_pages(pages, switch_touched_pages);
+		}
+		return tsc::now() - start;
+	}
+
+	constexpr int flood_bursts = 100;
+	constexpr int flood_moves_per_burst = 64;
+
+	// 入力のイベントが届いてから画面に反映するまでの時間(ns)
+	struct FloodLatency {
+		std::uint64_t avg_ns;
+		std::uint64_t max_ns;
+	};
+
+	// マウスの移動イベントが連続して届いた時のメインループを模す
+	// イベントごとにMessage::arg.mouse.timestampを付けてキューに積み、取り出して反映してからpresent()を終えるまでを測る
+	// batchでなければイベントごとに画面に反映する
+	FloodLatency measure_mouse_flood(bool batch) {
+		using graphics::layer_manager;
+		namespace layer_ids = graphics::layer_ids;
+
+		MessageQueue queue;
+		std::uint64_t total_ns = 0;
+		std::uint64_t max_ns = 0;
+		const auto add_latency = [&](std::uint64_t timestamp) {
+			const auto latency = tsc::now() - timestamp;
+			total_ns += latency;
+			max_ns = std::max(max_ns, latency);
+		};
+
+		layer_manager->set_frame_paced(true);
+		for (int burst = 0; burst < flood_bursts; ++burst) {
+			// dx, dyには動かす先の座標を入れる
+			for (int i = 0; i < flood_moves_per_burst; ++i) {
+				Message msg{Message::Type::MouseMove};
+				msg.arg.mouse.timestamp = tsc::now();
+				msg.arg.mouse.dx = i;
+				msg.arg.mouse.dy = (burst + i) % 32;
+				queue.push(msg);
+			}
+
+			std::array<std::uint64_t, flood_moves_per_burst> timestamps;
+			int num_moves = 0;
+			if (batch) {
+				layer_manager->begin_batch();
+			}
+			while (const auto msg = queue.pop()) {
+				layer_manager->move(layer_ids::mouse, {200 + msg->arg.mouse.dx, 200 + msg->arg.mouse.dy});
+				if (batch) {
+					timestamps[num_moves++] = msg->arg.mouse.timestamp;
+				} else {
+					layer_manager->present();
+					add_latency(msg->arg.mouse.timestamp);
+				}
+			}
+			if (batch) {
+				layer_manager->end_batch();
+				layer_manager->present();
+				for (int i = 0; i < num_moves; ++i) {
+					add_latency(timestamps[i]);
+				}
+			}
+		}
+		layer_manager->set_frame_paced(false);
+
+		return {total_ns / (flood_bursts * flood_moves_per_burst), max_ns};
+	}
+
+	constexpr int shootdown_iterations = 1000;
+	constexpr std::size_t shootdown_max_pages = 64;
+
+	std::array<std::uint64_t, shootdown_max_pages> shootdown_frames;
+
+	constexpr int tile_frames = 50;
+	constexpr int tile_size = 128;
+	constexpr std::uint32_t tile_transparent_color = 0xff00ff;
+
+	// タイルのジョブが共有する状態。ジョブはそれぞれ別の領域に書くので排他しない
+	struct TileJobs {
+		const graphics::FrameBuffer* src;
+		graphics::FrameBuffer* dst;
+		int columns;
+		std::atomic<int> remaining;
+		Task* waiter;
+	};
+
+	TileJobs tile_jobs;
+
+	void compose_tile(std::uint64_t index) {
+		const auto& jobs = tile_jobs;
+		const graphics::Vector2D<int> pos{
+			static_cast<int>(index % jobs.columns) * tile_size,
+			static_cast<int>(index / jobs.columns) * tile_size};
+		jobs.dst->copy_from(*jobs.src, pos, pos, {tile_size, tile_size}, graphics::PixelColor{tile_transparent_color});
+
+		if (tile_jobs.remaining.fetch_sub(1) == 1) {
+			TaskManager::wakeup(*tile_jobs.waiter);
+		}
+	}
+
+	// affinityのCPUだけでtile_frames回の合成を終えるまでの時間。タスクを作れなければ0
+	std::uint64_t measure_tile_jobs(int num_tiles, std::uint64_t affinity) {
+		const auto start = tsc::now();
+		for (int frame = 0; frame < tile_frames; ++frame) {
+			tile_jobs.remaining.store(num_tiles);
+			for (int i = 0; i < num_tiles; ++i) {
+				if (TaskManager::new_task("tile", compose_tile, i, TaskPriority::Normal, affinity) == nullptr) {
+					return 0;
+				}
+			}
+
+			// 最後のジョブに起こされるまで待つ。眠っている間はこのCPUもジョブを実行する
+			while (true) {
+				__asm__("cli");
+				if (tile_jobs.remaining.load() == 0) {
+					break;
+				}
+				TaskManager::sleep();
+				__asm__("sti");
+			}
+			__asm__("sti");
+		}
+		return tsc::now() - start;
+	}
+
+	// 4Kの画面に、半分ほどが透明色の大きなレイヤーをずらして重ねて合成する
+	constexpr graphics::Vector2D<int> compose_screen_size{3840, 2160};
+	constexpr int compose_layers = 4;
+	constexpr int compose_frames = 20;
+	constexpr std::array<int, 4> compose_workers{1, 2, 4, 8};
+
+	// 高さstripeごとに不透明な帯と透明色の帯を交互に塗る
+	void paint_stripes(graphics::BufferLayer& layer, int stripe, graphics::PixelColor color) {
+		auto painter = layer.start_paint();
+		const auto size = painter.size();
+		for (int y = 0; y < size.y; y += stripe) {
+			const auto c = (y / stripe) % 2 == 0 ? color : graphics::PixelColor{tile_transparent_color};
+			painter.draw_filled_rectangle({0, y, size.x, std::min(y + stripe, size.y)}, c);
+		}
+	}
+
+	Error map_shootdown_pages(std::uint64_t virt_addr, std::size_t num_pages) {
+		for (std::size_t i = 0; i < num_pages; ++i) {
+			const auto flags = PageFlag::writable | PageFlag::no_execute;
+			if (auto err = map_page(virt_addr + i * page_size_4k, shootdown_frames[i], flags)) {
+				return err;
+			}
+		}
+		return Error::Code::Success;
+	}
+}
+
+void benchmark::run_address_space_switch() {
+	const auto other_table = clone_kernel_page_table();
+	if (other_table.error) {
+		log->error(u8"benchmark: clone_kernel_page_table(): %s\n", other_table.error.name());
+		return;
+	}
+
+	// タスク固有のマッピングを模してグローバルでないページを用意する
+	const auto pages = reserve_demand_zero_region(switch_touched_pages * page_size_4k);
+	if (pages.error) {
+		log->error(u8"benchmark: reserve_demand_zero_region(): %s\n", pages.error.name());
+		return;
+	}
+
+	for (std::size_t i = 0; i < switch_touched_pages; ++i) {
+		const auto frame = memory_manager->allocate(1);
+		if (frame.error) {
+			log->error(u8"benchmark: allocate(): %s\n", frame.error.name());
+			return;
+		}
+
+		const auto phys_addr = reinterpret_cast<std::uint64_t>(frame.value.frame());
+		map_page(pages.value + i * page_size_4k, phys_addr, PageFlag::writable | PageFlag::no_execute);
+	}
+
+	log->info(
+		u8"benchmark: address space switch x%d, %lu pages, PCID %s\n",
+		switch_iterations,
+		switch_touched_pages,
+		is_pcid_enabled() ? u8"enabled" : u8"disabled");
+
+	const auto flush = measure_switch(other_table.value, pages.value, true);
+	log->info(u8"  flush:    %lu ns\n", flush);
+
+	if (is_pcid_enabled()) {
+		const auto no_flush = measure_switch(other_table.value, pages.value, false);
+		log->info(u8"  no flush: %lu ns\n", no_flush);
+	}
+}
+
+void benchmark::run_tlb_shootdown() {
+	const auto pages = reserve_demand_zero_region(shootdown_max_pages * page_size_4k);
+	if (pages.error) {
+		log->error(u8"benchmark: reserve_demand_zero_region(): %s\n", pages.error.name());
+		return;
+	}
+
+	// 毎回同じフレームをマップし直す
+	for (auto& frame_addr : shootdown_frames) {
+		const auto frame = memory_manager->allocate(1);
+		if (frame.error) {
+			log->error(u8"benchmark: allocate(): %s\n", frame.error.name());
+			return;
+		}
+		frame_addr = reinterpret_cast<std::uint64_t>(frame.value.frame());
+	}
+
+	log->info(u8"benchmark: unmap + TLB shootdown x%d, %d CPUs\n", shootdown_iterations, cpu::online_count());
+
+	for (std::size_t num_pages : {1, 8, 64}) {
+		std::uint64_t total = 0;
+		for (int i = 0; i < shootdown_iterations; ++i) {
+			if (auto err = map_shootdown_pages(pages.value, num_pages)) {
+				log->error(u8"benchmark: map_page(): %s\n", err.name());
+				return;
+			}
+
+			// TLBにエントリが載った状態にする
+			for (std::size_t p = 0; p < num_pages; ++p) {
+				*reinterpret_cast<volatile std::uint64_t*>(pages.value + p * page_size_4k);
+			}
+
+			const auto start = tsc::now();
+			unmap_pages(pages.value, num_pages);
+			total += tsc::now() - start;
+		}
+
+		log->info(u8"  %2lu pages: %lu ns/unmap\n", num_pages, total / shootdown_iterations);
+	}
+}
+
+void benchmark::run_mouse_flood() {
+	log->info(u8"benchmark: %d mouse moves per burst x%d\n", flood_moves_per_burst, flood_bursts);
+	const auto unbatched = measure_mouse_flood(false);
+	log->info(u8"  unbatched: event to screen avg %lu ns, max %lu ns\n", unbatched.avg_ns, unbatched.max_ns);
+	const auto batched = measure_mouse_flood(true);
+	log->info(u8"  batched:   event to screen avg %lu ns, max %lu ns\n", batched.avg_ns, batched.max_ns);
+}
+
+void benchmark::run_tile_jobs() {
+	const auto size = graphics::screen_size;
+	const graphics::FrameBufferConfig config(size.x, size.y, graphics::PixelFormat::BGRResv8BitPerColor);
+	graphics::FrameBuffer src(config);
+	graphics::FrameBuffer dst(config);
+
+	// 半分ほどが透明色になる模様を描いておく
+	for (int y = 0; y < size.y; ++y) {
+		for (int x = 0; x < size.x; ++x) {
+			const auto color = ((x ^ y) & 16) != 0 ? tile_transparent_color : static_cast<std::uint32_t>(x * y);
+			src.writer().write(x, y, graphics::PixelColor{color});
+		}
+	}
+
+	const int columns = (size.x + tile_size - 1) / tile_size;
+	const int rows = (size.y + tile_size - 1) / tile_size;
+	const int num_tiles = columns * rows;
+	tile_jobs.src = &src;
+	tile_jobs.dst = &dst;
+	tile_jobs.columns = columns;
+	tile_jobs.waiter = &TaskManager::current_task();
+
+	log->info(
+		u8"benchmark: %d tile jobs (%dx%d) x%d frames, %d CPUs\n",
+		num_tiles,
+		tile_size,
+		tile_size,
+		tile_frames,
+		cpu::online_count());
+
+	// このタスクはBSPに固定されているので、CPU 0から順に使うCPUを倍にしていき、最後は全てのCPUで測る
+	const int online = cpu::online_count();
+	std::uint64_t single_ns = 0;
+	for (int num_cpus = 1;; num_cpus = std::min(num_cpus * 2, online)) {
+		const auto affinity = only_cpu(num_cpus) - 1;
+		const auto steals_before = current_task_manager()->statistics().stolen;
+
+		const auto elapsed = measure_tile_jobs(num_tiles, affinity);
+		if (elapsed == 0) {
+			log->error(u8"benchmark: failed to create a tile job\n");
+			return;
+		}
+		if (num_cpus == 1) {
+			single_ns = elapsed;
+		}
+
+		const auto jobs = static_cast<std::uint64_t>(num_tiles) * tile_frames;
+		log->info(
+			u8"  %2d CPUs: %lu jobs/s, x%lu.%02lu, %lu stolen from CPU 0\n",
+			num_cpus,
+			jobs * 1'000'000'000 / elapsed,
+			single_ns / elapsed,
+			single_ns * 100 / elapsed % 100,
+			current_task_manager()->statistics().stolen - steals_before);
+
+		if (num_cpus == online) {
+			break;
+		}
+	}
+}
+
+void benchmark::run_compositing() {
+	using graphics::BufferLayer;
+
+	const auto size = compose_screen_size;
+	const auto pixel_format = graphics::PixelFormat::BGRResv8BitPerColor;
+	graphics::FrameBuffer screen(graphics::FrameBufferConfig(size.x, size.y, pixel_format));
+	graphics::LayerManager manager(pixel_format);
+	manager.set_buffer(&screen);
+
+	const auto background = manager.new_layer<BufferLayer>(size);
+	paint_stripes(*background, size.y, graphics::desktop_bg_color);
+	manager.up_down(background->id(), 0);
+	for (int i = 0; i < compose_layers; ++i) {
+		const auto layer = manager.new_layer<BufferLayer>(graphics::Vector2D<int>{size.x * 3 / 4, size.y * 3 / 4});
+		layer->set_transparent_color(graphics::PixelColor{tile_transparent_color});
+		paint_stripes(*layer, 8 + i * 4, graphics::PixelColor{static_cast<std::uint32_t>(0x204060 * (i + 1))});
+		layer->move({i * size.x / 12, i * size.y / 12});
+		manager.up_down(layer->id(), i + 1);
+	}
+
+	log->info(
+		u8"benchmark: %dx%d, %d translucent layers x%d frames\n",
+		size.x,
+		size.y,
+		compose_layers,
+		compose_frames);
+
+	std::uint64_t single_ns = 0;
+	for (const int workers : compose_workers) {
+		if (workers > graphics::compositor::max_workers()) {
+			log->info(u8"  %d workers: skipped, %d CPUs online\n", workers, cpu::online_count());
+			continue;
+		}
+
+		graphics::compositor::set_num_workers(workers);
+		const auto start = tsc::now();
+		for (int frame = 0; frame < compose_frames; ++frame) {
+			manager.draw();
+		}
+		const auto elapsed = tsc::now() - start;
+		if (workers == 1) {
+			single_ns = elapsed;
+		}
+
+		log->info(
+			u8"  %d workers: %lu us/frame, x%lu.%02lu\n",
+			workers,
+			elapsed / compose_frames / 1000,
+			single_ns / elapsed,
+			single_ns * 100 / elapsed % 100);
+	}
+	graphics::compositor::set_num_workers(graphics::compositor::max_workers());
+}
+
+void benchmark::run_all() {
+	run_address_space_switch();
+	run_tlb_shootdown();
+	run_mouse_flood();
+	run_tile_jobs();
+	run_compositing();
+}
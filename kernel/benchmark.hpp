@@ -0,0 +1,18 @@
+#pragma once
+
+// QEMU上で計測するためのカーネル内ベンチマーク
+// KERNEL_BENCHMARKを有効にしてビルドすると起動時に実行される
+namespace benchmark {
+	// ページテーブルを交互に切り替えながらページに触れ、アドレス空間切り替えのコストを測る
+	void run_address_space_switch();
+	// ページのマップを外してTLB shootdownが終わるまでの時間を起動済みのCPU数とともに測る
+	void run_tlb_shootdown();
+	// マウスの移動イベントを連続して送り、描画をまとめた場合とまとめない場合で画面に反映するまでの時間を比べる
+	void run_mouse_flood();
+	// 画面をタイルに分けて合成する短いタスクを大量に作り、使うCPUの数を変えてスループットを測る
+	void run_tile_jobs();
+	// 4Kの画面に半透明のレイヤーを重ねて合成し、合成に使うCPUの数を1, 2, 4, 8と変えて1フレームの時間を測る
+	void run_compositing();
+
+	void run_all();
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstdint>
+
+// ローダーがページ境界に読み込んで渡すファイル
+struct BootAssets {
+	const std::uint8_t* font;
+	std::uint64_t font_size;
+};
@@ -0,0 +1,42 @@
+#include "cpu.hpp"
+
+#include <array>
+#include <atomic>
+
+#include <asmfunc.hpp>
+
+namespace {
+	constexpr std::uint32_t msr_gs_base = 0xc000'0101;
+
+	std::array<cpu::PerCpu, cpu::max_count> per_cpu{};
+	std::atomic<int> num_online{0};
+}
+
+int cpu::register_online(std::uint8_t lapic_id) {
+	const int index = num_online.load();
+	if (index == max_count) {
+		return -1;
+	}
+
+	auto& data = per_cpu[index];
+	data.self = &data;
+	data.index = index;
+	data.lapic_id = lapic_id;
+	write_msr(msr_gs_base, reinterpret_cast<std::uint64_t>(&data));
+	kernel_interface::profile::per_cpu_ready = true;
+
+	num_online.store(index + 1);
+	return index;
+}
+
+int cpu::online_count() {
+	return num_online.load();
+}
+
+cpu::PerCpu& cpu::of(int index) {
+	return per_cpu[index];
+}
+
+std::uint8_t cpu::lapic_id_of(int index) {
+	return per_cpu[index].lapic_id;
+}
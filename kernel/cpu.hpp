@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include <kernel_interface/profile.hpp>
+#include <kernel_interface/trace.hpp>
+
+namespace cpu {
+	inline constexpr int max_count = 16;
+
+	// CPUごとのデータ。各CPUのGSベースが自分のPerCpuを指す
+	struct PerCpu {
+		// %gs:0から自分自身のアドレスを読めるようにする
+		PerCpu* self;
+		int index;
+		std::uint8_t lapic_id;
+		// kernel_interface::profile::count()で数える回数
+		std::array<std::uint64_t, kernel_interface::profile::num_events> events;
+		// KERNEL_TRACE()で記録するバッファ
+		kernel_interface::trace::Buffer* trace;
+	};
+
+	static_assert(offsetof(PerCpu, events) == kernel_interface::profile::per_cpu_events_offset);
+	static_assert(offsetof(PerCpu, trace) == kernel_interface::trace::per_cpu_trace_offset);
+
+	// CPUを起動済みとして登録し、GSベースを設定してCPU番号を返す
+	// セグメントレジスタを設定した後に、起動するCPUの上で1つずつ呼ぶ
+	int register_online(std::uint8_t lapic_id);
+	// 起動済みのCPUの数
+	int online_count();
+
+	// 実行中のCPUのデータ。register_online()の後でだけ使える
+	inline PerCpu& current() {
+		PerCpu* self;
+		__asm__ volatile("mov %%gs:0, %0" : "=r"(self));
+		return *self;
+	}
+	// 実行中のCPUの番号(0 <= 番号 < online_count())
+	inline int current_index() {
+		return current().index;
+	}
+	PerCpu& of(int index);
+	std::uint8_t lapic_id_of(int index);
+}
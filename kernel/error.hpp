@@ -13,11 +13,18 @@ public:
 		NoPCIMSI,
 		NoEnoughMemory,
 		UnknownPixelFormat,
+		NotMapped,
+		InvalidFormat,
+		NotFound,
 		LastOfCode,
 	};
 
 	Error(Code code) : code_{code} {}
 
+	bool operator==(Code code) const {
+		return code_ == code;
+	}
+
 	operator bool() const {
 		return this->code_ != Code::Success;
 	}
@@ -40,6 +47,10 @@ private:
 		u8"NotImplemented",
 		u8"NoPCIMSI",
 		u8"NoEnoughMemory",
+		u8"UnknownPixelFormat",
+		u8"NotMapped",
+		u8"InvalidFormat",
+		u8"NotFound",
 	};
 
 	Code code_;
@@ -0,0 +1,70 @@
+#include "exception.hpp"
+
+#include <cstdint>
+
+#include <asmfunc.hpp>
+
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "paging.hpp"
+#include "segment.hpp"
+
+namespace {
+	bool is_in_stack_guard(std::uint64_t addr) {
+		const auto guard = reinterpret_cast<std::uint64_t>(kernel_main_stack_guard);
+		return guard <= addr && addr < guard + page_size_4k;
+	}
+
+	__attribute__((interrupt)) void int_handler_page_fault(InterruptFrame* frame, std::uint64_t error_code) {
+		const auto fault_addr = get_cr2();
+		if (handle_page_fault(fault_addr, error_code)) {
+			return;
+		}
+
+		if (is_in_stack_guard(fault_addr)) {
+			log->error(u8"Kernel stack overflow\n");
+		}
+
+		log->panic(
+			u8"#PF at %016lx: error=%lx (P=%d W=%d U=%d I=%d) RIP=%016lx\n",
+			fault_addr,
+			error_code,
+			(error_code >> 0) & 1,
+			(error_code >> 1) & 1,
+			(error_code >> 2) & 1,
+			(error_code >> 4) & 1,
+			frame->rip);
+	}
+
+	__attribute__((interrupt)) void int_handler_nmi(InterruptFrame* frame) {
+		log->error(u8"NMI at RIP=%016lx\n", frame->rip);
+	}
+
+	// カーネルスタックが溢れて#PFを積めなかった時などに来るので、ISTの別のスタックで受ける
+	__attribute__((interrupt)) void int_handler_double_fault(InterruptFrame* frame, std::uint64_t error_code) {
+		if (is_in_stack_guard(frame->rsp) || is_in_stack_guard(get_cr2())) {
+			log->error(u8"Kernel stack overflow\n");
+		}
+
+		log->panic(u8"#DF: RIP=%016lx RSP=%016lx CR2=%016lx\n", frame->rip, frame->rsp, get_cr2());
+	}
+}
+
+void initialize_exception_handlers() {
+	set_idt_entry(
+		idt[InterruptVector::nmi],
+		make_idt_attr(DescriptorType::InterruptGate, 0, true, InterruptStackTable::nmi),
+		reinterpret_cast<std::uint64_t>(int_handler_nmi),
+		get_cs());
+	set_idt_entry(
+		idt[InterruptVector::double_fault],
+		make_idt_attr(DescriptorType::InterruptGate, 0, true, InterruptStackTable::double_fault),
+		reinterpret_cast<std::uint64_t>(int_handler_double_fault),
+		get_cs());
+	set_idt_entry(
+		idt[InterruptVector::page_fault],
+		make_idt_attr(DescriptorType::InterruptGate, 0),
+		reinterpret_cast<std::uint64_t>(int_handler_page_fault),
+		get_cs());
+	load_idt(sizeof(idt) - 1, reinterpret_cast<std::uintptr_t>(idt.data()));
+}
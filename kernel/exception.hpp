@@ -0,0 +1,4 @@
+#pragma once
+
+// CPU例外のハンドラをIDTに登録してIDTをロードする
+void initialize_exception_handlers();
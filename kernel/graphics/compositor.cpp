@@ -0,0 +1,138 @@
+#include "compositor.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#include "cpu.hpp"
+#include "logger.hpp"
+#include "task.hpp"
+
+using graphics::Rect;
+
+namespace {
+	using graphics::compositor::BandFunction;
+
+	// 今使っているピクセルフォーマットはどれも1pxが4byte
+	constexpr int bytes_per_pixel = 4;
+
+	// draw_bands()1回分の仕事。呼び出したCPUのスタックに置く
+	struct Job {
+		std::uint64_t generation;
+		Rect<int> rect;
+		int band_height;
+		int num_bands;
+		BandFunction draw_band;
+		const void* data;
+		// 次に取る帯の番号
+		std::atomic<int> next_band;
+	};
+
+	// 手伝うタスクに見せている仕事。無ければnullptr
+	std::atomic<Job*> current_job{nullptr};
+	// current_jobを読んでから使い終わるまでの間にいる手伝うタスクの数
+	// 呼び出したCPUはcurrent_jobを消した後にこれが0になるのを待ってから、スタックのJobを捨てる
+	std::atomic<int> busy_workers{0};
+	std::uint64_t next_generation = 1;
+
+	std::array<Task*, cpu::max_count> workers{};
+	int num_started_workers = 0;
+	std::atomic<int> num_active_workers{1};
+
+	// 帯が無くなるまで取って描く
+	void run_job(Job& job) {
+		while (true) {
+			const int band = job.next_band.fetch_add(1, std::memory_order_relaxed);
+			if (band >= job.num_bands) {
+				return;
+			}
+
+			const int top = job.rect.top + band * job.band_height;
+			const int bottom = std::min(top + job.band_height, job.rect.bottom);
+			job.draw_band(job.data, {job.rect.left, top, job.rect.right, bottom});
+		}
+	}
+
+	// dataは手伝うタスクの番号。呼び出したCPUを0として1から数える
+	void worker_main(std::uint64_t data) {
+		const int index = static_cast<int>(data);
+		std::uint64_t last_generation = 0;
+
+		while (true) {
+			__asm__("cli");
+			busy_workers.fetch_add(1);
+			const auto job = current_job.load();
+			if (job == nullptr || job->generation == last_generation || index >= num_active_workers.load()) {
+				busy_workers.fetch_sub(1);
+				TaskManager::sleep();
+				__asm__("sti");
+				continue;
+			}
+			__asm__("sti");
+
+			last_generation = job->generation;
+			run_job(*job);
+			busy_workers.fetch_sub(1);
+		}
+	}
+}
+
+void graphics::compositor::start_workers() {
+	for (int i = 1; i < cpu::online_count(); ++i) {
+		const auto task = TaskManager::new_task("compositor", worker_main, i, TaskPriority::High, only_cpu(i));
+		if (task == nullptr) {
+			break;
+		}
+		workers[num_started_workers++] = task;
+	}
+	num_active_workers = max_workers();
+	log->debug(u8"compositor: %d workers\n", num_active_workers.load());
+}
+
+int graphics::compositor::num_workers() {
+	return num_active_workers;
+}
+
+int graphics::compositor::max_workers() {
+	return num_started_workers + 1;
+}
+
+void graphics::compositor::set_num_workers(int n) {
+	num_active_workers = std::clamp(n, 1, max_workers());
+}
+
+void graphics::compositor::draw_bands(const Rect<int>& rect, BandFunction draw_band, const void* data) {
+	const int width = rect.width();
+	const int height = rect.height();
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+	if (width * height < min_parallel_pixels) {
+		draw_band(data, rect);
+		return;
+	}
+
+	const int band_height = std::max(min_band_height, static_cast<int>(band_bytes / (width * bytes_per_pixel)));
+	const int num_bands = (height + band_height - 1) / band_height;
+	Job job{next_generation++, rect, band_height, num_bands, draw_band, data, {0}};
+
+	// 1つのCPUでも帯に分けて描く方が、重ねる間に書き込み先がキャッシュから追い出されない
+	const int helpers = std::min(num_active_workers.load(), num_bands) - 1;
+	if (helpers <= 0) {
+		run_job(job);
+		return;
+	}
+
+	current_job = &job;
+	for (int i = 0; i < helpers; ++i) {
+		TaskManager::wakeup(*workers[i]);
+	}
+	run_job(job);
+
+	// 全ての帯は取られたので、これから来るタスクには見せない。取った帯を描き終えるまで待つ
+	current_job = nullptr;
+	while (busy_workers.load() != 0) {
+		__asm__("pause");
+	}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+
+#include "primitives.hpp"
+
+// レイヤーの合成を横長の帯に分けて、複数のCPUで並行に描く
+namespace graphics::compositor {
+	// 1つの帯に書き込む量の目安(byte)。全てのレイヤーを重ねる間、帯がL2キャッシュに収まるようにする
+	inline constexpr std::size_t band_bytes = 128 * 1024;
+	// 画面の幅が広くても帯を細かくしすぎない
+	inline constexpr int min_band_height = 8;
+	// これより画素の少ない範囲(マウスカーソルなど)は分けずに呼び出したCPUだけで描く
+	inline constexpr int min_parallel_pixels = 256 * 256;
+
+	// 帯を1つ描く関数。dataはdraw_bands()に渡したもの
+	using BandFunction = void (*)(const void* data, const Rect<int>& band);
+
+	// BSP以外の各CPUに合成を手伝うタスクを作る。呼ぶまでは全て呼び出したCPUで描く
+	// smp::start_application_processors()の後にBSPから呼ぶ
+	void start_workers();
+
+	// 合成に使うCPUの数(呼び出したCPUを含む)。既定はmax_workers()
+	int num_workers();
+	int max_workers();
+	// 1からmax_workers()の間に丸めて設定する。ベンチマーク用
+	void set_num_workers(int n);
+
+	// rectを帯に分けてdraw_band(data, band)を呼び、全ての帯を描き終えてから戻る
+	// 帯は呼び出したCPUと手伝うCPUが早い者勝ちで取って描くので、draw_bandは帯の外に書き込んではいけない
+	// 手伝うCPUではロックを取らずに呼ぶので、draw_bandの中でロックを取ったりログを出したりしない
+	// 同時に1つしか実行できないので、layer_lockを取って呼ぶ
+	void draw_bands(const Rect<int>& rect, BandFunction draw_band, const void* data);
+}
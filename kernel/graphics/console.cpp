@@ -3,6 +3,7 @@
 #include "console.hpp"
 #include "font.hpp"
 #include "layer.hpp"
+#include "profile.hpp"
 
 using graphics::Console;
 
@@ -15,6 +16,7 @@ void Console::set_pixel_writer(PixelWriter* writer) {
 }
 
 void Console::put_string(const char* s) {
+	profile::count<profile::Event::console_put_string>();
 	for (; *s != u8'\0'; ++s) {
 		if (*s == u8'\n') {
 			new_line();
@@ -81,6 +83,7 @@ FastConsole::FastConsole(const PixelColor& fg_color, const PixelColor& bg_color,
 }
 
 void FastConsole::put_string(const char* s) {
+	profile::count<profile::Event::console_put_string>();
 	auto painter = layer_.start_paint();
 
 	for (; *s != u8'\0'; ++s) {
@@ -2,21 +2,25 @@
 
 #include <cstdint>
 
-extern const std::uint8_t _binary_hankaku_bin_start;
-extern const std::uint8_t _binary_hankaku_bin_end;
-extern const std::uint8_t _binary_hankaku_bin_size;
-
 namespace {
+	const std::uint8_t* font_data = nullptr;
+	std::size_t font_size = 0;
+
 	const std::uint8_t* get_font(char c) {
 		auto index = 16 * static_cast<unsigned int>(c);
-		if (index >= reinterpret_cast<uintptr_t>(&_binary_hankaku_bin_size)) {
+		if (index + 16 > font_size) {
 			return nullptr;
 		}
 
-		return &_binary_hankaku_bin_start + index;
+		return font_data + index;
 	}
 }
 
+void graphics::initialize_font(const std::uint8_t* data, std::size_t size) {
+	font_data = data;
+	font_size = size;
+}
+
 void graphics::write_ascii(PixelWriter& writer, int x, int y, char c, const PixelColor& color) {
 	const auto font = get_font(c);
 	if (font == nullptr) {
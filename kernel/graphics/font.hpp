@@ -1,8 +1,14 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 #include "pixel_writer.hpp"
 
 namespace graphics {
+	// ローダーが読み込んだフォントを使う。呼ばれるまで文字は描画されない
+	void initialize_font(const std::uint8_t* data, std::size_t size);
+
 	void write_ascii(PixelWriter& writer, int x, int y, char c, const PixelColor& color);
 	void write_string(PixelWriter& writer, int x, int y, const char* s, const PixelColor& color);
 }
@@ -2,6 +2,8 @@
 
 #include <cstring>
 
+#include "profile.hpp"
+
 using graphics::Vector2D;
 
 namespace {
@@ -130,6 +132,7 @@ Error FrameBuffer::copy_from(
 	Vector2D<int> src_pos,
 	Vector2D<int> size,
 	std::optional<PixelColor> transparent_color) {
+	profile::count<profile::Event::frame_buffer_copy>();
 	if (src.config_.pixel_format != config_.pixel_format) {
 		return Error::Code::UnknownPixelFormat;
 	}
@@ -68,6 +68,8 @@ void graphics::initialize_graphics(
 	auto mouse_layer = make_mouse_layer(*layer_manager);
 	layer_ids::mouse = mouse_layer->id();
 	mouse_layer->move({200, 200});
+	// カーソルの遅れは目立つので、フレームを待たずに反映する
+	mouse_layer->set_immediate_present(true);
 
 	auto group_layer = layer_manager->new_layer<GroupLayer>(Vector2D<int>(500, 500));
 	layer_ids::group_layer = group_layer->id();
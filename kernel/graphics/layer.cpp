@@ -54,3 +54,11 @@ void Layer::set_draggable(bool draggable) {
 bool Layer::is_draggable() const {
 	return draggable_;
 }
+
+void Layer::set_immediate_present(bool immediate) {
+	immediate_present_ = immediate;
+}
+
+bool Layer::is_immediate_present() const {
+	return immediate_present_;
+}
@@ -39,11 +39,16 @@ namespace graphics {
 		void set_draggable(bool draggable);
 		bool is_draggable() const;
 
+		// trueならフレームの区切りを待たずに画面に反映する(マウスカーソルなど)
+		void set_immediate_present(bool immediate);
+		bool is_immediate_present() const;
+
 	protected:
 		LayerManager& manager_;
 		const LayerId id_;
 		Vector2D<int> pos_ = {0, 0};
 		std::optional<PixelColor> transparent_color_;
 		bool draggable_ = false;
+		bool immediate_present_ = false;
 	};
 }
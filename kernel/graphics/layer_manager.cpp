@@ -1,23 +1,48 @@
 #include "layer_manager.hpp"
 
+#include "compositor.hpp"
 #include "layer.hpp"
+#include "profile.hpp"
+#include "tsc.hpp"
+
+#include <algorithm>
+#include <utility>
 
 using graphics::Layer;
 using graphics::Rect;
 
+namespace {
+	// 帯ごとに重ねるレイヤーと描き先
+	struct BandContext {
+		graphics::FrameBuffer* buffer;
+		std::vector<Layer*>::const_iterator first;
+		std::vector<Layer*>::const_iterator last;
+	};
+
+	void draw_band(const void* data, const Rect<int>& band) {
+		const auto& context = *static_cast<const BandContext*>(data);
+		for (auto it = context.first; it != context.last; ++it) {
+			(*it)->draw_to(*context.buffer, band);
+		}
+	}
+}
+
 using graphics::LayerManager;
 
 LayerManager::LayerManager(PixelFormat pixel_format) : pixel_format_(pixel_format){};
 
 void LayerManager::set_buffer(FrameBuffer* buffer) {
+	Guard guard(layer_lock);
 	buffer_ = buffer;
 }
 
 void LayerManager::set_parent(Layer* parent) {
+	Guard guard(layer_lock);
 	parent_ = parent;
 }
 
 Layer* LayerManager::find_layer(LayerId id) const {
+	Guard guard(layer_lock);
 	const auto it = std::find_if(layers_.cbegin(), layers_.cend(), [id](const auto& elm) { return elm->id() == id; });
 	if (it == layers_.end()) {
 		return nullptr;
@@ -26,6 +51,7 @@ Layer* LayerManager::find_layer(LayerId id) const {
 }
 
 Layer* LayerManager::find_layer_by_position(Vector2D<int> pos, LayerId exclude_id) const {
+	Guard guard(layer_lock);
 	auto it = std::find_if(layer_stack_.crbegin(), layer_stack_.crend(), [pos, exclude_id](Layer* layer) {
 		if (layer->id() == exclude_id) {
 			return false;
@@ -55,14 +81,17 @@ LayerManager::find_layer_stack_itr(LayerId id, decltype(layer_stack_)::const_ite
 }
 
 void LayerManager::move(LayerId id, Vector2D<int> new_position) {
+	Guard guard(layer_lock);
 	find_layer(id)->move(new_position);
 }
 
 void LayerManager::move_relative(LayerId id, Vector2D<int> pos_diff) {
+	Guard guard(layer_lock);
 	find_layer(id)->move_relative(pos_diff);
 }
 
 void LayerManager::draw() const {
+	Guard guard(layer_lock);
 	if (buffer_ == nullptr) {
 		return;
 	}
@@ -71,24 +100,144 @@ void LayerManager::draw() const {
 }
 
 void LayerManager::draw_to(FrameBuffer& buffer) const {
-	for (const auto& layer : layer_stack_) {
-		layer->draw_to(buffer);
-	}
+	const BandContext context{&buffer, layer_stack_.cbegin(), layer_stack_.cend()};
+	compositor::draw_bands(Rect<int>::with_size({0, 0}, buffer.size()), draw_band, &context);
 }
 
 void LayerManager::damage(LayerId id, const std::vector<Rect<int>>& rects) const {
-	if (buffer_ == nullptr || rects.empty()) {
+	Guard guard(layer_lock);
+	profile::count<profile::Event::layer_damage>();
+	if (buffer_ == nullptr || rects.empty() || defer_damage(id, rects)) {
 		return;
 	}
 
-	draw_damage_to(*buffer_, id, merge_rects(rects));
+	compose({id}, merge_rects(rects));
 
 	if (parent_ != nullptr) {
 		parent_->damage(rects);
 	}
 }
 
-void LayerManager::draw_damage_to(FrameBuffer& buffer, LayerId id, const Rect<int>& rect) const {
+void LayerManager::begin_batch() {
+	Guard guard(layer_lock);
+	batching_ = true;
+}
+
+void LayerManager::end_batch() {
+	Guard guard(layer_lock);
+	batching_ = false;
+	flush_damages(frame_paced_);
+}
+
+void LayerManager::set_frame_paced(bool frame_paced) {
+	Guard guard(layer_lock);
+	frame_paced_ = frame_paced;
+	if (!frame_paced_) {
+		flush_damages(false);
+	}
+}
+
+void LayerManager::set_frame_request_handler(void (*handler)()) {
+	Guard guard(layer_lock);
+	frame_request_handler_ = handler;
+}
+
+void LayerManager::present() {
+	Guard guard(layer_lock);
+	if (pending_damages_.empty()) {
+		++frame_statistics_.frames;
+		++frame_statistics_.empty_frames;
+		return;
+	}
+
+	const auto start = tsc::now();
+	flush_damages(false);
+	const auto elapsed = tsc::now() - start;
+
+	++frame_statistics_.frames;
+	frame_statistics_.total_ns += elapsed;
+	if (elapsed > frame_statistics_.max_ns) {
+		frame_statistics_.max_ns = elapsed;
+	}
+}
+
+const graphics::FrameStatistics& LayerManager::frame_statistics() const {
+	return frame_statistics_;
+}
+
+void LayerManager::reset_frame_statistics() {
+	Guard guard(layer_lock);
+	frame_statistics_ = FrameStatistics{};
+}
+
+void LayerManager::flush_damages(bool immediate_only) {
+	// 描画中に新しいdamageが来ても壊れないように取り出してから描画する
+	std::vector<PendingDamage> damages;
+	if (immediate_only) {
+		auto deferred = std::stable_partition(
+			pending_damages_.begin(), pending_damages_.end(), [](const auto& elm) { return !elm.immediate; });
+		damages.assign(deferred, pending_damages_.end());
+		pending_damages_.erase(deferred, pending_damages_.end());
+	} else {
+		damages = std::move(pending_damages_);
+		pending_damages_.clear();
+		frame_requested_ = false;
+	}
+
+	if (damages.empty()) {
+		return;
+	}
+
+	// レイヤーごとに描き直すと重なった部分を何度も合成するので、全体を囲む1つの範囲を1回だけ合成する
+	std::vector<LayerId> ids;
+	ids.reserve(damages.size());
+	auto rect = damages[0].rect;
+	for (const auto& damage_entry : damages) {
+		ids.push_back(damage_entry.id);
+		rect = rect.merge(damage_entry.rect);
+	}
+
+	if (buffer_ != nullptr) {
+		compose(ids, rect);
+	}
+	if (parent_ != nullptr) {
+		parent_->damage({rect});
+	}
+}
+
+bool LayerManager::defer_damage(LayerId id, const std::vector<Rect<int>>& rects) const {
+	if (!batching_ && !frame_paced_) {
+		return false;
+	}
+
+	const auto layer = find_layer(id);
+	const bool immediate = layer != nullptr && layer->is_immediate_present();
+	// すぐに反映するレイヤーはバッチの終わりまでだけ溜める
+	if (immediate && !batching_) {
+		return false;
+	}
+
+	const auto rect = merge_rects(rects);
+	const auto it =
+		std::find_if(pending_damages_.begin(), pending_damages_.end(), [id](const auto& elm) { return elm.id == id; });
+	if (it == pending_damages_.end()) {
+		pending_damages_.push_back({id, rect, immediate});
+	} else {
+		it->rect = it->rect.merge(rect);
+	}
+
+	if (!immediate && frame_paced_ && !frame_requested_ && frame_request_handler_ != nullptr) {
+		frame_requested_ = true;
+		frame_request_handler_();
+	}
+	return true;
+}
+
+void LayerManager::compose(const std::vector<LayerId>& ids, const Rect<int>& rect) const {
+	draw_damage_to(*buffer_, ids, rect);
+}
+
+void LayerManager::draw_damage_to(FrameBuffer& buffer, const std::vector<LayerId>& ids, const Rect<int>& rect) const {
 	// 不透明でdamage範囲を完全に含む最前面のレイヤーiを探す
 	// それより背面にあるレイヤーはレイヤーiに隠されるので描画する必要が無い
 	auto i = layer_stack_.end();
@@ -104,14 +253,16 @@ void LayerManager::draw_damage_to(FrameBuffer& buffer, LayerId id, const Rect<in
 		}
 	}
 
-	// damageされたレイヤーがレイヤーi以上に前面になければ描画をスキップ
-	if (find_layer_stack_itr(id, i) == layer_stack_.end()) {
+	// damageされたレイヤーがどれもレイヤーi以上に前面になければ描画をスキップ
+	const auto visible = std::any_of(i, layer_stack_.cend(), [&ids](const Layer* layer) {
+		return std::find(ids.cbegin(), ids.cend(), layer->id()) != ids.cend();
+	});
+	if (!visible) {
 		return;
 	}
 
-	for (; i != layer_stack_.end(); ++i) {
-		(*i)->draw_to(buffer, rect);
-	}
+	const BandContext context{&buffer, i, layer_stack_.cend()};
+	compositor::draw_bands(rect, draw_band, &context);
 }
 
 Rect<int> LayerManager::merge_rects(const std::vector<Rect<int>>& rects) const {
@@ -123,6 +274,7 @@ Rect<int> LayerManager::merge_rects(const std::vector<Rect<int>>& rects) const {
 };
 
 void LayerManager::hide(LayerId id) {
+	Guard guard(layer_lock);
 	const auto pos = find_layer_stack_itr(id);
 	if (pos != layer_stack_.end()) {
 		layer_stack_.erase(pos);
@@ -130,6 +282,7 @@ void LayerManager::hide(LayerId id) {
 }
 
 void LayerManager::up_down(LayerId id, int new_height) {
+	Guard guard(layer_lock);
 	if (new_height < 0) {
 		hide(id);
 		return;
@@ -164,6 +317,7 @@ void LayerManager::up_down(LayerId id, int new_height) {
 using graphics::DoubleBufferedLayerManager;
 
 void DoubleBufferedLayerManager::set_buffer(FrameBuffer* buffer) {
+	Guard guard(layer_lock);
 	if (buffer == nullptr) {
 		back_buffer_.reset();
 	} else {
@@ -174,6 +328,7 @@ void DoubleBufferedLayerManager::set_buffer(FrameBuffer* buffer) {
 }
 
 void DoubleBufferedLayerManager::draw() const {
+	Guard guard(layer_lock);
 	if (buffer_ == nullptr) {
 		return;
 	}
@@ -182,16 +337,7 @@ void DoubleBufferedLayerManager::draw() const {
 	buffer_->forward(*back_buffer_);
 }
 
-void DoubleBufferedLayerManager::damage(LayerId id, const std::vector<Rect<int>>& rects) const {
-	if (buffer_ == nullptr || rects.empty()) {
-		return;
-	}
-
-	auto merged_rect = merge_rects(rects);
-	draw_damage_to(*back_buffer_, id, merged_rect);
-	buffer_->copy_from(*back_buffer_, merged_rect.top_left(), merged_rect.top_left(), merged_rect.size(), std::nullopt);
-
-	if (parent_ != nullptr) {
-		parent_->damage(rects);
-	}
+void DoubleBufferedLayerManager::compose(const std::vector<LayerId>& ids, const Rect<int>& rect) const {
+	draw_damage_to(*back_buffer_, ids, rect);
+	buffer_->copy_from(*back_buffer_, rect.top_left(), rect.top_left(), rect.size(), std::nullopt);
 }
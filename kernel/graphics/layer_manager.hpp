@@ -2,12 +2,29 @@
 
 #include "frame_buffer.hpp"
 #include "layer.hpp"
+#include "sync.hpp"
 
+#include <cstdint>
 #include <memory>
 #include <utility>
 #include <vector>
 
 namespace graphics {
+	// present()1回ごとの描画時間の集計
+	struct FrameStatistics {
+		std::uint64_t frames = 0;
+		// 描画するものが無かったフレーム
+		std::uint64_t empty_frames = 0;
+		std::uint64_t total_ns = 0;
+		std::uint64_t max_ns = 0;
+	};
+
+	// 全てのLayerManagerで共有するロック
+	// GroupLayerの中のLayerManagerと外のLayerManagerは互いに呼び合うので、別々のロックにすると取る順番が食い違う
+	// 描画の途中から同じLayerManagerに戻ってくることがあるので、同じCPUなら入れ子に取れるものにする
+	inline sync::RecursiveSpinLock layer_lock{"layer_manager"};
+
+	// 公開しているメンバ関数はlayer_lockを取ってから状態に触る。別のタスクやCPUから呼んでもよい
 	class LayerManager {
 	public:
 		LayerManager(PixelFormat pixel_format);
@@ -17,6 +34,7 @@ namespace graphics {
 
 		template <typename T, typename... Args>
 		T* new_layer(Args&&... args) {
+			Guard guard(layer_lock);
 			++latest_id_;
 			auto layer = std::make_unique<T>(*this, latest_id_, pixel_format_, std::forward<Args>(args)...);
 			auto layer_raw_ptr = layer.get();
@@ -39,14 +57,37 @@ namespace graphics {
 		// rectsはこのLayerManagerの座標空間
 		virtual void damage(LayerId id, const std::vector<Rect<int>>& rects) const;
 
+		// end_batch()までのdamageを溜めておき、全てのレイヤーの範囲をまとめて1回だけ描画する
+		void begin_batch();
+		void end_batch();
+
+		// trueにすると、is_immediate_present()でないレイヤーのdamageはpresent()まで画面に反映しない
+		void set_frame_paced(bool frame_paced);
+		// set_frame_paced(true)の間に、present()を待つdamageが溜まり始めたら呼ぶ処理を設定する。フレームタイマを掛けるのに使う
+		// layer_lockを持ち、割り込みを禁止したまま呼ぶ
+		void set_frame_request_handler(void (*handler)());
+		// 溜まっているdamageを描画して画面に反映する。フレームタイマから呼ぶ
+		void present();
+		const FrameStatistics& frame_statistics() const;
+		void reset_frame_statistics();
+
 	protected:
+		// 割り込みハンドラや優先度の高いタスクからのログの出力もレイヤーを描くので、割り込みを禁止して持つ
+		using Guard = sync::IrqSaveLockGuard<sync::RecursiveSpinLock>;
+
 		FrameBuffer* buffer_ = nullptr;
 		Layer* parent_ = nullptr;
 		std::vector<Layer*> layer_stack_{};
 
+		// 範囲を帯に分け、compositorで複数のCPUに並行して描かせる
 		void draw_to(FrameBuffer& buffer) const;
-		void draw_damage_to(FrameBuffer& buffer, LayerId id, const Rect<int>& rects) const;
+		// idsのレイヤーのどれかがrectで見えていれば、rectの範囲を描き直す
+		void draw_damage_to(FrameBuffer& buffer, const std::vector<LayerId>& ids, const Rect<int>& rect) const;
+		// draw_damage_to()で描き直して画面に反映する。buffer_がある時に呼ぶ
+		virtual void compose(const std::vector<LayerId>& ids, const Rect<int>& rect) const;
 		Rect<int> merge_rects(const std::vector<Rect<int>>& rects) const;
+		// 今は描画しないdamageならrectsを溜めてtrueを返す
+		bool defer_damage(LayerId id, const std::vector<Rect<int>>& rects) const;
 
 	private:
 		const PixelFormat pixel_format_;
@@ -54,6 +95,23 @@ namespace graphics {
 		std::vector<std::unique_ptr<Layer>> layers_{};
 		LayerId latest_id_ = 0;
 
+		struct PendingDamage {
+			LayerId id;
+			Rect<int> rect;
+			bool immediate;
+		};
+
+		bool batching_ = false;
+		bool frame_paced_ = false;
+		void (*frame_request_handler_)() = nullptr;
+		// 溜まっているdamageのためにframe_request_handler_を呼んでから、まだpresent()していない
+		mutable bool frame_requested_ = false;
+		mutable std::vector<PendingDamage> pending_damages_{};
+		FrameStatistics frame_statistics_{};
+
+		// 溜めたdamageの範囲を1つにまとめて描画する。immediate_onlyならis_immediate_present()なレイヤーの分だけにする
+		void flush_damages(bool immediate_only);
+
 		decltype(layer_stack_)::iterator find_layer_stack_itr(LayerId id);
 		decltype(layer_stack_)::iterator find_layer_stack_itr(LayerId id, decltype(layer_stack_)::iterator begin);
 		decltype(layer_stack_)::const_iterator
@@ -66,7 +124,7 @@ namespace graphics {
 		void set_buffer(FrameBuffer* buffer) override;
 
 		void draw() const override;
-		void damage(LayerId id, const std::vector<Rect<int>>& rects) const override;
+		void compose(const std::vector<LayerId>& ids, const Rect<int>& rect) const override;
 
 	private:
 		mutable std::optional<FrameBuffer> back_buffer_;
@@ -48,7 +48,14 @@ void set_idt_entry(
 	std::uint16_t segment_selector);
 
 namespace InterruptVector {
-	inline constexpr std::size_t xhci = 0x40;
+	inline constexpr std::size_t nmi = 0x02;
+	inline constexpr std::size_t double_fault = 0x08;
+	inline constexpr std::size_t page_fault = 0x0e;
+	inline constexpr std::size_t lapic_timer = 0x41;
+	inline constexpr std::size_t tlb_shootdown = 0xf0;
+	inline constexpr std::size_t task_wakeup = 0xf1;
+	inline constexpr std::size_t profile_sample = 0xf2;
+	inline constexpr std::size_t spurious = 0xff;
 };
 
 struct InterruptFrame {
@@ -60,3 +67,26 @@ struct InterruptFrame {
 };
 
 __attribute__((no_caller_saved_registers)) void notify_end_of_interrput();
+
+// 割り込みハンドラと同時に触らないように、スコープの間だけ割り込みを禁止する
+// 元から禁止されていれば抜ける時も禁止のままにする
+class InterruptGuard {
+public:
+	InterruptGuard() {
+		__asm__ volatile("pushfq; popq %0; cli" : "=r"(rflags_)::"memory");
+	}
+
+	~InterruptGuard() {
+		if (was_enabled()) {
+			__asm__ volatile("sti" ::: "memory");
+		}
+	}
+
+	// 作る前に割り込みが許可されていたらtrue
+	bool was_enabled() const {
+		return (rflags_ & (1u << 9)) != 0;
+	}
+
+private:
+	std::uint64_t rflags_;
+};
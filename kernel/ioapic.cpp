@@ -0,0 +1,107 @@
+#include "ioapic.hpp"
+
+#include <asmfunc.hpp>
+
+#include "acpi.hpp"
+#include "logger.hpp"
+#include "sync.hpp"
+
+namespace {
+	// 8259 PICのマスクレジスタ
+	constexpr std::uint16_t pic_master_data = 0x21;
+	constexpr std::uint16_t pic_slave_data = 0xa1;
+
+	// IOREGSELに書いたレジスタをIOWINから読み書きする
+	constexpr std::uint64_t ioregsel_offset = 0x00;
+	constexpr std::uint64_t iowin_offset = 0x10;
+
+	constexpr std::uint32_t reg_version = 0x01;
+	// 入力nのリダイレクションエントリはreg_redirection + 2n(下位)と+ 2n + 1(上位)
+	constexpr std::uint32_t reg_redirection = 0x10;
+
+	// リダイレクションエントリの下位32ビット。配送は固定、宛先は物理モード
+	constexpr std::uint32_t redirection_active_low = 1u << 13;
+	constexpr std::uint32_t redirection_level_triggered = 1u << 15;
+	constexpr std::uint32_t redirection_masked = 1u << 16;
+
+	std::uint64_t base;
+	std::uint32_t gsi_base;
+	int num_inputs;
+	// 選んでから読み書きするまでの間に他のCPUに選び直させない
+	sync::SpinLock lock{"ioapic"};
+
+	std::uint32_t read(std::uint32_t reg) {
+		*reinterpret_cast<volatile std::uint32_t*>(base + ioregsel_offset) = reg;
+		return *reinterpret_cast<volatile std::uint32_t*>(base + iowin_offset);
+	}
+
+	void write(std::uint32_t reg, std::uint32_t value) {
+		*reinterpret_cast<volatile std::uint32_t*>(base + ioregsel_offset) = reg;
+		*reinterpret_cast<volatile std::uint32_t*>(base + iowin_offset) = value;
+	}
+
+	void write_redirection(int input, std::uint32_t low, std::uint32_t high) {
+		sync::IrqSaveLockGuard guard(lock);
+		// 書き換える途中の設定で割り込みが届かないように、マスクしてから宛先を書き換える
+		write(reg_redirection + 2 * input, redirection_masked);
+		write(reg_redirection + 2 * input + 1, high);
+		write(reg_redirection + 2 * input, low);
+	}
+
+	// irqのつながっている入力の番号。このI/O APICの入力でなければ-1
+	int input_of(std::uint8_t irq) {
+		if (base == 0 || irq >= acpi::num_isa_irqs) {
+			return -1;
+		}
+
+		const auto gsi = acpi::isa_irq_route(irq).gsi;
+		if (gsi < gsi_base || gsi - gsi_base >= static_cast<std::uint32_t>(num_inputs)) {
+			return -1;
+		}
+		return gsi - gsi_base;
+	}
+}
+
+Error ioapic::initialize() {
+	io_out_8(pic_master_data, 0xff);
+	io_out_8(pic_slave_data, 0xff);
+
+	base = acpi::ioapic_address();
+	if (base == 0) {
+		return Error::Code::NotFound;
+	}
+	gsi_base = acpi::ioapic_gsi_base();
+	num_inputs = ((read(reg_version) >> 16) & 0xff) + 1;
+
+	for (int input = 0; input < num_inputs; ++input) {
+		write_redirection(input, redirection_masked, 0);
+	}
+
+	log->debug(u8"I/O APIC at %08lx: GSI %u-%u\n", base, gsi_base, gsi_base + num_inputs - 1);
+	return Error::Code::Success;
+}
+
+Error ioapic::route_isa_irq(std::uint8_t irq, std::uint8_t vector, std::uint8_t apic_id) {
+	const int input = input_of(irq);
+	if (input < 0) {
+		return Error::Code::NotFound;
+	}
+
+	const auto route = acpi::isa_irq_route(irq);
+	std::uint32_t low = vector;
+	if (route.active_low) {
+		low |= redirection_active_low;
+	}
+	if (route.level_triggered) {
+		low |= redirection_level_triggered;
+	}
+	write_redirection(input, low, static_cast<std::uint32_t>(apic_id) << 24);
+	return Error::Code::Success;
+}
+
+void ioapic::mask_isa_irq(std::uint8_t irq) {
+	const int input = input_of(irq);
+	if (input >= 0) {
+		write_redirection(input, redirection_masked, 0);
+	}
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+
+// I/O APICでデバイスの割り込み線をLocal APICに届ける
+namespace ioapic {
+	// 最初のI/O APICの全ての入力をマスクし、使わない8259 PICもマスクする
+	// acpi::initialize()の後にBSPから呼ぶ。I/O APICが無ければNotFound
+	Error initialize();
+
+	// ISAの割り込みirqを、apic_idのCPUのvectorに届ける
+	// MADTのInterrupt Source Overrideに従って入力の番号と極性、トリガを決める
+	Error route_isa_irq(std::uint8_t irq, std::uint8_t vector, std::uint8_t apic_id);
+	void mask_isa_irq(std::uint8_t irq);
+}
@@ -0,0 +1,209 @@
+#include "irq.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+#include <asmfunc.hpp>
+
+#include "cpu.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "segment.hpp"
+#include "task.hpp"
+#include "tsc.hpp"
+
+namespace {
+	constexpr std::size_t stub_size = 16;
+	volatile std::uint32_t& spurious_interrupt_vector = *reinterpret_cast<std::uint32_t*>(0xfee000f0);
+	constexpr std::uint32_t apic_software_enable = 1u << 8;
+
+	struct Entry {
+		irq::Handler handler;
+		void* context;
+	};
+
+	// 1つのCPUの1つのベクタの集計。書き込むのはそのCPUの割り込みハンドラだけで、max_nsだけは集計する側が0に戻す
+	struct Counters {
+		std::atomic<std::uint64_t> count;
+		std::atomic<std::uint64_t> last_timestamp;
+		std::atomic<std::uint64_t> total_ns;
+		std::atomic<std::uint64_t> max_ns;
+	};
+
+	// 他のCPUと同じキャッシュラインを取り合わないようにCPUごとに分ける
+	struct alignas(64) PerCpu {
+		std::array<Counters, 256> vectors;
+		std::atomic<std::uint64_t> num_spurious;
+		std::atomic<std::uint64_t> num_unhandled;
+	};
+
+	std::array<Entry, 256> entries{};
+	std::array<PerCpu, cpu::max_count> per_cpu{};
+	// log_statistics()で前回出力した時の全CPUの合計
+	std::array<irq::Statistics, 256> reported{};
+	std::array<const InterruptContext*, cpu::max_count> interrupted_contexts{};
+
+	// 書き込むのは実行中のCPUだけなので、lockを付けずに足す
+	void add(std::atomic<std::uint64_t>& counter, std::uint64_t n) {
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+}
+
+extern "C" void irq_dispatch(InterruptContext* context, const void* fxsave_area) {
+	const auto vector = context->vector;
+	auto& self = per_cpu[cpu::current_index()];
+
+	// スプリアス割り込みにはEOIを送らない
+	if (vector == InterruptVector::spurious) {
+		add(self.num_spurious, 1);
+		return;
+	}
+
+	auto& entry = entries[vector];
+	if (entry.handler == nullptr) {
+		add(self.num_unhandled, 1);
+		notify_end_of_interrput();
+		return;
+	}
+
+	// 割り込みハンドラの中では割り込みを禁止しているので、CPUごとに1つ覚えておけば足りる
+	interrupted_contexts[cpu::current_index()] = context;
+
+	const auto start = tsc::now();
+	entry.handler(entry.context);
+	const auto elapsed = tsc::now() - start;
+
+	auto& counters = self.vectors[vector];
+	add(counters.count, 1);
+	counters.last_timestamp.store(start, std::memory_order_relaxed);
+	add(counters.total_ns, elapsed);
+	if (elapsed > counters.max_ns.load(std::memory_order_relaxed)) {
+		counters.max_ns.store(elapsed, std::memory_order_relaxed);
+	}
+
+	notify_end_of_interrput();
+
+	// ハンドラが優先度の高いタスクを起こしていれば、割り込まれたタスクに戻らずに切り替える
+	if (const auto manager = current_task_manager()) {
+		manager->on_interrupt_exit(*context, fxsave_area);
+	}
+}
+
+void irq::initialize() {
+	const auto stubs = reinterpret_cast<std::uint64_t>(irq_stub_table);
+	for (std::size_t vector = first_vector; vector < idt.size(); ++vector) {
+		set_idt_entry(
+			idt[vector],
+			make_idt_attr(DescriptorType::InterruptGate, 0, true, InterruptStackTable::irq),
+			stubs + (vector - first_vector) * stub_size,
+			get_cs());
+	}
+
+	initialize_local();
+}
+
+void irq::initialize_local() {
+	spurious_interrupt_vector = apic_software_enable | InterruptVector::spurious;
+}
+
+Error irq::register_handler(std::uint8_t vector, Handler handler, void* context) {
+	if (vector < first_vector || vector == InterruptVector::spurious) {
+		return Error::Code::IndexOutOfRange;
+	}
+
+	auto& entry = entries[vector];
+	if (entry.handler != nullptr) {
+		return Error::Code::Full;
+	}
+
+	// 登録されていないベクタの集計は増えないので、ここで0に戻しても取り合わない
+	for (auto& cpu : per_cpu) {
+		auto& counters = cpu.vectors[vector];
+		counters.count.store(0, std::memory_order_relaxed);
+		counters.last_timestamp.store(0, std::memory_order_relaxed);
+		counters.total_ns.store(0, std::memory_order_relaxed);
+		counters.max_ns.store(0, std::memory_order_relaxed);
+	}
+	reported[vector] = Statistics{};
+
+	entry.context = context;
+	entry.handler = handler;
+	return Error::Code::Success;
+}
+
+void irq::unregister_handler(std::uint8_t vector) {
+	entries[vector].handler = nullptr;
+}
+
+WithError<std::uint8_t> irq::allocate_vector(Handler handler, void* context) {
+	for (auto vector = dynamic_vector_begin; vector < dynamic_vector_end; ++vector) {
+		if (entries[vector].handler == nullptr) {
+			return {vector, register_handler(vector, handler, context)};
+		}
+	}
+	return {0, Error::Code::Full};
+}
+
+const InterruptContext& irq::interrupted_context() {
+	return *interrupted_contexts[cpu::current_index()];
+}
+
+irq::Statistics irq::statistics(std::uint8_t vector) {
+	Statistics total{};
+	for (int i = 0; i < cpu::online_count(); ++i) {
+		const auto& counters = per_cpu[i].vectors[vector];
+		total.count += counters.count.load(std::memory_order_relaxed);
+		total.last_timestamp = std::max(total.last_timestamp, counters.last_timestamp.load(std::memory_order_relaxed));
+		total.total_ns += counters.total_ns.load(std::memory_order_relaxed);
+		total.max_ns = std::max(total.max_ns, counters.max_ns.load(std::memory_order_relaxed));
+	}
+	return total;
+}
+
+std::uint64_t irq::spurious_count() {
+	std::uint64_t total = 0;
+	for (int i = 0; i < cpu::online_count(); ++i) {
+		total += per_cpu[i].num_spurious.load(std::memory_order_relaxed);
+	}
+	return total;
+}
+
+std::uint64_t irq::unhandled_count() {
+	std::uint64_t total = 0;
+	for (int i = 0; i < cpu::online_count(); ++i) {
+		total += per_cpu[i].num_unhandled.load(std::memory_order_relaxed);
+	}
+	return total;
+}
+
+void irq::log_statistics() {
+	for (std::size_t vector = first_vector; vector < entries.size(); ++vector) {
+		const auto total = statistics(vector);
+		auto& last = reported[vector];
+		const auto count = total.count - last.count;
+		if (count == 0) {
+			continue;
+		}
+
+		// 回数と実行時間は累計の差を取る。最大値だけは各CPUで0に戻して次の期間を測り直す
+		std::uint64_t max_ns = 0;
+		for (int i = 0; i < cpu::online_count(); ++i) {
+			max_ns = std::max(max_ns, per_cpu[i].vectors[vector].max_ns.exchange(0, std::memory_order_relaxed));
+		}
+
+		log->debug(
+			u8"IRQ %02lx: %lu times, avg %lu ns, max %lu ns\n",
+			vector,
+			count,
+			(total.total_ns - last.total_ns) / count,
+			max_ns);
+		last = total;
+	}
+
+	const auto num_spurious = spurious_count();
+	const auto num_unhandled = unhandled_count();
+	if (num_spurious != 0 || num_unhandled != 0) {
+		log->debug(u8"IRQ spurious: %lu, unhandled: %lu\n", num_spurious, num_unhandled);
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+
+struct InterruptContext;
+
+// 0x20番以降の割り込みを共通の入口で受け、登録されたハンドラに振り分ける
+// ハンドラは割り込み禁止の状態でISTの割り込み用スタックで呼ばれ、EOIは振り分ける側で送る
+namespace irq {
+	using Handler = void (*)(void* context);
+
+	inline constexpr std::uint8_t first_vector = 0x20;
+	// allocate_vector()で割り当てるベクタの範囲
+	inline constexpr std::uint8_t dynamic_vector_begin = 0x50;
+	inline constexpr std::uint8_t dynamic_vector_end = 0xf0;
+
+	struct Statistics {
+		std::uint64_t count;
+		// 最後に割り込みが来た時刻(ns)
+		std::uint64_t last_timestamp;
+		// ハンドラの実行時間(ns)
+		std::uint64_t total_ns;
+		std::uint64_t max_ns;
+	};
+
+	// IDTに共通の入口を設定し、実行中のCPUでinitialize_local()を呼ぶ
+	void initialize();
+	// 実行中のCPUのLocal APICを有効にし、スプリアス割り込みをInterruptVector::spuriousで受ける
+	void initialize_local();
+
+	Error register_handler(std::uint8_t vector, Handler handler, void* context = nullptr);
+	void unregister_handler(std::uint8_t vector);
+	// 空いているベクタにhandlerを登録する
+	WithError<std::uint8_t> allocate_vector(Handler handler, void* context = nullptr);
+
+	// 実行中のCPUで処理している割り込みが割り込んだ時のレジスタ。ハンドラの中でだけ使える
+	const InterruptContext& interrupted_context();
+
+	// 全てのCPUの合計。max_nsは前回のlog_statistics()からの最大
+	Statistics statistics(std::uint8_t vector);
+	std::uint64_t spurious_count();
+	// ハンドラが登録されていないベクタに来た割り込みの数
+	std::uint64_t unhandled_count();
+	// 前回からの割り込みの回数と実行時間をベクタごとにdebugで出力する。1つのCPUからだけ呼ぶ
+	void log_statistics();
+}
@@ -1,5 +1,12 @@
 #pragma once
 
+#include <cstdint>
+
+// これより詳しいレベルのログはコンパイル時に取り除く。CMakeのKERNEL_LOG_LEVELで決める
+#ifndef KERNEL_LOG_LEVEL
+#define KERNEL_LOG_LEVEL Debug
+#endif
+
 namespace kernel_interface::logger {
 	enum class LogLevel {
 		Panic = 1,
@@ -9,10 +16,21 @@ namespace kernel_interface::logger {
 		Debug = 7,
 	};
 
+	inline constexpr LogLevel compiled_log_level = LogLevel::KERNEL_LOG_LEVEL;
+
+	// levelのログを出力するコードがコンパイルされていればtrue
+	constexpr bool is_compiled(LogLevel level) {
+		return level <= compiled_log_level;
+	}
+
 	class ILogger {
 	public:
 		virtual ~ILogger() = default;
 		virtual void log(LogLevel level, const char* msg) = 0;
+		// 後からまとめて出力する時に、ログを出した時刻(ns)を添えて呼ぶ。時刻を出力しなければlog()と同じ
+		virtual void log_at(LogLevel level, const char* msg, std::uint64_t timestamp) {
+			log(level, msg);
+		}
 
 		virtual bool will_be_logged(LogLevel level) = 0;
 	};
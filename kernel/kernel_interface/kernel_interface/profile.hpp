@@ -0,0 +1,46 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// カーネルとUSBドライバの処理の回数をCPUごとに数える
+// 回数はカーネルのcpu::PerCpuの中に置き、GSベースからの相対アドレスに1命令で足す
+// 数えている途中で割り込まれたり他のCPUに移ったりしても数え損なわず、CPUの間でキャッシュラインを取り合わない
+namespace kernel_interface::profile {
+	enum class Event {
+		// usb::xhci::ProcessEvent()がイベントを1つ処理した
+		xhci_process_event,
+		// LayerManager::damage()
+		layer_damage,
+		// FrameBuffer::copy_from()
+		frame_buffer_copy,
+		// Console::put_string()
+		console_put_string,
+	};
+
+	inline constexpr int num_events = 4;
+
+	inline constexpr std::array<const char*, num_events> event_names{
+		"xhci_process_event",
+		"layer_damage",
+		"frame_buffer_copy",
+		"console_put_string",
+	};
+
+	// cpu::PerCpuの中で回数の配列が始まる位置(cpu.hppで確かめる)
+	inline constexpr std::size_t per_cpu_events_offset = 16;
+
+	// BSPのGSベースを設定したらtrueにする。それより前の回数は数えない
+	inline std::atomic<bool> per_cpu_ready{false};
+
+	// 実行中のCPUのeventの回数にnを足す
+	template <Event event>
+	void count(std::uint64_t n = 1) {
+		constexpr auto offset = per_cpu_events_offset + sizeof(std::uint64_t) * static_cast<std::size_t>(event);
+		if (per_cpu_ready.load(std::memory_order_relaxed)) {
+			__asm__ volatile("addq %1, %%gs:%c0" : : "i"(offset), "r"(n));
+		}
+	}
+}
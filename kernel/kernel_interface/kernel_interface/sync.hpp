@@ -0,0 +1,333 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// カーネルとUSBドライバで共有する状態を守るロック
+// ロックはどれも定数で初期化できるので、グローバル変数にしてもコンストラクタの呼び出しを待たずに使える
+// 持っている間に同じCPUの割り込みハンドラや、切り替わった先のタスクが同じロックを取ると止まってしまう
+// 割り込みハンドラや優先度の高いタスクからも触る状態には、IrqSaveの付いたガードを使う
+namespace kernel_interface::sync {
+	inline std::uint64_t read_tsc() {
+		std::uint32_t low, high;
+		__asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+		return (static_cast<std::uint64_t>(high) << 32) | low;
+	}
+
+	inline void cpu_relax() {
+		__asm__ volatile("pause" ::: "memory");
+	}
+
+	// 割り込みを禁止し、禁止する前のRFLAGSを返す
+	inline std::uint64_t save_and_disable_interrupts() {
+		std::uint64_t rflags;
+		__asm__ volatile("pushfq; popq %0; cli" : "=r"(rflags)::"memory");
+		return rflags;
+	}
+
+	// save_and_disable_interrupts()の前に割り込みが許可されていれば許可し直す
+	inline void restore_interrupts(std::uint64_t rflags) {
+		if ((rflags & (1u << 9)) != 0) {
+			__asm__ volatile("sti" ::: "memory");
+		}
+	}
+
+	// ロックの取り合いの集計。待った時間はTSCのサイクル数で数える
+	// 初めて取られた時にlock_statistics_headからたどれるリストに入る
+	class LockStatistics {
+	public:
+		constexpr explicit LockStatistics(const char* name) : name_{name} {}
+
+		// ロックを取れた時に呼ぶ。すぐに取れた時はwait_cyclesを0にする
+		void on_acquired(std::uint64_t wait_cycles);
+
+		const char* name() const {
+			return name_;
+		}
+		std::uint64_t acquisitions() const {
+			return acquisitions_.load(std::memory_order_relaxed);
+		}
+		// すぐには取れなかった回数
+		std::uint64_t contended() const {
+			return contended_.load(std::memory_order_relaxed);
+		}
+		std::uint64_t wait_cycles() const {
+			return wait_cycles_.load(std::memory_order_relaxed);
+		}
+		std::uint64_t max_wait_cycles() const {
+			return max_wait_cycles_.load(std::memory_order_relaxed);
+		}
+		LockStatistics* next() const {
+			return next_;
+		}
+
+		void reset();
+
+	private:
+		const char* const name_;
+		std::atomic<std::uint64_t> acquisitions_{0};
+		std::atomic<std::uint64_t> contended_{0};
+		std::atomic<std::uint64_t> wait_cycles_{0};
+		std::atomic<std::uint64_t> max_wait_cycles_{0};
+		std::atomic<bool> registered_{false};
+		LockStatistics* next_ = nullptr;
+	};
+
+	// 一度でも取られたロックの集計のリスト
+	inline std::atomic<LockStatistics*> lock_statistics_head{nullptr};
+
+	inline void LockStatistics::on_acquired(std::uint64_t wait_cycles) {
+		if (!registered_.load(std::memory_order_relaxed) && !registered_.exchange(true)) {
+			next_ = lock_statistics_head.load();
+			while (!lock_statistics_head.compare_exchange_weak(next_, this)) {
+			}
+		}
+
+		acquisitions_.fetch_add(1, std::memory_order_relaxed);
+		if (wait_cycles == 0) {
+			return;
+		}
+
+		contended_.fetch_add(1, std::memory_order_relaxed);
+		wait_cycles_.fetch_add(wait_cycles, std::memory_order_relaxed);
+		auto max = max_wait_cycles_.load(std::memory_order_relaxed);
+		while (wait_cycles > max && !max_wait_cycles_.compare_exchange_weak(max, wait_cycles)) {
+		}
+	}
+
+	inline void LockStatistics::reset() {
+		acquisitions_.store(0, std::memory_order_relaxed);
+		contended_.store(0, std::memory_order_relaxed);
+		wait_cycles_.store(0, std::memory_order_relaxed);
+		max_wait_cycles_.store(0, std::memory_order_relaxed);
+	}
+
+	// 空くまで回って待つロック。取る順番は保証しない
+	class SpinLock {
+	public:
+		constexpr explicit SpinLock(const char* name) : statistics_{name} {}
+
+		void lock() {
+			if (!locked_.exchange(true, std::memory_order_acquire)) {
+				statistics_.on_acquired(0);
+				return;
+			}
+
+			// 書き込みでキャッシュラインを奪い合わないように、空くまでは読むだけにする
+			const auto start = read_tsc();
+			do {
+				while (locked_.load(std::memory_order_relaxed)) {
+					cpu_relax();
+				}
+			} while (locked_.exchange(true, std::memory_order_acquire));
+			statistics_.on_acquired(read_tsc() - start);
+		}
+
+		bool try_lock() {
+			if (locked_.load(std::memory_order_relaxed) || locked_.exchange(true, std::memory_order_acquire)) {
+				return false;
+			}
+			statistics_.on_acquired(0);
+			return true;
+		}
+
+		void unlock() {
+			locked_.store(false, std::memory_order_release);
+		}
+
+		const LockStatistics& statistics() const {
+			return statistics_;
+		}
+
+	private:
+		std::atomic<bool> locked_{false};
+		LockStatistics statistics_;
+	};
+
+	// 来た順に取れるロック。多くのCPUが取り合っても待ち時間が偏らない
+	class TicketLock {
+	public:
+		constexpr explicit TicketLock(const char* name) : statistics_{name} {}
+
+		void lock() {
+			const auto ticket = next_ticket_.fetch_add(1, std::memory_order_relaxed);
+			if (now_serving_.load(std::memory_order_acquire) == ticket) {
+				statistics_.on_acquired(0);
+				return;
+			}
+
+			const auto start = read_tsc();
+			while (now_serving_.load(std::memory_order_acquire) != ticket) {
+				cpu_relax();
+			}
+			statistics_.on_acquired(read_tsc() - start);
+		}
+
+		bool try_lock() {
+			auto ticket = now_serving_.load(std::memory_order_relaxed);
+			if (!next_ticket_.compare_exchange_strong(ticket, ticket + 1, std::memory_order_acquire)) {
+				return false;
+			}
+			statistics_.on_acquired(0);
+			return true;
+		}
+
+		void unlock() {
+			// 書き換えるのは持っているCPUだけ
+			now_serving_.store(now_serving_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		const LockStatistics& statistics() const {
+			return statistics_;
+		}
+
+	private:
+		std::atomic<std::uint32_t> next_ticket_{0};
+		std::atomic<std::uint32_t> now_serving_{0};
+		LockStatistics statistics_;
+	};
+
+	// 読むだけなら同時に何人でも持てるロック
+	// 書き手が待っている間は新しい読み手を入れないので、読み手が絶えなくても書き手は止まり続けない
+	class RWLock {
+	public:
+		constexpr explicit RWLock(const char* name) : statistics_{name} {}
+
+		void lock_shared() {
+			auto state = state_.load(std::memory_order_relaxed);
+			if (can_read(state) && state_.compare_exchange_strong(state, state + 1, std::memory_order_acquire)) {
+				statistics_.on_acquired(0);
+				return;
+			}
+
+			const auto start = read_tsc();
+			while (true) {
+				state = state_.load(std::memory_order_relaxed);
+				if (can_read(state) && state_.compare_exchange_weak(state, state + 1, std::memory_order_acquire)) {
+					break;
+				}
+				cpu_relax();
+			}
+			statistics_.on_acquired(read_tsc() - start);
+		}
+
+		void unlock_shared() {
+			state_.fetch_sub(1, std::memory_order_release);
+		}
+
+		void lock() {
+			std::uint32_t state = 0;
+			if (state_.compare_exchange_strong(state, writer, std::memory_order_acquire)) {
+				statistics_.on_acquired(0);
+				return;
+			}
+
+			const auto start = read_tsc();
+			writers_waiting_.fetch_add(1, std::memory_order_relaxed);
+			while (true) {
+				state = 0;
+				if (state_.compare_exchange_weak(state, writer, std::memory_order_acquire)) {
+					break;
+				}
+				cpu_relax();
+			}
+			writers_waiting_.fetch_sub(1, std::memory_order_relaxed);
+			statistics_.on_acquired(read_tsc() - start);
+		}
+
+		void unlock() {
+			state_.store(0, std::memory_order_release);
+		}
+
+		const LockStatistics& statistics() const {
+			return statistics_;
+		}
+
+	private:
+		// 下位ビットは持っている読み手の数
+		static constexpr std::uint32_t writer = 1u << 31;
+
+		std::atomic<std::uint32_t> state_{0};
+		std::atomic<std::uint32_t> writers_waiting_{0};
+		LockStatistics statistics_;
+
+		bool can_read(std::uint32_t state) const {
+			return (state & writer) == 0 && writers_waiting_.load(std::memory_order_relaxed) == 0;
+		}
+	};
+
+	// スコープの間だけロックを持つ
+	template <typename Lock>
+	class LockGuard {
+	public:
+		explicit LockGuard(Lock& lock) : lock_{lock} {
+			lock_.lock();
+		}
+		~LockGuard() {
+			lock_.unlock();
+		}
+
+		LockGuard(const LockGuard&) = delete;
+		LockGuard& operator=(const LockGuard&) = delete;
+
+	private:
+		Lock& lock_;
+	};
+
+	// 割り込みを禁止してからロックを取り、放した後に元に戻す
+	template <typename Lock>
+	class IrqSaveLockGuard {
+	public:
+		explicit IrqSaveLockGuard(Lock& lock) : lock_{lock}, rflags_{save_and_disable_interrupts()} {
+			lock_.lock();
+		}
+		~IrqSaveLockGuard() {
+			lock_.unlock();
+			restore_interrupts(rflags_);
+		}
+
+		IrqSaveLockGuard(const IrqSaveLockGuard&) = delete;
+		IrqSaveLockGuard& operator=(const IrqSaveLockGuard&) = delete;
+
+	private:
+		Lock& lock_;
+		const std::uint64_t rflags_;
+	};
+
+	// RWLockを読み手として持つ
+	template <typename Lock>
+	class SharedLockGuard {
+	public:
+		explicit SharedLockGuard(Lock& lock) : lock_{lock} {
+			lock_.lock_shared();
+		}
+		~SharedLockGuard() {
+			lock_.unlock_shared();
+		}
+
+		SharedLockGuard(const SharedLockGuard&) = delete;
+		SharedLockGuard& operator=(const SharedLockGuard&) = delete;
+
+	private:
+		Lock& lock_;
+	};
+
+	template <typename Lock>
+	class IrqSaveSharedLockGuard {
+	public:
+		explicit IrqSaveSharedLockGuard(Lock& lock) : lock_{lock}, rflags_{save_and_disable_interrupts()} {
+			lock_.lock_shared();
+		}
+		~IrqSaveSharedLockGuard() {
+			lock_.unlock_shared();
+			restore_interrupts(rflags_);
+		}
+
+		IrqSaveSharedLockGuard(const IrqSaveSharedLockGuard&) = delete;
+		IrqSaveSharedLockGuard& operator=(const IrqSaveSharedLockGuard&) = delete;
+
+	private:
+		Lock& lock_;
+		const std::uint64_t rflags_;
+	};
+}
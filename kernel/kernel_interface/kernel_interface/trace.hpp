@@ -0,0 +1,152 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include <kernel_interface/profile.hpp>
+
+// linker.ldで.trace_formatsの先頭に置く
+extern "C" const char __trace_formats_start[];
+
+// 後から読むだけのデバッグ出力を、文字列にせずに時刻と引数のままCPUごとのリングバッファに記録する
+// 書式の文字列はKERNEL_TRACE()ごとに.trace_formatsセクションに置き、記録にはその中の位置だけを残す
+// 記録したバッファはQEMUのモニタで保存し、tools/decode_trace.pyでkernel.elfの書式に当てはめて読む
+namespace kernel_interface::trace {
+	// 1つの記録に残せる引数の数
+	inline constexpr std::size_t max_arguments = 6;
+	// CPUごとに覚えておく記録の数。溢れたら古いものから上書きする
+	inline constexpr std::size_t records_per_cpu = 1024;
+	// Buffer::magicの値。"TRACEBUF"
+	inline constexpr std::uint64_t buffer_magic = 0x4655'4245'4341'5254;
+
+	struct Record {
+		std::uint64_t tsc;
+		// .trace_formatsの先頭からの書式の位置
+		std::uint32_t format;
+		std::uint32_t num_arguments;
+		std::array<std::uint64_t, max_arguments> arguments;
+	};
+
+	static_assert(sizeof(Record) == 64);
+
+	// tools/decode_trace.pyはこの並びで読む
+	struct Buffer {
+		std::uint64_t magic;
+		std::uint32_t cpu_index;
+		std::uint32_t num_records;
+		std::uint64_t tsc_frequency;
+		// tsc::now()が0になるTSCの値
+		std::uint64_t boot_tsc;
+		// これまでに書き込んだ記録の数。次はrecords[head % records_per_cpu]に書く
+		std::uint64_t head;
+		// 記録はキャッシュラインに1つずつ置く
+		alignas(64) std::array<Record, records_per_cpu> records;
+	};
+
+	static_assert(offsetof(Buffer, records) == 64);
+
+	// cpu::PerCpuの中で実行中のCPUのBufferを指すポインタの位置(cpu.hppで確かめる)
+	inline constexpr std::size_t per_cpu_trace_offset =
+		profile::per_cpu_events_offset + sizeof(std::uint64_t) * profile::num_events;
+
+	// カーネルのtrace::initialize()で全てのCPUのBufferを用意したらtrueにする
+	inline std::atomic<bool> enabled{false};
+
+	// 書式が取る引数の数。文字列や浮動小数点数のように記録できない変換があれば-1
+	constexpr int count_conversions(const char* format) {
+		int count = 0;
+		for (auto p = format; *p != '\0'; ++p) {
+			if (*p != '%') {
+				continue;
+			}
+			if (*++p == '%') {
+				continue;
+			}
+
+			while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') {
+				++p;
+			}
+			while ((*p >= '0' && *p <= '9') || *p == '.') {
+				++p;
+			}
+			while (*p == 'h' || *p == 'l' || *p == 'z' || *p == 'j' || *p == 't') {
+				++p;
+			}
+
+			switch (*p) {
+			case 'd':
+			case 'i':
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X':
+			case 'c':
+			case 'p':
+				++count;
+				break;
+			default:
+				return -1;
+			}
+		}
+		return count;
+	}
+
+	template <typename T>
+	std::uint64_t to_argument(T value) {
+		static_assert(std::is_integral_v<T> || std::is_enum_v<T> || std::is_pointer_v<T>,
+			"only integers, enums and pointers can be traced");
+		if constexpr (std::is_pointer_v<T>) {
+			return reinterpret_cast<std::uintptr_t>(value);
+		} else if constexpr (std::is_signed_v<T>) {
+			// %dで読み戻せるように符号を広げる
+			return static_cast<std::uint64_t>(static_cast<std::int64_t>(value));
+		} else {
+			return static_cast<std::uint64_t>(value);
+		}
+	}
+
+	// KERNEL_TRACE()から呼ぶ。formatは.trace_formatsセクションの中を指す
+	template <int NumConversions, typename... Args>
+	void record(const char* format, Args... args) {
+		static_assert(NumConversions >= 0, "trace formats can only use integer and pointer conversions");
+		static_assert(NumConversions == sizeof...(Args), "the number of arguments does not match the format");
+		static_assert(sizeof...(Args) <= max_arguments, "too many arguments to trace");
+
+		if (!enabled.load(std::memory_order_relaxed)) {
+			return;
+		}
+
+		// 書き込む位置を決めてから書き終えるまで、割り込みにも他のCPUへの移動にも邪魔させない
+		std::uint64_t rflags;
+		__asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags) : : "memory");
+
+		Buffer* buffer;
+		__asm__ volatile("movq %%gs:%c1, %0" : "=r"(buffer) : "i"(per_cpu_trace_offset));
+		std::uint32_t tsc_low, tsc_high;
+		__asm__ volatile("rdtsc" : "=a"(tsc_low), "=d"(tsc_high));
+
+		auto& r = buffer->records[buffer->head % records_per_cpu];
+		r.tsc = (static_cast<std::uint64_t>(tsc_high) << 32) | tsc_low;
+		r.format = static_cast<std::uint32_t>(format - __trace_formats_start);
+		r.num_arguments = sizeof...(Args);
+		[[maybe_unused]] std::size_t i = 0;
+		((r.arguments[i++] = to_argument(args)), ...);
+		++buffer->head;
+
+		if (rflags & (1u << 9)) {
+			__asm__ volatile("sti" : : : "memory");
+		}
+	}
+}
+
+// printfと同じ書式でformatと引数を記録する。formatは文字列リテラルで、整数とポインタの変換だけを使える
+// 書式と引数の数が合わなければコンパイルできない
+#define KERNEL_TRACE(format, ...)                                                                                      \
+	do {                                                                                                               \
+		[[gnu::section(".trace_formats"), gnu::used]] static constexpr char kernel_trace_format[] = format;            \
+		::kernel_interface::trace::record<::kernel_interface::trace::count_conversions(kernel_trace_format)>(          \
+			kernel_trace_format, ##__VA_ARGS__);                                                                       \
+	} while (false)
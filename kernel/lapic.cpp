@@ -0,0 +1,46 @@
+#include "lapic.hpp"
+
+#include "interrupt.hpp"
+
+namespace {
+	volatile std::uint32_t& id_register = *reinterpret_cast<std::uint32_t*>(0xfee00020);
+	volatile std::uint32_t& icr_low = *reinterpret_cast<std::uint32_t*>(0xfee00300);
+	volatile std::uint32_t& icr_high = *reinterpret_cast<std::uint32_t*>(0xfee00310);
+
+	constexpr std::uint32_t icr_delivery_init = 0b101u << 8;
+	constexpr std::uint32_t icr_delivery_startup = 0b110u << 8;
+	constexpr std::uint32_t icr_delivery_status = 1u << 12;
+	constexpr std::uint32_t icr_level_assert = 1u << 14;
+	constexpr std::uint32_t icr_all_excluding_self = 0b11u << 18;
+
+	void write_icr(std::uint32_t high, std::uint32_t low) {
+		// 割り込みハンドラもIPIを送るので、宛先と送信の書き込みの間に割り込ませない
+		InterruptGuard guard;
+		while ((icr_low & icr_delivery_status) != 0) {
+			__asm__("pause");
+		}
+
+		icr_high = high;
+		icr_low = low;
+	}
+}
+
+std::uint8_t lapic::id() {
+	return id_register >> 24;
+}
+
+void lapic::send_ipi(std::uint8_t apic_id, std::uint8_t vector) {
+	write_icr(static_cast<std::uint32_t>(apic_id) << 24, icr_level_assert | vector);
+}
+
+void lapic::send_ipi_all_excluding_self(std::uint8_t vector) {
+	write_icr(0, icr_all_excluding_self | icr_level_assert | vector);
+}
+
+void lapic::send_init(std::uint8_t apic_id) {
+	write_icr(static_cast<std::uint32_t>(apic_id) << 24, icr_delivery_init | icr_level_assert);
+}
+
+void lapic::send_startup(std::uint8_t apic_id, std::uint8_t page) {
+	write_icr(static_cast<std::uint32_t>(apic_id) << 24, icr_delivery_startup | icr_level_assert | page);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+namespace lapic {
+	// 実行中のCPUのLocal APIC ID
+	std::uint8_t id();
+
+	void send_ipi(std::uint8_t apic_id, std::uint8_t vector);
+	// 自分以外の全てのCPUにIPIを送る
+	void send_ipi_all_excluding_self(std::uint8_t vector);
+
+	// apic_idのCPUにINIT IPIを送り、Startup IPIを待つ状態にする
+	void send_init(std::uint8_t apic_id);
+	// apic_idのCPUにStartup IPIを送り、リアルモードでpage * 4KiB番地から実行させる
+	void send_startup(std::uint8_t apic_id, std::uint8_t page);
+}
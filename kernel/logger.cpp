@@ -1,19 +1,26 @@
 #include "logger.hpp"
 
+#include <cstring>
+
+#include "serial.hpp"
+#include "tsc.hpp"
+
 namespace logger {
 	ConsoleLogger::ConsoleLogger(graphics::IConsole* console, LogLevel log_level) :
 		console_{console}, log_level_{log_level} {}
 
 	void ConsoleLogger::set_console(graphics::IConsole* console) {
+		sync::IrqSaveLockGuard guard(lock_);
 		console_ = console;
 	}
 
 	void ConsoleLogger::log(LogLevel level, const char* msg) {
-		if (console_ == nullptr) {
+		if (!will_be_logged(level)) {
 			return;
 		}
 
-		if (will_be_logged(level)) {
+		sync::IrqSaveLockGuard guard(lock_);
+		if (console_ != nullptr) {
 			console_->put_string(msg);
 		}
 	}
@@ -22,9 +29,119 @@ namespace logger {
 		return level <= log_level_;
 	}
 
+	SerialLogger::SerialLogger(LogLevel log_level) : log_level_{log_level} {}
+
+	void SerialLogger::log(LogLevel level, const char* msg) {
+		log_at(level, msg, tsc::now());
+	}
+
+	void SerialLogger::log_at(LogLevel level, const char* msg, std::uint64_t timestamp) {
+		if (!will_be_logged(level)) {
+			return;
+		}
+
+		sync::IrqSaveLockGuard guard(lock_);
+		if (at_line_start_) {
+			char prefix[32];
+			const auto length = std::snprintf(
+				prefix,
+				sizeof(prefix),
+				u8"[%5lu.%06lu] ",
+				timestamp / 1'000'000'000,
+				timestamp / 1000 % 1'000'000);
+			serial::write(prefix, length);
+		}
+
+		const auto length = std::strlen(msg);
+		serial::write(msg, length);
+		at_line_start_ = length > 0 ? msg[length - 1] == u8'\n' : at_line_start_;
+
+		// 止まる前に送り切る
+		if (level == LogLevel::Panic) {
+			serial::flush();
+		}
+	}
+
+	bool SerialLogger::will_be_logged(LogLevel level) {
+		return level <= log_level_ && serial::is_available();
+	}
+
+	TeeLogger::TeeLogger(ILogger& first, ILogger& second) : first_{first}, second_{second} {}
+
+	void TeeLogger::log(LogLevel level, const char* msg) {
+		first_.log(level, msg);
+		second_.log(level, msg);
+	}
+
+	void TeeLogger::log_at(LogLevel level, const char* msg, std::uint64_t timestamp) {
+		first_.log_at(level, msg, timestamp);
+		second_.log_at(level, msg, timestamp);
+	}
+
+	bool TeeLogger::will_be_logged(LogLevel level) {
+		return first_.will_be_logged(level) || second_.will_be_logged(level);
+	}
+
+	DeferredLogger::DeferredLogger(ILogger& sink) : sink_{sink} {}
+
+	void DeferredLogger::start_deferring() {
+		deferring_.store(true, std::memory_order_release);
+	}
+
+	void DeferredLogger::log(LogLevel level, const char* msg) {
+		if (!deferring_.load(std::memory_order_acquire)) {
+			sink_.log(level, msg);
+			return;
+		}
+
+		if (level == LogLevel::Panic) {
+			// 止まる前に、それまでのログと一緒に出し切る
+			drain();
+			sink_.log(level, msg);
+			return;
+		}
+
+		Record record;
+		record.level = level;
+		record.timestamp = tsc::now();
+		const auto length = std::strlen(msg);
+		if (length < sizeof(record.text)) {
+			std::memcpy(record.text, msg, length + 1);
+		} else {
+			// 切り詰めても行の終わりは残す
+			std::memcpy(record.text, msg, sizeof(record.text) - 1);
+			record.text[sizeof(record.text) - 1] = '\0';
+			if (msg[length - 1] == u8'\n') {
+				record.text[sizeof(record.text) - 2] = u8'\n';
+			}
+		}
+		records_.push(record);
+	}
+
+	bool DeferredLogger::will_be_logged(LogLevel level) {
+		return sink_.will_be_logged(level);
+	}
+
+	void DeferredLogger::drain() {
+		if (draining_.exchange(true, std::memory_order_acquire)) {
+			return;
+		}
+
+		while (auto record = records_.pop()) {
+			sink_.log_at(record->level, record->text, record->timestamp);
+		}
+		draining_.store(false, std::memory_order_release);
+	}
+
+	std::uint64_t DeferredLogger::dropped_count() const {
+		return records_.overflow_count();
+	}
+
 	LoggerProxy::LoggerProxy(ILogger& logger) : logger_{logger} {}
 
 	void LoggerProxy::log(LogLevel level, const char* msg) {
-		logger_.log(level, msg);
+		if (is_compiled(level)) {
+			logger_.log(level, msg);
+		}
 	}
 }
@@ -1,10 +1,14 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <cstdio>
 
 #include <kernel_interface/logger.hpp>
 
 #include "graphics/console.hpp"
+#include "mpmc_queue.hpp"
+#include "sync.hpp"
 #include "utils.hpp"
 
 namespace logger {
@@ -22,6 +26,73 @@ namespace logger {
 	private:
 		graphics::IConsole* console_;
 		LogLevel log_level_;
+		// 複数のCPUや割り込みハンドラからの出力が行の途中で混ざらないようにする
+		sync::TicketLock lock_{"logger"};
+	};
+
+	// シリアルポートに出力する。行の頭に起動してからの時刻を付ける
+	class SerialLogger final : public ILogger {
+	public:
+		SerialLogger(LogLevel log_level = LogLevel::Debug);
+
+		void log(LogLevel level, const char* msg) override;
+		void log_at(LogLevel level, const char* msg, std::uint64_t timestamp) override;
+		bool will_be_logged(LogLevel level) override;
+
+	private:
+		LogLevel log_level_;
+		bool at_line_start_ = true;
+		// 時刻と本文の間に他の出力が入らないようにする
+		sync::TicketLock lock_{"serial_logger"};
+	};
+
+	// 2つのILoggerに同じログを出力する。レベルはそれぞれのILoggerで決める
+	class TeeLogger final : public ILogger {
+	public:
+		TeeLogger(ILogger& first, ILogger& second);
+
+		void log(LogLevel level, const char* msg) override;
+		void log_at(LogLevel level, const char* msg, std::uint64_t timestamp) override;
+		bool will_be_logged(LogLevel level) override;
+
+	private:
+		ILogger& first_;
+		ILogger& second_;
+	};
+
+	// start_deferring()の後は、ログをリングバッファに積むだけにしてsinkへの出力をdrain()まで遅らせる
+	// 割り込みハンドラや他のCPUはロックを待たず、画面の描画にも付き合わない
+	// リングバッファが一杯なら捨てて数える。Panicは溜まっている分を出力してからその場で出力する
+	class DeferredLogger final : public ILogger {
+	public:
+		// 溜めておけるログの数
+		static constexpr std::size_t capacity = 256;
+
+		DeferredLogger(ILogger& sink);
+
+		void start_deferring();
+
+		void log(LogLevel level, const char* msg) override;
+		bool will_be_logged(LogLevel level) override;
+
+		// 溜まっているログを全てsinkに出力する。他のCPUが出力している間は何もしない
+		void drain();
+		// リングバッファが一杯で捨てたログの数
+		std::uint64_t dropped_count() const;
+
+	private:
+		// 1行分のログ。入り切らない分は切り詰める
+		struct Record {
+			LogLevel level;
+			std::uint64_t timestamp;
+			char text[240];
+		};
+
+		ILogger& sink_;
+		std::atomic<bool> deferring_{false};
+		// 複数のCPUが同時に出力して順番が入れ替わらないようにする
+		std::atomic<bool> draining_{false};
+		MpmcQueue<Record, capacity> records_;
 	};
 
 	class LoggerProxy final {
@@ -32,51 +103,54 @@ namespace logger {
 
 		template <typename... Args>
 		void panic(const char* format, Args... args) {
-			log_format(LogLevel::Panic, format, args...);
+			log_format<LogLevel::Panic>(format, args...);
 			halt();
 		}
 
 		template <typename... Args>
 		void error(const char* format, Args... args) {
-			log_format(LogLevel::Error, format, args...);
+			log_format<LogLevel::Error>(format, args...);
 		}
 
 		template <typename... Args>
 		void warn(const char* format, Args... args) {
-			log_format(LogLevel::Warn, format, args...);
+			log_format<LogLevel::Warn>(format, args...);
 		}
 
 		template <typename... Args>
 		void info(const char* format, Args... args) {
-			log_format(LogLevel::Info, format, args...);
+			log_format<LogLevel::Info>(format, args...);
 		}
 
 		template <typename... Args>
 		void debug(const char* format, Args... args) {
-			log_format(LogLevel::Debug, format, args...);
+			log_format<LogLevel::Debug>(format, args...);
 		}
 
 	private:
 		ILogger& logger_;
 
-		template <typename... Args>
-		void log_format(LogLevel level, const char* format, Args... args) {
-			if (!logger_.will_be_logged(level)) {
-				return;
-			}
+		template <LogLevel level, typename... Args>
+		void log_format(const char* format, Args... args) {
+			// コンパイルしないレベルなら呼び出しごと消える
+			if constexpr (is_compiled(level)) {
+				if (!logger_.will_be_logged(level)) {
+					return;
+				}
 
-			char buf[1024];
+				char buf[1024];
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wformat-security"
-			auto result = std::snprintf(buf, sizeof(buf), format, args...);
+				auto result = std::snprintf(buf, sizeof(buf), format, args...);
 #pragma clang diagnostic pop
 
-			if (result < 0) {
-				return;
-			}
+				if (result < 0) {
+					return;
+				}
 
-			logger_.log(level, buf);
+				logger_.log(level, buf);
+			}
 		}
 	};
 }
@@ -1,34 +1,56 @@
+#include <array>
 #include <cstdint>
 #include <cstdio>
 #include <optional>
-#include <queue>
 
 #include <asmfunc.hpp>
 #include <kernel_interface/logger.hpp>
 #include <usb/classdriver/mouse.hpp>
 #include <usb/device.hpp>
+#include <usb/log_level.hpp>
 #include <usb/memory.hpp>
 #include <usb/xhci/trb.hpp>
 #include <usb/xhci/xhci.hpp>
 
+#include "acpi.hpp"
+#include "benchmark.hpp"
+#include "boot_assets.hpp"
+#include "cpu.hpp"
+#include "graphics/compositor.hpp"
 #include "graphics/console.hpp"
+#include "graphics/font.hpp"
 #include "graphics/frame_buffer_config.hpp"
 #include "graphics/graphics.hpp"
 #include "graphics/group_layer.hpp"
 #include "graphics/layer_ids.hpp"
 #include "graphics/mouse.hpp"
+#include "exception.hpp"
 #include "interrupt.hpp"
+#include "ioapic.hpp"
+#include "irq.hpp"
+#include "lapic.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
+#include "message.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
+#include "profile.hpp"
 #include "sbrk.hpp"
 #include "segment.hpp"
+#include "serial.hpp"
+#include "smp.hpp"
+#include "sync.hpp"
+#include "task.hpp"
 #include "timer.hpp"
+#include "timer_wheel.hpp"
+#include "tlb.hpp"
+#include "trace.hpp"
+#include "tsc.hpp"
 #include "utils.hpp"
 
 namespace {
-	void mouse_observer(std::uint8_t buttons, std::int8_t dx, std::int8_t dy) {
+	// メインタスクでマウスの移動を画面に反映する
+	void on_mouse_move(std::uint8_t buttons, std::int8_t dx, std::int8_t dy) {
 		using graphics::layer_manager;
 		namespace layer_ids = graphics::layer_ids;
 		using graphics::Vector2D;
@@ -66,30 +88,270 @@ namespace {
 		previous_buttons = buttons;
 	}
 
-	struct Message {
-		enum class Type {
-			InterruptXHCI,
-		} type;
+	// xHCのイベントリングを処理するタスクと、そのタスクに任せたインタラプタ
+	// 割り込みハンドラとタスクは同じCPUに置き、タスクからは割り込みを禁止して読み書きする
+	struct XhciWorker {
+		usb::xhci::Controller* xhc;
+		// 担当するインタラプタのビットマップ
+		std::uint32_t interrupters;
+		int cpu_index;
+		// タスクが動き始めたら自分で設定する
+		Task* task;
+		// 割り込みが来てまだ処理していないか、その最初の割り込みの時刻(ns)
+		bool pending;
+		std::uint64_t first_timestamp;
 	};
 
-	std::queue<Message>* main_queue;
+	// [0]はBSPでコマンドの完了やポートの変化を処理する。APがあれば[1]がそのAPでHIDの割り込み転送を処理する
+	std::array<XhciWorker, 2> xhci_workers;
+	int num_xhci_workers;
+	// 各CPUのxHCIタスクが処理中のイベントの元になった割り込みの時刻(ns)
+	std::array<std::uint64_t, cpu::max_count> xhci_processing_timestamps;
+
+	// contextには担当するXhciWorkerが入っている
+	void on_xhci_interrupt(void* context) {
+		auto& worker = *static_cast<XhciWorker*>(context);
+		if (!worker.pending) {
+			worker.pending = true;
+			worker.first_timestamp = tsc::now();
+		}
+		if (worker.task != nullptr) {
+			TaskManager::wakeup(*worker.task);
+		}
+	}
+
+	// xHCIタスクでHIDマウスのドライバから呼ばれる。画面の更新はメインタスクに任せる
+	void mouse_observer(std::uint8_t buttons, std::int8_t dx, std::int8_t dy) {
+		Message msg{Message::Type::MouseMove};
+		msg.arg.mouse.timestamp = xhci_processing_timestamps[cpu::current_index()];
+		msg.arg.mouse.buttons = buttons;
+		msg.arg.mouse.dx = dx;
+		msg.arg.mouse.dy = dy;
+		post_message(msg);
+	}
+
+	// xHCのイベントリングを処理するタスク。dataは担当するXhciWorker
+	// 描画より優先度を高くして、合成の途中でも入力を取りこぼさないようにする
+	void xhci_task_main(std::uint64_t data) {
+		auto& worker = *reinterpret_cast<XhciWorker*>(data);
+		auto& xhc = *worker.xhc;
+
+		{
+			InterruptGuard guard;
+			worker.task = &TaskManager::current_task();
+		}
+
+		while (true) {
+			{
+				InterruptGuard guard;
+				if (!worker.pending) {
+					TaskManager::sleep();
+				}
+				worker.pending = false;
+				xhci_processing_timestamps[worker.cpu_index] = worker.first_timestamp;
+			}
+
+			// 入力の遅延を小さくするため、割り込み転送のインタラプタを先に処理する
+			for (int i = xhc.NumInterrupters() - 1; i >= 0; --i) {
+				if ((worker.interrupters & (1u << i)) == 0) {
+					continue;
+				}
 
-	__attribute__((interrupt)) void int_handler_xhci(InterruptFrame* frame) {
-		main_queue->push(Message{Message::Type::InterruptXHCI});
-		notify_end_of_interrput();
+				auto er = xhc.EventRingAt(i);
+				while (er->HasFront()) {
+					if (auto err = ProcessEvent(xhc, *er)) {
+						log->error(u8"Error while ProcessEvent: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+					}
+				}
+			}
+		}
 	}
 
+	// xHCのインタラプタごとにMSI-Xのエントリとベクタを割り当てる
+	// APがあればHIDの割り込み転送のインタラプタをAPに送り、入力の処理がBSPの描画やコマンドの処理を待たないようにする
+	// HIDの転送リングに積むのもそのAPだけで、BSPが触るコマンドリングや制御転送とは別のリングになる
+	// MSI-Xのエントリが足りなければMSIの1ベクタで全インタラプタをBSPで受ける
+	void configure_xhci_interrupts(const pci::Device& xhc_device, usb::xhci::Controller& xhc) {
+		const auto num_interrupters = xhc.NumInterrupters();
+
+		auto& primary = xhci_workers[0];
+		primary = XhciWorker{&xhc, (1u << num_interrupters) - 1, cpu::current_index()};
+		num_xhci_workers = 1;
+
+		if (num_interrupters > 1 && pci::msix_table_size(xhc_device) >= num_interrupters) {
+			if (cpu::online_count() > 1) {
+				const auto hid_interrupters = 1u << xhc.InterruptTransferInterrupter();
+				xhci_workers[1] = XhciWorker{&xhc, hid_interrupters, 1};
+				primary.interrupters &= ~hid_interrupters;
+				num_xhci_workers = 2;
+			}
+
+			for (std::uint16_t i = 0; i < num_interrupters; ++i) {
+				auto& worker = (xhci_workers[1].interrupters & (1u << i)) != 0 ? xhci_workers[1] : primary;
+				const auto vector = irq::allocate_vector(on_xhci_interrupt, &worker);
+				if (vector.error) {
+					log->panic(u8"Failed to allocate an interrupt vector for xHC: %s\n", vector.error.name());
+				}
+
+				const auto err = pci::configure_msix_fixed_destination(
+					xhc_device,
+					i,
+					cpu::lapic_id_of(worker.cpu_index),
+					pci::MSITriggerMode::Level,
+					pci::MSIDeliveryMode::Fixed,
+					vector.value);
+				log->debug(
+					u8"pci::configure_msix_fixed_destination(): interrupter %u, vector 0x%02x, CPU %d: %s\n",
+					i,
+					vector.value,
+					worker.cpu_index,
+					err.name());
+			}
+			return;
+		}
+
+		const auto vector = irq::allocate_vector(on_xhci_interrupt, &primary);
+		if (vector.error) {
+			log->panic(u8"Failed to allocate an interrupt vector for xHC: %s\n", vector.error.name());
+		}
+
+		const auto err = pci::configure_msi_fixed_destination(
+			xhc_device,
+			lapic::id(),
+			pci::MSITriggerMode::Level,
+			pci::MSIDeliveryMode::Fixed,
+			vector.value,
+			0);
+		log->debug(u8"pci::configure_msi_fixed_destination(): %s\n", err.name());
+	}
+
+	// メインループで使うタイマのMessageに入る値
+	constexpr int frame_timer_value = 1;
+	constexpr int stats_timer_value = 2;
+
+	// 画面に反映する頻度。timer_frequencyを割り切れなくても平均でこの頻度になるように、フレームの境界は番号から求める
+	constexpr std::uint64_t frames_per_second = 60;
+
+	// 描くものがある時だけ次のフレームの境界に掛ける。描くものが無ければ掛けないので、アイドル中のBSPを起こさない
+	Timer* frame_timer;
+
+	// present()を待つdamageが溜まり始めた時にLayerManagerから呼ばれる
+	void request_frame() {
+		if (frame_timer == nullptr || frame_timer->pending) {
+			return;
+		}
+
+		const auto next_frame = current_tick() * frames_per_second / timer_frequency + 1;
+		frame_timer->timeout = next_frame * timer_frequency / frames_per_second;
+		timer_wheel->add(*frame_timer);
+	}
+
+	// KERNEL_PROFILEの時にRIPを記録する間隔(tick)と、サンプルの集計を出力する間隔(秒)
+	constexpr std::uint64_t profile_interval = 1;
+	constexpr int profile_dump_period = 10;
+
+	// 1回にまとめて処理するMessageの最大数
+	constexpr std::size_t max_batch_size = 64;
+
+	// 画面とシリアルポートへの出力は、BSPが空いた時にアイドルタスクがまとめて行う
+	alignas(logger::DeferredLogger) std::uint8_t deferred_logger_buf[sizeof(logger::DeferredLogger)];
+	logger::DeferredLogger* deferred_logger;
+
+	// CPU使用率と入力の遅延を1秒ごとに集計する
+	struct LoopStatistics {
+		std::uint64_t last_idle_ns = 0;
+		std::uint64_t message_count = 0;
+		std::uint64_t batch_count = 0;
+		std::uint64_t input_count = 0;
+		std::uint64_t input_latency_total_ns = 0;
+		std::uint64_t input_latency_max_ns = 0;
+		unsigned int cpu_usage = 0;
+		std::uint64_t dropped_reported = 0;
+		std::uint64_t serial_dropped_reported = 0;
+		std::uint64_t log_dropped_reported = 0;
+		int report_count = 0;
+
+		void add_input_latency(std::uint64_t latency_ns) {
+			++input_count;
+			input_latency_total_ns += latency_ns;
+			if (latency_ns > input_latency_max_ns) {
+				input_latency_max_ns = latency_ns;
+			}
+		}
+
+		void report(std::uint64_t period_ns) {
+			const auto total_idle_ns = current_task_manager()->idle_ns();
+			const auto idle_ns = total_idle_ns - last_idle_ns;
+			last_idle_ns = total_idle_ns;
+			cpu_usage = idle_ns >= period_ns ? 0 : 100 - idle_ns * 100 / period_ns;
+			log->debug(
+				u8"CPU %u%%, %lu messages in %lu batches, input to screen avg %lu us, max %lu us\n",
+				cpu_usage,
+				message_count,
+				batch_count,
+				input_count == 0 ? 0 : input_latency_total_ns / input_count / 1000,
+				input_latency_max_ns / 1000);
+			const auto& frames = graphics::layer_manager->frame_statistics();
+			log->debug(
+				u8"%lu frames (%lu empty), frame time avg %lu us, max %lu us\n",
+				frames.frames,
+				frames.empty_frames,
+				frames.frames == frames.empty_frames ? 0 : frames.total_ns / (frames.frames - frames.empty_frames) / 1000,
+				frames.max_ns / 1000);
+			graphics::layer_manager->reset_frame_statistics();
+
+			irq::log_statistics();
+			TaskManager::log_statistics(period_ns);
+			sync::log_statistics();
+			profile::log_event_counts();
+#ifdef KERNEL_PROFILE
+			if (++report_count % profile_dump_period == 0) {
+				profile::dump_samples();
+			}
+#endif
+
+			const auto dropped = main_queue->overflow_count();
+			if (dropped != dropped_reported) {
+				log->error(u8"main_queue overflowed: %lu messages dropped\n", dropped - dropped_reported);
+				dropped_reported = dropped;
+			}
+
+			const auto serial_dropped = serial::statistics().dropped_bytes;
+			if (serial_dropped != serial_dropped_reported) {
+				log->warn(u8"serial: %lu bytes dropped\n", serial_dropped - serial_dropped_reported);
+				serial_dropped_reported = serial_dropped;
+			}
+
+			const auto log_dropped = deferred_logger->dropped_count();
+			if (log_dropped != log_dropped_reported) {
+				log->warn(u8"logger: %lu records dropped\n", log_dropped - log_dropped_reported);
+				log_dropped_reported = log_dropped;
+			}
+
+			message_count = 0;
+			batch_count = 0;
+			input_count = 0;
+			input_latency_total_ns = 0;
+			input_latency_max_ns = 0;
+		}
+	};
+
 	alignas(BitmapMemoryManager) std::uint8_t memory_manager_buf[sizeof(BitmapMemoryManager)];
-	BitmapMemoryManager* memory_manager = reinterpret_cast<BitmapMemoryManager*>(&memory_manager_buf);
 
 	alignas(std::max_align_t) char fb_pixel_writer_buf[graphics::max_device_pixel_writer_size];
 	graphics::DevicePixelWriter* fb_pixel_writer = reinterpret_cast<graphics::DevicePixelWriter*>(fb_pixel_writer_buf);
 }
 
-extern "C" void
-kernel_main(const graphics::FrameBufferConfig& frame_buffer_config_ref, const MemoryMap& memory_map_ref) {
+extern "C" void kernel_main(
+	const graphics::FrameBufferConfig& frame_buffer_config_ref,
+	const MemoryMap& memory_map_ref,
+	const BootAssets& boot_assets_ref,
+	const acpi::RSDP* acpi_table) {
 	auto frame_buffer_config = frame_buffer_config_ref;
 	auto memory_map = memory_map_ref;
+	auto boot_assets = boot_assets_ref;
+
+	graphics::initialize_font(boot_assets.font, boot_assets.font_size);
 
 	get_suitable_device_pixel_writer_traits(frame_buffer_config.pixel_format)
 		.construct(frame_buffer_config, fb_pixel_writer_buf);
@@ -103,31 +365,114 @@ kernel_main(const graphics::FrameBufferConfig& frame_buffer_config_ref, const Me
 
 	console_instance.set_pixel_writer(fb_pixel_writer);
 
+	// 画面にはInfoまで、シリアルポートにはDebugまで出力する
+	const auto serial_error = serial::initialize();
 	auto console_logger = logger::ConsoleLogger(&console_instance, logger::LogLevel::Info);
-	auto logger_proxy = logger::LoggerProxy(console_logger);
-	kernel_interface::logger::default_logger = &console_logger;
+	auto serial_logger = logger::SerialLogger(logger::LogLevel::Debug);
+	auto tee_logger = logger::TeeLogger(console_logger, serial_logger);
+	deferred_logger = new (deferred_logger_buf) logger::DeferredLogger(tee_logger);
+	auto logger_proxy = logger::LoggerProxy(*deferred_logger);
+	kernel_interface::logger::default_logger = deferred_logger;
 	log = &logger_proxy;
+	if (serial_error) {
+		log->info(u8"No serial port: %s\n", serial_error.name());
+	}
 
 	// セグメンテーションの設定
 	initialize_segmentation();
+	// GSベースからCPUごとのデータを引けるようにする
+	cpu::register_online(lapic::id());
 	// ページングの設定
 	setup_identity_page_table();
+	// 例外ハンドラの設定
+	initialize_exception_handlers();
+	// 割り込みハンドラの振り分けの設定
+	irq::initialize();
+	tlb::initialize();
+
+	// CPUの構成を読む
+	if (auto err = acpi::initialize(acpi_table)) {
+		log->error(u8"Failed to parse ACPI tables: %s\n", err.name());
+	}
+
+	// デバイスの割り込み線はI/O APICで受ける
+	if (auto err = ioapic::initialize()) {
+		log->error(u8"Failed to initialize I/O APIC: %s\n", err.name());
+	} else if (serial::is_available()) {
+		if (auto err = serial::enable_interrupt()) {
+			log->error(u8"Failed to enable the serial port interrupt: %s\n", err.name());
+		}
+	}
 
 	// メモリマネージャの設定
-	new (memory_manager) BitmapMemoryManager();
+	memory_manager = new (memory_manager_buf) BitmapMemoryManager();
 	initialize_memory_manager(memory_map, *memory_manager);
+	// APの起動コードを置くページは他に使わせない
+	memory_manager->mark_allocated(FrameID(smp::trampoline_addr / bytes_per_frame), 1);
+
+	// 割り込み用のスタックを用意する
+	if (auto err = initialize_tss(cpu::current_index())) {
+		log->panic("Failed to initialize TSS: %s\n", err.name());
+	}
+
+	// カーネルスタックの下にガードページを置く
+	if (auto err = unmap_page(reinterpret_cast<std::uint64_t>(kernel_main_stack_guard))) {
+		log->panic("Failed to unmap the stack guard page: %s\n", err.name());
+	}
 
-	if (auto err = initialize_heap(*memory_manager)) {
+	// ローダーが読み込んだアセットは読み取り専用にする
+	{
+		const auto font_addr = reinterpret_cast<std::uint64_t>(boot_assets.font);
+		const auto num_pages = (boot_assets.font_size + page_size_4k - 1) / page_size_4k;
+		if (auto err = protect_pages(font_addr, num_pages, PageFlag::global | PageFlag::no_execute)) {
+			log->error("Failed to protect the font: %s\n", err.name());
+		}
+	}
+
+	if (auto err = initialize_heap()) {
 		log->panic("Failed to allocate pages: %s\n", err.name());
 	}
 
+	MessageQueue main_queue_instance;
+	main_queue = &main_queue_instance;
+
 	initialize_lapic_timer();
+	log->info(u8"Local APIC timer: %lu Hz\n", lapic_timer_frequency());
 
-	std::queue<Message> main_queue_instance;
-	main_queue = &main_queue_instance;
+	// 割り込みの開始
+	__asm("sti");
+
+	tsc::initialize();
+	log->info(
+		u8"TSC: %lu Hz, %s, TSC-deadline %s\n",
+		tsc::frequency(),
+		tsc::is_invariant() ? u8"invariant" : u8"variant",
+		tsc::is_deadline_supported() ? u8"supported" : u8"unsupported");
+	trace::initialize();
+
+	start_tickless_timer();
+
+	// ここまでの実行の流れはBSPに固定したメインタスクとして続ける
+	initialize_task_manager("main", TaskPriority::Normal);
+	main_task = &TaskManager::current_task();
+	// 画面への出力はmallocを使うが、newlibのmallocはロックを取らない
+	// メインタスクやxHCIのタスクと同じBSPでだけ出力し、他のCPUと同時にヒープを触らせない
+	TaskManager::set_idle_work([] {
+		if (cpu::current_index() == 0) {
+			deferred_logger->drain();
+		}
+	});
+	deferred_logger->start_deferring();
+
+	log->info(u8"%d CPUs online\n", smp::start_application_processors());
+	graphics::compositor::start_workers();
 
 	initialize_graphics(frame_buffer_config, console_logger);
 
+#ifdef KERNEL_BENCHMARK
+	benchmark::run_all();
+#endif
+
 	auto err = pci::scan_all_bus();
 	log->debug(u8"pci::scan_all_bus(): %s\n", err.name());
 
@@ -137,33 +482,16 @@ kernel_main(const graphics::FrameBufferConfig& frame_buffer_config_ref, const Me
 	}
 	log->info(u8"xHC has been found: %d.%d.%d\n", xhc_device->bus, xhc_device->device, xhc_device->function);
 
-	// 割り込みの設定
-	{
-		set_idt_entry(
-			idt[InterruptVector::xhci],
-			make_idt_attr(DescriptorType::InterruptGate, 0),
-			reinterpret_cast<std::uint64_t>(int_handler_xhci),
-			get_cs());
-		load_idt(sizeof(idt) - 1, reinterpret_cast<std::uintptr_t>(idt.data()));
-
-		const std::uint8_t bsp_local_apic_id = *reinterpret_cast<const std::uint32_t*>(0xfee00020) >> 24;
-
-		const auto err = pci::configure_msi_fixed_destination(
-			*xhc_device,
-			bsp_local_apic_id,
-			pci::MSITriggerMode::Level,
-			pci::MSIDeliveryMode::Fixed,
-			InterruptVector::xhci,
-			0);
-		log->debug(u8"pci::configure_msi_fixed_destination(): %s\n", err.name());
-	}
-
 	const auto xhc_bar = pci::read_bar(*xhc_device, 0);
 	log->debug(u8"pci::read_bar(): %s\n", xhc_bar.error.name());
 
 	const std::uint64_t xhc_mmio_base = xhc_bar.value & ~static_cast<std::uint64_t>(0xf);
 	log->debug(u8"xHC mmio_base = %08lx\n", xhc_mmio_base);
 
+	// シリアルポートはDebugまで受け取るので、マウスの報告ごとのDebugログを毎回書式化して送らないようにする
+	// USBドライバのDebugログが要る時はここを変える
+	usb::logger::SetLogLevel(usb::logger::kInfo);
+
 	usb::xhci::Controller xhc(xhc_mmio_base);
 
 	{
@@ -171,12 +499,12 @@ kernel_main(const graphics::FrameBufferConfig& frame_buffer_config_ref, const Me
 		log->debug(u8"xhc.Initialize(): %s\n", err.Name());
 	}
 
+	// 割り込みの設定
+	configure_xhci_interrupts(*xhc_device, xhc);
+
 	log->info(u8"xHC starting\n");
 	xhc.Run();
 
-	// 割り込みの開始
-	__asm("sti");
-
 	usb::HIDMouseDriver::default_observer = mouse_observer;
 	for (int i = 1; i <= xhc.MaxPorts(); ++i) {
 		auto port = xhc.PortAt(i);
@@ -190,6 +518,21 @@ kernel_main(const graphics::FrameBufferConfig& frame_buffer_config_ref, const Me
 		}
 	}
 
+	// ポートの設定を終えてからxHCを触らせる。それまでに来た割り込みは最初にまとめて処理する
+	// 各タスクは割り込みを受けるCPUに固定する
+	for (int i = 0; i < num_xhci_workers; ++i) {
+		auto& worker = xhci_workers[i];
+		const auto task = TaskManager::new_task(
+			i == 0 ? "xhci" : "xhci-hid",
+			xhci_task_main,
+			reinterpret_cast<std::uint64_t>(&worker),
+			TaskPriority::High,
+			only_cpu(worker.cpu_index));
+		if (task == nullptr) {
+			log->panic(u8"Failed to create the xHCI task\n");
+		}
+	}
+
 	int c = 0;
 	char str[128];
 
@@ -199,39 +542,104 @@ kernel_main(const graphics::FrameBufferConfig& frame_buffer_config_ref, const Me
 	auto group_layer = static_cast<graphics::GroupLayer*>(graphics::layer_manager->find_layer(layer_ids::group_layer));
 	auto test_layer = group_layer->layer_manager().find_layer(layer_ids::test_layer);
 
+	Timer frame_timer_instance;
+	frame_timer_instance.value = frame_timer_value;
+	frame_timer = &frame_timer_instance;
+
+	Timer stats_timer;
+	stats_timer.timeout = current_tick() + timer_frequency;
+	stats_timer.period = timer_frequency;
+	stats_timer.value = stats_timer_value;
+	timer_wheel->add(stats_timer);
+
+	LoopStatistics stats;
+	auto stats_start = tsc::now();
+
+#ifdef KERNEL_PROFILE
+	profile::start_sampling(profile_interval);
+#endif
+
+	// 以降の描画はフレームタイマに合わせて画面に反映する
+	graphics::layer_manager->set_frame_request_handler(request_frame);
+	graphics::layer_manager->set_frame_paced(true);
+
 	while (true) {
-		++c;
-		std::snprintf(str, sizeof(str), u8"%010u", c);
-		{
-			auto painter = main_window_layer->start_paint();
-			painter.draw_filled_rectangle(graphics::Rect<int>::with_size({24, 28}, {8 * 10, 16}), {0xc6c6c6});
-			painter.draw_string({24, 28}, str, {0x000000});
+		// 溜まっているMessageをまとめて取り出し、タイマは1回の処理にまとめる
+		bool input_pending = false;
+		std::uint64_t first_input_timestamp = 0;
+		bool frame_pending = false;
+		bool stats_pending = false;
+
+		// マウスの移動はドラッグの状態が変わるので1つずつ順番に反映する
+		// バッチ中の描画は最後に1回だけ画面に反映する
+		graphics::layer_manager->begin_batch();
+
+		std::size_t num_messages = 0;
+		while (num_messages < max_batch_size) {
+			const auto msg = main_queue->pop();
+			if (!msg) {
+				break;
+			}
+			++num_messages;
+
+			switch (msg->type) {
+			case Message::Type::MouseMove:
+				if (!input_pending) {
+					input_pending = true;
+					first_input_timestamp = msg->arg.mouse.timestamp;
+				}
+				on_mouse_move(msg->arg.mouse.buttons, msg->arg.mouse.dx, msg->arg.mouse.dy);
+				break;
+			case Message::Type::TimerTimeout:
+				if (msg->arg.timer.value == frame_timer_value) {
+					frame_pending = true;
+				} else if (msg->arg.timer.value == stats_timer_value) {
+					stats_pending = true;
+				}
+				break;
+			default:
+				log->error(u8"Unknown message type: %d\n", static_cast<int>(msg->type));
+			}
 		}
-		test_layer->move({10, c % 100});
 
-		__asm__("cli");
-		if (main_queue->empty()) {
-			__asm__("sti;"
-					//"hlt;"
-			);
+		if (num_messages == 0) {
+			graphics::layer_manager->end_batch();
+
+			__asm__("cli");
+			// 割り込みを禁止したまま確認して眠るので、確認してから眠るまでに送られたMessageで起き損ねることはない
+			if (main_queue->empty()) {
+				TaskManager::sleep();
+			}
+			__asm__("sti");
 			continue;
 		}
 
-		const auto msg = main_queue->front();
-		main_queue->pop();
-		__asm("sti");
-
-		switch (msg.type) {
-		case Message::Type::InterruptXHCI:
-			while (xhc.PrimaryEventRing()->HasFront()) {
-				if (auto err = ProcessEvent(xhc)) {
-					log->error(u8"Error while ProcessEvent: %s at %s:%d\n", err.Name(), err.File(), err.Line());
-				}
+		stats.message_count += num_messages;
+		++stats.batch_count;
+
+		// 毎フレーム描くとフレームタイマが止まらずアイドルにならないので、カウンタとtest_layerは集計ごとに動かす
+		if (stats_pending) {
+			const auto now = tsc::now();
+			stats.report(now - stats_start);
+			stats_start = now;
+
+			++c;
+			std::snprintf(str, sizeof(str), u8"%08u CPU%3u%%", c, stats.cpu_usage);
+			{
+				auto painter = main_window_layer->start_paint();
+				painter.draw_filled_rectangle(graphics::Rect<int>::with_size({24, 28}, {8 * 16, 16}), {0xc6c6c6});
+				painter.draw_string({24, 28}, str, {0x000000});
 			}
+			test_layer->move({10, c % 100});
+		}
+
+		graphics::layer_manager->end_batch();
+		if (frame_pending) {
+			graphics::layer_manager->present();
+		}
 
-			break;
-		default:
-			log->error(u8"Unknown message type: %d\n", static_cast<int>(msg.type));
+		if (input_pending) {
+			stats.add_input_latency(tsc::now() - first_input_timestamp);
 		}
 	}
 }
@@ -68,4 +68,6 @@ private:
 	void set_bit(FrameID frame, bool allocated);
 };
 
+inline BitmapMemoryManager* memory_manager;
+
 void initialize_memory_manager(const MemoryMap& memory_map, BitmapMemoryManager& memory_manager);
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+#include "mpmc_queue.hpp"
+#include "task.hpp"
+
+// 割り込みハンドラなどからメインループに送る通知
+struct Message {
+	enum class Type {
+		TimerTimeout,
+		MouseMove,
+	} type;
+
+	union {
+		struct {
+			std::uint64_t timeout;
+			int value;
+		} timer;
+
+		struct {
+			// 元になったxHCの割り込みが起きた時刻(ns)
+			std::uint64_t timestamp;
+			std::uint8_t buttons;
+			std::int8_t dx;
+			std::int8_t dy;
+		} mouse;
+	} arg;
+};
+
+// 割り込みハンドラや他のタスクからメインタスクへ渡すキュー。送り手はどのCPUにいてもよい
+using MessageQueue = MpmcQueue<Message, 256>;
+inline MessageQueue* main_queue;
+// main_queueを読むタスク
+inline Task* main_task;
+
+// main_queueにMessageを積んでメインタスクを起こす。割り込みハンドラや他のCPUからも呼べる
+inline void post_message(const Message& msg) {
+	main_queue->push(msg);
+	if (main_task != nullptr) {
+		TaskManager::wakeup(*main_task);
+	}
+}
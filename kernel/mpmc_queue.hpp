@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// 書き込む側も読み出す側も複数でよい固定長リングバッファ
+// 要素ごとの番号で書き込みと読み出しの順番を決めるので、ロックを取らずに割り込みハンドラや複数のCPUから使える
+// 書き込みの途中で割り込まれた要素より後ろは、その書き込みが終わるまで読み出せない
+template <typename T, std::size_t Capacity>
+class MpmcQueue {
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+public:
+	MpmcQueue() {
+		for (std::size_t i = 0; i < Capacity; ++i) {
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	// 満杯ならvalueを捨ててfalseを返す
+	bool push(const T& value) {
+		auto pos = tail_.load(std::memory_order_relaxed);
+		while (true) {
+			auto& cell = cells_[pos & mask];
+			const auto diff = static_cast<std::intptr_t>(cell.sequence.load(std::memory_order_acquire) - pos);
+			if (diff == 0) {
+				// 失敗すればposに今のtail_が入る
+				if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.value = value;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				// 1周前の要素がまだ読み出されていない
+				overflow_count_.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			} else {
+				pos = tail_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	std::optional<T> pop() {
+		auto pos = head_.load(std::memory_order_relaxed);
+		while (true) {
+			auto& cell = cells_[pos & mask];
+			const auto diff = static_cast<std::intptr_t>(cell.sequence.load(std::memory_order_acquire) - (pos + 1));
+			if (diff == 0) {
+				if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					T value = cell.value;
+					cell.sequence.store(pos + Capacity, std::memory_order_release);
+					return value;
+				}
+			} else if (diff < 0) {
+				// 空か、次の要素を書き込んでいる途中
+				return std::nullopt;
+			} else {
+				pos = head_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// 書き込みの途中の要素があればfalseを返すので、その後のpop()が空を返すこともある
+	bool empty() const {
+		return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+	}
+
+	// 満杯で捨てた要素の数
+	std::uint64_t overflow_count() const {
+		return overflow_count_.load(std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr std::size_t mask = Capacity - 1;
+
+	struct Cell {
+		// posの位置にこの要素が書き込めるならpos、読み出せるならpos + 1
+		std::atomic<std::size_t> sequence;
+		T value;
+	};
+
+	std::array<Cell, Capacity> cells_;
+	// 書き込む側と読み出す側で別々のキャッシュラインに置く
+	alignas(64) std::atomic<std::size_t> head_{0};
+	alignas(64) std::atomic<std::size_t> tail_{0};
+	std::atomic<std::uint64_t> overflow_count_{0};
+};
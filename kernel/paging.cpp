@@ -2,28 +2,395 @@
 
 #include <array>
 #include <cstdint>
+#include <cstring>
 
 #include <asmfunc.hpp>
 
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "tlb.hpp"
+
+extern "C" const std::uint8_t __kernel_text_start[];
+extern "C" const std::uint8_t __kernel_rodata_start[];
+extern "C" const std::uint8_t __kernel_data_start[];
+extern "C" const std::uint8_t __kernel_end[];
+
 namespace {
-	constexpr std::uint64_t page_size_4k = 4096;
-	constexpr std::uint64_t page_size_2m = 512 * page_size_4k;
-	constexpr std::uint64_t page_size_1g = 512 * page_size_2m;
+	using PageTable = std::array<std::uint64_t, 512>;
+
+	constexpr std::uint64_t entry_address_mask = 0x000f'ffff'ffff'f000;
+
+	// メモリマネージャが使えるようになる前に使うページテーブル
+	constexpr std::size_t early_page_table_count = 16;
+
+	alignas(page_size_4k) PageTable pml4_table;
+	alignas(page_size_4k) PageTable pdp_table;
+	alignas(page_size_4k) std::array<PageTable, page_directory_count> page_directory;
+	alignas(page_size_4k) std::array<PageTable, early_page_table_count> early_page_tables;
+	std::size_t early_page_tables_used = 0;
+
+	struct DemandZeroRegion {
+		std::uint64_t begin;
+		std::uint64_t end;
+	};
+
+	constexpr std::uint64_t cr4_pge = 1u << 7;
+	constexpr std::uint64_t cr4_pcide = 1u << 17;
+	constexpr std::uint64_t cr3_no_flush = 1ull << 63;
+	constexpr std::uint64_t cr0_wp = 1u << 16;
+	constexpr std::uint32_t msr_efer = 0xc000'0080;
+	constexpr std::uint64_t efer_nxe = 1u << 11;
+
+	bool pcid_enabled = false;
+	// NXに対応していない時にPageFlag::no_executeを落とすためのマスク
+	std::uint64_t supported_flags_mask = ~PageFlag::no_execute;
+
+	std::array<DemandZeroRegion, 8> demand_zero_regions;
+	std::size_t num_demand_zero_regions = 0;
+	std::uint64_t demand_zero_area_next = demand_zero_area_begin;
+
+	PageTable* allocate_page_table() {
+		PageTable* table = nullptr;
+
+		if (memory_manager != nullptr) {
+			const auto frame = memory_manager->allocate(1);
+			if (frame.error) {
+				return nullptr;
+			}
+			table = reinterpret_cast<PageTable*>(frame.value.frame());
+		} else if (early_page_tables_used < early_page_tables.size()) {
+			table = &early_page_tables[early_page_tables_used++];
+		} else {
+			return nullptr;
+		}
+
+		table->fill(0);
+		return table;
+	}
+
+	PageTable* table_at(std::uint64_t entry) {
+		return reinterpret_cast<PageTable*>(entry & entry_address_mask);
+	}
+
+	// level: 3 = PML4, 2 = PDPT, 1 = PD, 0 = PT
+	std::size_t index_at(std::uint64_t virt_addr, int level) {
+		return (virt_addr >> (12 + 9 * level)) & 0x1ffu;
+	}
+
+	// 2MiBページを同じ属性の4KiBページ512個に分割する
+	Error split_large_page(std::uint64_t& pd_entry) {
+		auto table = allocate_page_table();
+		if (table == nullptr) {
+			return Error::Code::NoEnoughMemory;
+		}
+
+		const auto base = pd_entry & entry_address_mask;
+		const auto flags = (pd_entry & ~entry_address_mask) & ~PageFlag::huge;
+		for (std::size_t i = 0; i < table->size(); ++i) {
+			(*table)[i] = (base + i * page_size_4k) | flags;
+		}
 
-	alignas(page_size_4k) std::array<std::uint64_t, 512> pml4_table;
-	alignas(page_size_4k) std::array<std::uint64_t, 512> pdp_table;
-	alignas(page_size_4k) std::array<std::array<std::uint64_t, 512>, page_directory_count> page_directory;
+		pd_entry = reinterpret_cast<std::uint64_t>(table) | PageFlag::present | PageFlag::writable;
+		// 分割前の2MiBページのTLBエントリを捨てる
+		// 2MiBページのエントリは、その中のどのアドレスをinvlpgしても消える
+		tlb::queue_invalidate(base, page_size_4k);
+		return Error::Code::Success;
+	}
+
+	// virt_addrに対応するPTのエントリを返す
+	// 途中に2MiBページがあれば分割する。createがtrueなら存在しないテーブルを作る
+	WithError<std::uint64_t*> find_page_entry(std::uint64_t virt_addr, bool create) {
+		PageTable* table = &pml4_table;
+
+		for (int level = 3; level > 0; --level) {
+			auto& entry = (*table)[index_at(virt_addr, level)];
+
+			if ((entry & PageFlag::present) == 0) {
+				if (!create) {
+					return {nullptr, Error::Code::NotMapped};
+				}
+
+				auto next = allocate_page_table();
+				if (next == nullptr) {
+					return {nullptr, Error::Code::NoEnoughMemory};
+				}
+				entry = reinterpret_cast<std::uint64_t>(next) | PageFlag::present | PageFlag::writable;
+			} else if ((entry & PageFlag::huge) != 0) {
+				// 1GiBページは使っていない
+				if (level != 1) {
+					return {nullptr, Error::Code::NotImplemented};
+				}
+
+				if (auto err = split_large_page(entry)) {
+					return {nullptr, err};
+				}
+			}
+
+			table = table_at(entry);
+		}
+
+		return {&(*table)[index_at(virt_addr, 0)], Error::Code::Success};
+	}
+
+	const DemandZeroRegion* find_demand_zero_region(std::uint64_t addr) {
+		for (std::size_t i = 0; i < num_demand_zero_regions; ++i) {
+			const auto& region = demand_zero_regions[i];
+			if (region.begin <= addr && addr < region.end) {
+				return &region;
+			}
+		}
+		return nullptr;
+	}
+
+	void enable_no_execute() {
+		std::uint32_t eax, ebx, ecx, edx;
+		get_cpuid(0x8000'0000, 0, &eax, &ebx, &ecx, &edx);
+		if (eax < 0x8000'0001) {
+			return;
+		}
+
+		get_cpuid(0x8000'0001, 0, &eax, &ebx, &ecx, &edx);
+		if ((edx & (1u << 20)) == 0) {
+			return;
+		}
+
+		write_msr(msr_efer, read_msr(msr_efer) | efer_nxe);
+		supported_flags_mask = ~static_cast<std::uint64_t>(0);
+	}
+
+	std::uint64_t addr_of(const std::uint8_t* p) {
+		return reinterpret_cast<std::uint64_t>(p);
+	}
+
+	// アイデンティティマップ上のaddrのページに付けるべき権限
+	std::uint64_t identity_page_flags(std::uint64_t addr) {
+		auto flags = PageFlag::present | PageFlag::global;
+
+		if (addr_of(__kernel_text_start) <= addr && addr < addr_of(__kernel_rodata_start)) {
+			// .text
+		} else if (addr_of(__kernel_rodata_start) <= addr && addr < addr_of(__kernel_data_start)) {
+			flags |= PageFlag::no_execute;
+		} else {
+			flags |= PageFlag::writable | PageFlag::no_execute;
+		}
+		return flags & supported_flags_mask;
+	}
+
+	// 2MiBページ全体が同じ権限ならtrue
+	// .data以降とカーネル外は同じ権限なのでカーネルの.textと.rodataを含むかだけ見ればよい
+	bool is_uniform_large_page(std::uint64_t addr) {
+		const auto end = addr + page_size_2m;
+		return end <= addr_of(__kernel_text_start) || addr_of(__kernel_data_start) <= addr;
+	}
+
+	// 権限が一様でない2MiBページを分割してページ単位で権限を設定する
+	void protect_kernel_sections() {
+		InterruptGuard guard;
+		const auto begin = addr_of(__kernel_text_start) & ~(page_size_2m - 1);
+		const auto end = addr_of(__kernel_data_start);
+
+		for (auto large_page = begin; large_page < end; large_page += page_size_2m) {
+			for (auto addr = large_page; addr < large_page + page_size_2m; addr += page_size_4k) {
+				const auto entry = find_page_entry(addr, false);
+				if (entry.error) {
+					// 2MiBページのままだと.textが書き込み可能でデータが実行可能になるので、そのまま続けない
+					log->panic(u8"Failed to split the kernel page at %08lx: %s\n", addr, entry.error.name());
+				}
+
+				*entry.value = addr | identity_page_flags(addr);
+			}
+		}
+
+		// 書き込み禁止のページにはカーネルからの書き込みも禁止する
+		set_cr0(get_cr0() | cr0_wp);
+		tlb::queue_flush_all();
+		tlb::flush();
+	}
+
+	void enable_tlb_features() {
+		std::uint32_t eax, ebx, ecx, edx;
+		get_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+		const bool pge_supported = (edx & (1u << 13)) != 0;
+		const bool pcid_supported = (ecx & (1u << 17)) != 0;
+
+		auto cr4 = get_cr4();
+		if (pge_supported) {
+			cr4 |= cr4_pge;
+		}
+		// CR3の下位12bitが0(PCID 0)の時にしかPCIDEを立てられない
+		if (pcid_supported && (get_cr3() & 0xfffu) == 0) {
+			cr4 |= cr4_pcide;
+			pcid_enabled = true;
+		}
+		set_cr4(cr4);
+	}
 }
 
 void setup_identity_page_table() {
+	enable_no_execute();
+
 	pml4_table[0] = reinterpret_cast<std::uint64_t>(&pdp_table[0]) | 0x003;
 	for (int i_pdpt = 0; i_pdpt < page_directory.size(); ++i_pdpt) {
 		pdp_table[i_pdpt] = reinterpret_cast<std::uint64_t>(&page_directory[i_pdpt]) | 0x003;
 
 		for (int i_pd = 0; i_pd < 512; ++i_pd) {
-			page_directory[i_pdpt][i_pd] = i_pdpt * page_size_1g + i_pd * page_size_2m | 0x083;
+			const std::uint64_t addr = i_pdpt * page_size_1g + i_pd * page_size_2m;
+			// カーネルの.textを含む2MiBページは分割するまで実行可能にしておく
+			const auto nx = is_uniform_large_page(addr) ? PageFlag::no_execute : 0;
+			page_directory[i_pdpt][i_pd] = (addr | 0x183 | nx) & supported_flags_mask;
 		}
 	}
 
 	set_cr3(reinterpret_cast<std::uint64_t>(&pml4_table[0]));
+	protect_kernel_sections();
+	enable_tlb_features();
+}
+
+bool is_pcid_enabled() {
+	return pcid_enabled;
+}
+
+std::uint64_t kernel_page_table() {
+	return reinterpret_cast<std::uint64_t>(&pml4_table[0]);
+}
+
+WithError<std::uint64_t> clone_kernel_page_table() {
+	auto table = allocate_page_table();
+	if (table == nullptr) {
+		return {0, Error::Code::NoEnoughMemory};
+	}
+
+	*table = pml4_table;
+	return {reinterpret_cast<std::uint64_t>(table), Error::Code::Success};
+}
+
+void switch_page_table(std::uint64_t pml4_addr, std::uint16_t pcid, bool flush) {
+	if (!pcid_enabled) {
+		set_cr3(pml4_addr);
+		return;
+	}
+
+	auto value = pml4_addr | (pcid & 0xfffu);
+	if (!flush) {
+		value |= cr3_no_flush;
+	}
+	set_cr3(value);
+}
+
+Error map_page(std::uint64_t virt_addr, std::uint64_t phys_addr, std::uint64_t flags) {
+	// 無効化を予約してからflush()するまで同じCPUで続ける
+	InterruptGuard guard;
+	const auto entry = find_page_entry(virt_addr, true);
+	if (entry.error) {
+		return entry.error;
+	}
+
+	const auto old_entry = *entry.value;
+	*entry.value = ((phys_addr & entry_address_mask) | flags | PageFlag::present) & supported_flags_mask;
+
+	// 存在しなかったページはTLBに載っていない
+	if ((old_entry & PageFlag::present) != 0) {
+		tlb::queue_invalidate(virt_addr, page_size_4k);
+	}
+	tlb::flush();
+	return Error::Code::Success;
+}
+
+Error unmap_page(std::uint64_t virt_addr) {
+	return unmap_pages(virt_addr, 1);
+}
+
+Error unmap_pages(std::uint64_t virt_addr, std::size_t num_pages) {
+	InterruptGuard guard;
+	Error err = Error::Code::Success;
+
+	for (std::size_t i = 0; i < num_pages; ++i) {
+		const auto addr = virt_addr + i * page_size_4k;
+		const auto entry = find_page_entry(addr, false);
+		if (entry.error == Error::Code::NotMapped) {
+			continue;
+		} else if (entry.error) {
+			err = entry.error;
+			break;
+		}
+
+		if ((*entry.value & PageFlag::present) != 0) {
+			*entry.value = 0;
+			tlb::queue_invalidate(addr, page_size_4k);
+		}
+	}
+
+	// 全ページを書き換えてからまとめて無効化する
+	tlb::flush();
+	return err;
+}
+
+Error protect_pages(std::uint64_t virt_addr, std::size_t num_pages, std::uint64_t flags) {
+	InterruptGuard guard;
+	Error err = Error::Code::Success;
+
+	for (std::size_t i = 0; i < num_pages; ++i) {
+		const auto addr = virt_addr + i * page_size_4k;
+		const auto entry = find_page_entry(addr, false);
+		if (entry.error) {
+			err = entry.error;
+			break;
+		}
+
+		if ((*entry.value & PageFlag::present) == 0) {
+			err = Error::Code::NotMapped;
+			break;
+		}
+
+		*entry.value = ((*entry.value & entry_address_mask) | flags | PageFlag::present) & supported_flags_mask;
+		tlb::queue_invalidate(addr, page_size_4k);
+	}
+
+	tlb::flush();
+	return err;
+}
+
+WithError<std::uint64_t> reserve_demand_zero_region(std::size_t size) {
+	if (num_demand_zero_regions == demand_zero_regions.size()) {
+		return {0, Error::Code::Full};
+	}
+
+	const auto begin = demand_zero_area_next;
+	const auto end = begin + (size + page_size_4k - 1) / page_size_4k * page_size_4k;
+
+	demand_zero_regions[num_demand_zero_regions] = {begin, end};
+	++num_demand_zero_regions;
+
+	// 次の領域との間には未マップのページを1つ挟んでおく
+	demand_zero_area_next = end + page_size_4k;
+	return {begin, Error::Code::Success};
+}
+
+bool handle_page_fault(std::uint64_t fault_addr, std::uint64_t error_code) {
+	// 存在するページへの保護違反は解決できない
+	if ((error_code & 0x1u) != 0) {
+		return false;
+	}
+
+	if (find_demand_zero_region(fault_addr) == nullptr || memory_manager == nullptr) {
+		return false;
+	}
+
+	const auto frame = memory_manager->allocate(1);
+	if (frame.error) {
+		return false;
+	}
+
+	std::memset(frame.value.frame(), 0, bytes_per_frame);
+
+	const auto page_addr = fault_addr & ~(page_size_4k - 1);
+	const auto flags = PageFlag::writable | PageFlag::global | PageFlag::no_execute;
+	if (map_page(page_addr, reinterpret_cast<std::uint64_t>(frame.value.frame()), flags)) {
+		memory_manager->free(frame.value, 1);
+		return false;
+	}
+
+	return true;
 }
@@ -1,7 +1,56 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
 
 constexpr std::size_t page_directory_count = 64;
 
+constexpr std::uint64_t page_size_4k = 4096;
+constexpr std::uint64_t page_size_2m = 512 * page_size_4k;
+constexpr std::uint64_t page_size_1g = 512 * page_size_2m;
+
+namespace PageFlag {
+	inline constexpr std::uint64_t present = 0x001;
+	inline constexpr std::uint64_t writable = 0x002;
+	inline constexpr std::uint64_t user = 0x004;
+	inline constexpr std::uint64_t huge = 0x080;
+	// CR4.PGEが有効ならCR3を切り替えてもTLBから追い出されない
+	inline constexpr std::uint64_t global = 0x100;
+	// CPUがNXに対応していなければページテーブルに書き込む時に落とされる
+	inline constexpr std::uint64_t no_execute = 1ull << 63;
+}
+
+// アイデンティティマップの直後から始まる、必要に応じて割り当てる仮想アドレス領域
+constexpr std::uint64_t demand_zero_area_begin = page_directory_count * page_size_1g;
+
+// アイデンティティマップを作り、カーネルの各セクションに合わせた権限(W^X)を設定する
 void setup_identity_page_table();
+
+// PCIDが有効ならtrue。無効な時はpcidに0しか使えない
+bool is_pcid_enabled();
+
+// カーネルのページテーブル(PML4)のアドレス
+std::uint64_t kernel_page_table();
+// カーネル空間のマッピングを共有する新しいPML4を作る
+WithError<std::uint64_t> clone_kernel_page_table();
+// CR3をpml4_addrに切り替える
+// PCIDが有効でflushがfalseならpcidに対応するTLBエントリを残したまま切り替える
+void switch_page_table(std::uint64_t pml4_addr, std::uint16_t pcid, bool flush);
+
+// virt_addrを含む4KiBページをphys_addrにマップする
+// 必要ならページテーブルを割り当て、2MiBページを分割する
+Error map_page(std::uint64_t virt_addr, std::uint64_t phys_addr, std::uint64_t flags);
+// virt_addrを含む4KiBページをマップされていない状態にする
+Error unmap_page(std::uint64_t virt_addr);
+// virt_addrから連続するnum_pages個の4KiBページのマップを外し、TLBの無効化を1回にまとめる
+Error unmap_pages(std::uint64_t virt_addr, std::size_t num_pages);
+// virt_addrから連続するnum_pages個のマップ済みページの権限をflagsに変更する
+Error protect_pages(std::uint64_t virt_addr, std::size_t num_pages, std::uint64_t flags);
+
+// 触れられた時に初めてゼロ埋めされたフレームが割り当てられる領域をsizeバイト予約する
+WithError<std::uint64_t> reserve_demand_zero_region(std::size_t size);
+
+// ページフォルトを解決できたらtrue
+bool handle_page_fault(std::uint64_t fault_addr, std::uint64_t error_code);
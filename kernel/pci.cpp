@@ -61,7 +61,7 @@ namespace pci {
 		return 0x10 + 4 * bar_index;
 	}
 
-	WithError<std::uint64_t> read_bar(Device& device, unsigned int bar_index) {
+	WithError<std::uint64_t> read_bar(const Device& device, unsigned int bar_index) {
 		if (bar_index >= 6) {
 			return {0, Error::Code::IndexOutOfRange};
 		}
@@ -277,30 +277,121 @@ namespace pci {
 		return Error::Code::Success;
 	}
 
-	Error configure_msi(
-		const Device& device,
-		std::uint32_t msg_addr,
-		std::uint32_t msg_data,
-		unsigned int num_vector_exponent) {
-		std::uint8_t cap_addr = read_conf_reg(device, 0x34) & 0xffu;
-		std::uint8_t msi_cap_addr = 0;
-		std::uint8_t msix_cap_addr = 0;
+	union MSIXCapabilityHeader {
+		std::uint32_t data;
+		struct {
+			std::uint32_t cap_id : 8;
+			std::uint32_t next_ptr : 8;
+			// エントリ数 - 1
+			std::uint32_t table_size : 11;
+			std::uint32_t : 3;
+			std::uint32_t function_mask : 1;
+			std::uint32_t msix_enable : 1;
+		} __attribute__((packed)) bits;
+	} __attribute__((packed));
+
+	// MSI-Xテーブルの1エントリ。BARが指すメモリ空間に置かれる
+	struct MSIXTableEntry {
+		std::uint32_t msg_addr;
+		std::uint32_t msg_upper_addr;
+		std::uint32_t msg_data;
+		std::uint32_t vector_control;
+	} __attribute__((packed));
 
+	static constexpr std::uint32_t msix_vector_masked = 1;
+
+	// capability_idのケーパビリティのコンフィグレーション空間上のアドレス。無ければ0
+	std::uint8_t find_capability(const Device& device, std::uint8_t capability_id) {
+		std::uint8_t cap_addr = read_conf_reg(device, 0x34) & 0xffu;
 		while (cap_addr != 0) {
 			auto header = read_capability_header(device, cap_addr);
-			if (header.bits.cap_id == capability_msi) {
-				msi_cap_addr = cap_addr;
-			} else if (header.bits.cap_id == capability_msix) {
-				msix_cap_addr = cap_addr;
+			if (header.bits.cap_id == capability_id) {
+				return cap_addr;
 			}
 
 			cap_addr = header.bits.next_ptr;
 		}
 
-		if (msi_cap_addr != 0) {
+		return 0;
+	}
+
+	std::uint32_t make_msi_address(std::uint8_t apic_id) {
+		return 0xfee00000u | (apic_id << 12);
+	}
+
+	std::uint32_t make_msi_data(MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode, std::uint8_t vector) {
+		std::uint32_t msg_data = (static_cast<std::uint32_t>(delivery_mode) << 8) | vector;
+		if (trigger_mode == MSITriggerMode::Level) {
+			msg_data |= 0xc000;
+		}
+		return msg_data;
+	}
+
+	WithError<volatile MSIXTableEntry*> msix_table(const Device& device, std::uint8_t cap_addr) {
+		const auto table_reg = read_conf_reg(device, cap_addr + 4);
+		const auto bar = read_bar(device, table_reg & 0x7u);
+		if (bar.error) {
+			return {nullptr, bar.error};
+		}
+
+		const std::uint64_t table_addr = (bar.value & ~static_cast<std::uint64_t>(0xf)) + (table_reg & ~0x7u);
+		return {reinterpret_cast<volatile MSIXTableEntry*>(table_addr), Error::Code::Success};
+	}
+
+	Error configure_msix_register(
+		const Device& device,
+		std::uint8_t cap_addr,
+		unsigned int entry_index,
+		std::uint32_t msg_addr,
+		std::uint32_t msg_data) {
+		MSIXCapabilityHeader header;
+		header.data = read_conf_reg(device, cap_addr);
+		if (entry_index > header.bits.table_size) {
+			return Error::Code::IndexOutOfRange;
+		}
+
+		const auto table = msix_table(device, cap_addr);
+		if (table.error) {
+			return table.error;
+		}
+
+		// MSIとMSI-Xを同時に有効にしてはいけない
+		if (const auto msi_cap_addr = find_capability(device, capability_msi)) {
+			auto msi_cap = read_msi_capability(device, msi_cap_addr);
+			if (msi_cap.header.bits.msi_enable) {
+				msi_cap.header.bits.msi_enable = 0;
+				write_conf_reg(device, msi_cap_addr, msi_cap.header.data);
+			}
+		}
+
+		// エントリを書き換えている途中の割り込みが飛ばないように、全体をマスクしてから書き換える
+		header.bits.msix_enable = 1;
+		header.bits.function_mask = 1;
+		write_conf_reg(device, cap_addr, header.data);
+
+		auto& entry = table.value[entry_index];
+		entry.vector_control = entry.vector_control | msix_vector_masked;
+		entry.msg_addr = msg_addr;
+		entry.msg_upper_addr = 0;
+		entry.msg_data = msg_data;
+		entry.vector_control = entry.vector_control & ~msix_vector_masked;
+
+		header.bits.function_mask = 0;
+		write_conf_reg(device, cap_addr, header.data);
+		return Error::Code::Success;
+	}
+
+	Error configure_msi(
+		const Device& device,
+		std::uint32_t msg_addr,
+		std::uint32_t msg_data,
+		unsigned int num_vector_exponent) {
+		if (const auto msi_cap_addr = find_capability(device, capability_msi)) {
 			return configure_msi_register(device, msi_cap_addr, msg_addr, msg_data, num_vector_exponent);
-		} else if (msix_cap_addr != 0) {
-			return Error::Code::NotImplemented;
+		}
+		// MSI-Xしか持たないデバイスは最初のエントリだけを使う
+		if (const auto msix_cap_addr = find_capability(device, capability_msix)) {
+			return configure_msix_register(device, msix_cap_addr, 0, msg_addr, msg_data);
 		}
 		return Error::Code::NoPCIMSI;
 	}
@@ -312,13 +403,42 @@ namespace pci {
 		MSIDeliveryMode delivery_mode,
 		std::uint8_t vector,
 		unsigned int num_vector_exponent) {
-		std::uint32_t msg_addr = 0xfee00000u | (apic_id << 12);
-		std::uint32_t msg_data = (static_cast<std::uint32_t>(delivery_mode) << 8) | vector;
-		if (trigger_mode == MSITriggerMode::Level) {
-			msg_data |= 0xc000;
+		return configure_msi(
+			device,
+			make_msi_address(apic_id),
+			make_msi_data(trigger_mode, delivery_mode, vector),
+			num_vector_exponent);
+	}
+
+	unsigned int msix_table_size(const Device& device) {
+		const auto cap_addr = find_capability(device, capability_msix);
+		if (cap_addr == 0) {
+			return 0;
+		}
+
+		MSIXCapabilityHeader header;
+		header.data = read_conf_reg(device, cap_addr);
+		return header.bits.table_size + 1;
+	}
+
+	Error configure_msix_fixed_destination(
+		const Device& device,
+		unsigned int entry_index,
+		std::uint8_t apic_id,
+		MSITriggerMode trigger_mode,
+		MSIDeliveryMode delivery_mode,
+		std::uint8_t vector) {
+		const auto cap_addr = find_capability(device, capability_msix);
+		if (cap_addr == 0) {
+			return Error::Code::NoPCIMSI;
 		}
 
-		return configure_msi(device, msg_addr, msg_data, num_vector_exponent);
+		return configure_msix_register(
+			device,
+			cap_addr,
+			entry_index,
+			make_msi_address(apic_id),
+			make_msi_data(trigger_mode, delivery_mode, vector));
 	}
 
 	Device* find_xhc_device() {
@@ -40,7 +40,7 @@ namespace pci {
 	std::uint16_t read_vendor_id(std::uint8_t bus, std::uint8_t device, std::uint8_t function);
 	ClassCode read_class_code(std::uint8_t bus, std::uint8_t device, std::uint8_t function);
 
-	WithError<std::uint64_t> read_bar(Device& device, unsigned int bar_index);
+	WithError<std::uint64_t> read_bar(const Device& device, unsigned int bar_index);
 
 	inline std::array<Device, 32> devices;
 	inline int num_devices;
@@ -67,5 +67,17 @@ namespace pci {
 		std::uint8_t vector,
 		unsigned int num_vector_exponent);
 
+	// MSI-Xテーブルのエントリ数。MSI-Xに対応していなければ0
+	unsigned int msix_table_size(const Device& device);
+	// MSI-Xテーブルのentry_index番目のエントリを設定し、MSI-Xを有効にする
+	// MSIが有効になっていれば無効にする
+	Error configure_msix_fixed_destination(
+		const Device& device,
+		unsigned int entry_index,
+		std::uint8_t apic_id,
+		MSITriggerMode trigger_mode,
+		MSIDeliveryMode delivery_mode,
+		std::uint8_t vector);
+
 	Device* find_xhc_device();
 }
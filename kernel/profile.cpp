@@ -0,0 +1,142 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include "cpu.hpp"
+#include "interrupt.hpp"
+#include "irq.hpp"
+#include "lapic.hpp"
+#include "logger.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+#include "timer_wheel.hpp"
+
+namespace {
+	// 書き込むのは持ち主のCPUの割り込みハンドラだけ
+	struct SampleRing {
+		std::array<std::uint64_t, profile::samples_per_cpu> rips;
+		// 書き込んだサンプルの累計。次はcount % samples_per_cpuに書く
+		std::uint64_t count;
+	};
+
+	std::array<SampleRing, cpu::max_count> rings;
+	Timer sample_timer;
+	bool ipi_registered = false;
+
+	// log_event_counts()で前回出力した時の回数
+	std::array<std::array<std::uint64_t, profile::num_events>, cpu::max_count> last_logged_counts;
+
+	void record_sample() {
+		auto& ring = rings[cpu::current_index()];
+		ring.rips[ring.count % profile::samples_per_cpu] = irq::interrupted_context().rip;
+		++ring.count;
+	}
+
+	void on_sample_ipi(void*) {
+		record_sample();
+	}
+
+	void on_sample_timer(Timer&) {
+		record_sample();
+		if (cpu::online_count() > 1) {
+			lapic::send_ipi_all_excluding_self(InterruptVector::profile_sample);
+		}
+	}
+}
+
+std::uint64_t profile::event_count(int cpu_index, Event event) {
+	return *static_cast<volatile std::uint64_t*>(&cpu::of(cpu_index).events[static_cast<int>(event)]);
+}
+
+void profile::log_event_counts() {
+	const int num_cpus = cpu::online_count();
+	for (int event = 0; event < num_events; ++event) {
+		std::uint64_t total = 0;
+		char per_cpu[128] = "";
+		int length = 0;
+		for (int i = 0; i < num_cpus; ++i) {
+			const auto count = event_count(i, static_cast<Event>(event));
+			const auto delta = count - std::exchange(last_logged_counts[i][event], count);
+			total += delta;
+			if (length < static_cast<int>(sizeof(per_cpu))) {
+				length += std::snprintf(
+					per_cpu + length,
+					sizeof(per_cpu) - length,
+					u8"%sCPU%d %lu",
+					i == 0 ? "" : ", ",
+					i,
+					delta);
+			}
+		}
+
+		if (total != 0) {
+			log->debug(u8"event %s: %lu (%s)\n", event_names[event], total, per_cpu);
+		}
+	}
+}
+
+void profile::start_sampling(std::uint64_t interval) {
+	if (!ipi_registered) {
+		if (auto err = irq::register_handler(InterruptVector::profile_sample, on_sample_ipi)) {
+			log->error(u8"Failed to register the profile sample IPI: %s\n", err.name());
+			return;
+		}
+		ipi_registered = true;
+	}
+
+	sample_timer.timeout = current_tick() + interval;
+	sample_timer.period = interval;
+	sample_timer.handler = on_sample_timer;
+	timer_wheel->add(sample_timer);
+	log->info(u8"profile: sampling every %lu ticks\n", interval);
+}
+
+void profile::stop_sampling() {
+	timer_wheel->cancel(sample_timer);
+}
+
+void profile::dump_samples() {
+	// サンプリング中でも書き込まれるので、少しなら新旧が混ざってもよいことにする
+	std::vector<std::uint64_t> rips;
+	const int num_cpus = cpu::online_count();
+	for (int i = 0; i < num_cpus; ++i) {
+		const auto& ring = rings[i];
+		const auto count = std::min<std::uint64_t>(ring.count, samples_per_cpu);
+		rips.insert(rips.end(), ring.rips.begin(), ring.rips.begin() + count);
+	}
+	if (rips.empty()) {
+		return;
+	}
+
+	std::sort(rips.begin(), rips.end());
+	std::vector<std::pair<std::uint64_t, std::uint64_t>> histogram;
+	for (const auto rip : rips) {
+		if (histogram.empty() || histogram.back().first != rip) {
+			histogram.emplace_back(rip, 0);
+		}
+		++histogram.back().second;
+	}
+
+	const auto num_entries = std::min<std::size_t>(histogram.size(), dump_entries);
+	std::partial_sort(
+		histogram.begin(),
+		histogram.begin() + num_entries,
+		histogram.end(),
+		[](const auto& a, const auto& b) { return a.second > b.second; });
+
+	log->debug(
+		u8"profile: %lu samples on %d CPUs, %lu addresses, top %lu\n",
+		rips.size(),
+		num_cpus,
+		histogram.size(),
+		num_entries);
+	for (std::size_t i = 0; i < num_entries; ++i) {
+		const auto [rip, count] = histogram[i];
+		const auto permille = count * 1000 / rips.size();
+		log->debug(u8"profile: %6lu %3lu.%lu%% %016lx\n", count, permille / 10, permille % 10, rip);
+	}
+}
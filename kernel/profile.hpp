@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <kernel_interface/profile.hpp>
+
+// カーネルのどこで時間を使っているかを、処理の回数と割り込まれた時のRIPのサンプリングで調べる
+namespace profile {
+	using namespace kernel_interface::profile;
+
+	// CPUごとに覚えておくサンプルの数。溢れたら古いものから上書きする
+	inline constexpr std::size_t samples_per_cpu = 4096;
+	// dump_samples()で出力するアドレスの数
+	inline constexpr int dump_entries = 32;
+
+	// cpu_indexのCPUでeventを数えた回数。起動してからの累計
+	std::uint64_t event_count(int cpu_index, Event event);
+	// 前回からの回数を、数えたイベントごとにCPU別の内訳とともにdebugで出力する
+	void log_event_counts();
+
+	// interval(tick)ごとに全てのCPUで、割り込まれた時のRIPを記録する
+	// BSPはタイマで自分のRIPを記録し、他のCPUにはIPIを送って記録させる。timer_wheelを作った後にBSPから呼ぶ
+	void start_sampling(std::uint64_t interval);
+	void stop_sampling();
+	// 各CPUの直近のサンプルをRIPごとに数え、多い順にdebugで出力する(画面には出さず、シリアルポートにだけ出る)
+	// 出力はtools/symbolize_profile.pyでkernel.elfの関数ごとの集計に直せる
+	void dump_samples();
+}
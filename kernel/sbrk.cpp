@@ -3,6 +3,9 @@
 #include <cerrno>
 #include <sys/types.h>
 
+#include "memory_manager.hpp"
+#include "paging.hpp"
+
 namespace {
 	caddr_t program_break;
 	caddr_t program_break_end;
@@ -19,14 +22,14 @@ extern "C" caddr_t sbrk(int incr) {
 	return prev_break;
 }
 
-Error initialize_heap(BitmapMemoryManager& memory_manager) {
-	constexpr int heap_frames = 64 * 512;
-	const auto heap_start = memory_manager.allocate(heap_frames);
+Error initialize_heap() {
+	constexpr std::size_t heap_size = 1_gib;
+	const auto heap_start = reserve_demand_zero_region(heap_size);
 	if (heap_start.error) {
 		return heap_start.error;
 	}
 
-	program_break = reinterpret_cast<caddr_t>(heap_start.value.id() * bytes_per_frame);
-	program_break_end = program_break + heap_frames * bytes_per_frame;
+	program_break = reinterpret_cast<caddr_t>(heap_start.value);
+	program_break_end = program_break + heap_size;
 	return Error::Code::Success;
 }
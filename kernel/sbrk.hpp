@@ -1,5 +1,6 @@
 #pragma once
 
-#include "memory_manager.hpp"
+#include "error.hpp"
 
-Error initialize_heap(BitmapMemoryManager& memory_manager);
+// ヒープ用の領域を予約する。物理フレームは触れられた時に割り当てられる
+Error initialize_heap();
@@ -1,13 +1,57 @@
 #include "segment.hpp"
 
 #include <array>
+#include <utility>
 
 #include <asmfunc.hpp>
 
+#include "cpu.hpp"
 #include "interrupt.hpp"
+#include "memory_manager.hpp"
 
 namespace {
-	std::array<SegmentDescriptor, 3> gdt;
+	// ヌル, コード, データのあとに、CPUごとのTSSディスクリプタ(2エントリ分)を並べる
+	constexpr std::size_t tss_descriptor_begin = 3;
+	std::array<SegmentDescriptor, tss_descriptor_begin + 2 * cpu::max_count> gdt;
+
+	std::array<TaskStateSegment, cpu::max_count> tss;
+
+	// 各ISTのスタックのフレーム数
+	constexpr std::size_t nmi_stack_frames = 4;
+	constexpr std::size_t double_fault_stack_frames = 4;
+	constexpr std::size_t irq_stack_frames = 8;
+
+	WithError<std::uint64_t> allocate_stack(std::size_t num_frames) {
+		const auto frame = memory_manager->allocate(num_frames);
+		if (frame.error) {
+			return {0, frame.error};
+		}
+
+		// スタックは上から使うので、確保した領域の終端を返す
+		const auto begin = reinterpret_cast<std::uint64_t>(frame.value.frame());
+		return {begin + num_frames * bytes_per_frame, Error::Code::Success};
+	}
+
+	void set_tss_descriptor(std::size_t index, const TaskStateSegment& segment) {
+		const auto base = reinterpret_cast<std::uint64_t>(&segment);
+		const std::uint32_t limit = sizeof(segment) - 1;
+
+		auto& desc = gdt[index];
+		desc.data = 0;
+		desc.bits.base_low = base & 0xffffu;
+		desc.bits.base_middle = (base >> 16) & 0xffu;
+		desc.bits.base_high = (base >> 24) & 0xffu;
+		desc.bits.limit_low = limit & 0xffffu;
+		desc.bits.limit_high = (limit >> 16) & 0xfu;
+		desc.bits.type = DescriptorType::TSSAvailable;
+		// system segment
+		desc.bits.system_segment = 0;
+		desc.bits.descriptor_privilege_level = 0;
+		desc.bits.present = 1;
+
+		// 2エントリ目にはベースアドレスの上位32ビットが入る
+		gdt[index + 1].data = base >> 32;
+	}
 }
 
 void set_code_segment(
@@ -51,13 +95,40 @@ void setup_segments() {
 	gdt[0].data = 0;
 	set_code_segment(gdt[1], DescriptorType::ExecuteRead, 0, 0, 0xfffff);
 	set_data_segment(gdt[2], DescriptorType::ReadWrite, 0, 0, 0xfffff);
-	load_gdp(sizeof(gdt) - 1, reinterpret_cast<std::uintptr_t>(&gdt[0]));
+}
+
+Error initialize_tss(int cpu_index) {
+	auto& segment = tss[cpu_index];
+	segment = TaskStateSegment{};
+	// I/O許可ビットマップは使わない
+	segment.io_map_base = sizeof(segment);
+
+	const std::pair<std::uint8_t, std::size_t> stacks[] = {
+		{InterruptStackTable::nmi, nmi_stack_frames},
+		{InterruptStackTable::double_fault, double_fault_stack_frames},
+		{InterruptStackTable::irq, irq_stack_frames},
+	};
+	for (const auto& [ist, num_frames] : stacks) {
+		const auto stack_end = allocate_stack(num_frames);
+		if (stack_end.error) {
+			return stack_end.error;
+		}
+		segment.ist[ist - 1] = stack_end.value;
+	}
+
+	const auto index = tss_descriptor_begin + 2 * cpu_index;
+	set_tss_descriptor(index, segment);
+	load_tr(index << 3);
+	return Error::Code::Success;
 }
 
 void initialize_segmentation() {
 	setup_segments();
-	const std::uint16_t kernel_cs = 1 << 3;
-	const std::uint16_t kernel_ss = 2 << 3;
+	load_segmentation();
+}
+
+void load_segmentation() {
+	load_gdp(sizeof(gdt) - 1, reinterpret_cast<std::uintptr_t>(&gdt[0]));
 	set_ds_all(0);
 	set_cs_ss(kernel_cs, kernel_ss);
 }
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 
+#include "error.hpp"
 #include "x86_descriptor.hpp"
 
 union SegmentDescriptor {
@@ -23,5 +24,33 @@ union SegmentDescriptor {
 	} __attribute__((packed)) bits;
 } __attribute__((packed));
 
+// 64ビットモードのTSS
+struct TaskStateSegment {
+	std::uint32_t reserved0;
+	std::uint64_t rsp[3];
+	std::uint64_t reserved1;
+	// ist[i]がIST番号i + 1のスタック
+	std::uint64_t ist[7];
+	std::uint64_t reserved2;
+	std::uint16_t reserved3;
+	std::uint16_t io_map_base;
+} __attribute__((packed));
+
+// GDTの1番目がカーネルのコードセグメント、2番目がデータセグメント
+inline constexpr std::uint16_t kernel_cs = 1 << 3;
+inline constexpr std::uint16_t kernel_ss = 2 << 3;
+
+// IDTのinterrupt_stack_tableに指定する番号
+namespace InterruptStackTable {
+	inline constexpr std::uint8_t nmi = 1;
+	inline constexpr std::uint8_t double_fault = 2;
+	inline constexpr std::uint8_t irq = 3;
+}
+
 void setup_segments();
 void initialize_segmentation();
+// initialize_segmentation()で作ったGDTを実行中のCPUに読み込み、セグメントレジスタを設定する
+void load_segmentation();
+// cpu_index番のCPUのTSSとISTのスタックを用意し、TRに読み込む
+// メモリマネージャを初期化した後に呼ぶ
+Error initialize_tss(int cpu_index);
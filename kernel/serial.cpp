@@ -0,0 +1,176 @@
+#include "serial.hpp"
+
+#include <array>
+
+#include <asmfunc.hpp>
+
+#include "ioapic.hpp"
+#include "irq.hpp"
+#include "lapic.hpp"
+#include "sync.hpp"
+
+namespace {
+	constexpr std::uint16_t com1 = 0x3f8;
+	constexpr std::uint8_t com1_irq = 4;
+
+	// COM1からのオフセット
+	// DLABが1の間はreg_dataとreg_interrupt_enableがボーレートの除数の下位と上位になる
+	constexpr std::uint16_t reg_data = 0;
+	constexpr std::uint16_t reg_interrupt_enable = 1;
+	// 書き込むとFIFO Control、読むとInterrupt Identification
+	constexpr std::uint16_t reg_fifo_control = 2;
+	constexpr std::uint16_t reg_line_control = 3;
+	constexpr std::uint16_t reg_modem_control = 4;
+	constexpr std::uint16_t reg_line_status = 5;
+	constexpr std::uint16_t reg_scratch = 7;
+
+	constexpr std::uint8_t ier_tx_empty = 1u << 1;
+	// FIFOを有効にし、受信と送信のFIFOを空にする
+	constexpr std::uint8_t fcr_enable_and_clear = 0b0000'0111;
+	constexpr std::uint8_t lcr_8n1 = 0b0000'0011;
+	constexpr std::uint8_t lcr_dlab = 1u << 7;
+	// OUT2を立てないとIRQ線に割り込みが出ない
+	constexpr std::uint8_t mcr_dtr_rts_out2 = 0b0000'1011;
+	constexpr std::uint8_t lsr_tx_empty = 1u << 5;
+	constexpr std::uint8_t lsr_tx_idle = 1u << 6;
+
+	constexpr std::uint32_t base_clock = 115200;
+	constexpr std::uint32_t baud_rate = 115200;
+	constexpr int tx_fifo_size = 16;
+
+	bool available = false;
+	bool interrupt_enabled = false;
+
+	// tx_headからtx_tailの手前までが送信待ち。どちらも増やし続け、tx_buffer_sizeで割った位置を使う
+	std::array<char, serial::tx_buffer_size> tx_buffer;
+	std::uint64_t tx_head;
+	std::uint64_t tx_tail;
+	// 送信FIFOに書き込み、空になった割り込みを待っている
+	bool tx_busy = false;
+	serial::Statistics statistics_{};
+	sync::SpinLock tx_lock{"serial"};
+
+	void out(std::uint16_t reg, std::uint8_t value) {
+		io_out_8(com1 + reg, value);
+	}
+
+	std::uint8_t in(std::uint16_t reg) {
+		return io_in_8(com1 + reg);
+	}
+
+	// 送信FIFOが空なら、送信待ちのバイトをFIFOの大きさまで移す。tx_lockを取って呼ぶ
+	void start_transmit() {
+		if (tx_busy || tx_head == tx_tail) {
+			return;
+		}
+
+		if ((in(reg_line_status) & lsr_tx_empty) == 0) {
+			// 割り込みを使うなら、今送っているバイトが終われば割り込みが来る
+			tx_busy = interrupt_enabled;
+			return;
+		}
+
+		for (int i = 0; i < tx_fifo_size && tx_head != tx_tail; ++i) {
+			out(reg_data, tx_buffer[tx_head++ % tx_buffer.size()]);
+		}
+		tx_busy = interrupt_enabled;
+	}
+
+	void on_serial_interrupt(void*) {
+		// Interrupt Identificationを読むと送信FIFOが空になった割り込みの要因が消える
+		in(reg_fifo_control);
+
+		sync::LockGuard guard(tx_lock);
+		++statistics_.interrupts;
+		tx_busy = false;
+		start_transmit();
+	}
+}
+
+Error serial::initialize() {
+	// UARTが無ければスクラッチレジスタに書いた値を読み返せない
+	out(reg_scratch, 0x5a);
+	if (in(reg_scratch) != 0x5a) {
+		return Error::Code::NotFound;
+	}
+
+	constexpr auto divisor = base_clock / baud_rate;
+	out(reg_interrupt_enable, 0);
+	out(reg_line_control, lcr_dlab);
+	out(reg_data, divisor & 0xff);
+	out(reg_interrupt_enable, (divisor >> 8) & 0xff);
+	out(reg_line_control, lcr_8n1);
+	out(reg_fifo_control, fcr_enable_and_clear);
+	out(reg_modem_control, mcr_dtr_rts_out2);
+
+	available = true;
+	return Error::Code::Success;
+}
+
+Error serial::enable_interrupt() {
+	if (!available) {
+		return Error::Code::NotFound;
+	}
+
+	const auto vector = irq::allocate_vector(on_serial_interrupt);
+	if (vector.error) {
+		return vector.error;
+	}
+	if (auto err = ioapic::route_isa_irq(com1_irq, vector.value, lapic::id())) {
+		irq::unregister_handler(vector.value);
+		return err;
+	}
+
+	sync::IrqSaveLockGuard guard(tx_lock);
+	interrupt_enabled = true;
+	// 送信FIFOが既に空なら、有効にした直後に割り込みが来て溜まっている分を送り始める
+	out(reg_interrupt_enable, ier_tx_empty);
+	return Error::Code::Success;
+}
+
+bool serial::is_available() {
+	return available;
+}
+
+void serial::write(const char* data, std::size_t length) {
+	if (!available) {
+		return;
+	}
+
+	sync::IrqSaveLockGuard guard(tx_lock);
+	const auto space = tx_buffer.size() - (tx_tail - tx_head);
+	if (length > space) {
+		// 行の途中で切れないように、入り切らなければ全て捨てる
+		statistics_.dropped_bytes += length;
+		return;
+	}
+
+	for (std::size_t i = 0; i < length; ++i) {
+		tx_buffer[tx_tail++ % tx_buffer.size()] = data[i];
+	}
+	statistics_.written_bytes += length;
+	start_transmit();
+}
+
+void serial::flush() {
+	if (!available) {
+		return;
+	}
+
+	sync::IrqSaveLockGuard guard(tx_lock);
+	while (tx_head != tx_tail) {
+		while ((in(reg_line_status) & lsr_tx_empty) == 0) {
+			__asm__("pause");
+		}
+		tx_busy = false;
+		start_transmit();
+	}
+	while ((in(reg_line_status) & lsr_tx_idle) == 0) {
+		__asm__("pause");
+	}
+}
+
+serial::Statistics serial::statistics() {
+	sync::IrqSaveLockGuard guard(tx_lock);
+	return statistics_;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+// COM1の16550 UARTに送信する
+// 書き込んだバイトはリングバッファに溜め、送信FIFOが空になった割り込みで次の16バイトを移す
+// 書き込む側は送信の完了を待たないので、大量のログやトレースを画面の描画より安く出せる
+namespace serial {
+	// 溜めておけるバイト数。溢れた分は捨てる
+	inline constexpr std::size_t tx_buffer_size = 64 * 1024;
+
+	struct Statistics {
+		std::uint64_t written_bytes;
+		// リングバッファが一杯で捨てたバイト数
+		std::uint64_t dropped_bytes;
+		std::uint64_t interrupts;
+	};
+
+	// COM1を115200bps, 8N1, FIFO有効に設定する。UARTが無ければNotFound
+	// 割り込みを使う前も書き込めるが、送信FIFOが空いた時に書き込んだ分しか送らない
+	Error initialize();
+	// IRQ4をI/O APICで実行中のCPUに届け、送信FIFOが空いた時に割り込ませる
+	// irq::initialize()とioapic::initialize()の後にBSPから呼ぶ
+	Error enable_interrupt();
+
+	bool is_available();
+
+	// lengthバイトを送信待ちにする。割り込みハンドラや他のCPUからも呼べる
+	// 1回の呼び出しで書き込んだバイトは、他の呼び出しのバイトと混ざらずに続けて送られる
+	void write(const char* data, std::size_t length);
+	// 溜まっているバイトを送り終えるまで割り込みを使わずに待つ。panicの時に呼ぶ
+	void flush();
+
+	Statistics statistics();
+}
@@ -0,0 +1,143 @@
+#include "smp.hpp"
+
+#include <atomic>
+#include <cstring>
+
+#include <asmfunc.hpp>
+
+#include "acpi.hpp"
+#include "cpu.hpp"
+#include "interrupt.hpp"
+#include "irq.hpp"
+#include "lapic.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "segment.hpp"
+#include "task.hpp"
+#include "tsc.hpp"
+
+namespace {
+	// asmfunc.sのap_trampoline_paramsと並びを合わせる
+	struct TrampolineParams {
+		std::uint64_t cr3;
+		std::uint64_t efer;
+		std::uint64_t cr0;
+		std::uint64_t cr4;
+		std::uint64_t stack_end;
+		std::uint64_t entry;
+	};
+
+	constexpr std::uint32_t msr_efer = 0xc000'0080;
+	// ロングモードで動いていることを示すビット。書き込んではいけない
+	constexpr std::uint64_t efer_lma = 1u << 10;
+
+	// 各APの通常時のスタックのフレーム数
+	constexpr std::size_t ap_stack_frames = 16;
+
+	// INITの後にStartup IPIを送るまでの待ち時間
+	constexpr std::uint64_t init_delay_ns = 10'000'000;
+	// 1回目のStartup IPIで起動しなければ2回目を送るまでの待ち時間
+	constexpr std::uint64_t startup_retry_ns = 200'000;
+	// 起動を諦めるまでの待ち時間
+	constexpr std::uint64_t online_timeout_ns = 100'000'000;
+
+	// 起動中のAPが初期化を終えたら自分のCPU番号を書き込む
+	std::atomic<int> started_index{-1};
+
+	void wait_ns(std::uint64_t ns) {
+		const auto deadline = tsc::now() + ns;
+		while (tsc::now() < deadline) {
+			__asm__("pause");
+		}
+	}
+
+	bool wait_started(std::uint64_t timeout_ns) {
+		const auto deadline = tsc::now() + timeout_ns;
+		while (started_index.load(std::memory_order_acquire) < 0) {
+			if (tsc::now() >= deadline) {
+				return false;
+			}
+			__asm__("pause");
+		}
+		return true;
+	}
+
+	// 起動コードから呼ばれるAPの入口。ページングと制御レジスタはBSPと同じになっている
+	[[noreturn]] void ap_main() {
+		load_segmentation();
+		const int index = cpu::register_online(lapic::id());
+		load_idt(sizeof(idt) - 1, reinterpret_cast<std::uintptr_t>(idt.data()));
+		irq::initialize_local();
+
+		if (auto err = initialize_tss(index)) {
+			log->panic("Failed to initialize TSS of CPU %d: %s\n", index, err.name());
+		}
+
+		// BSPが起動を待っている間にヒープを使う
+		initialize_task_manager("idle", TaskPriority::Idle);
+
+		started_index.store(index, std::memory_order_release);
+
+		// 他のCPUの実行待ちのタスクを盗んで実行し、無ければTLB shootdownなどのIPIを受けながら休む
+		TaskManager::run_idle();
+	}
+}
+
+int smp::start_application_processors() {
+	// 起動コードのページはアイデンティティマップで実行禁止になっているので、起動する間だけ実行可能にする
+	if (auto err = protect_pages(trampoline_addr, 1, PageFlag::writable | PageFlag::global)) {
+		log->error(u8"Failed to map the AP trampoline: %s\n", err.name());
+		return cpu::online_count();
+	}
+
+	const auto trampoline = reinterpret_cast<std::uint8_t*>(trampoline_addr);
+	std::memcpy(trampoline, ap_trampoline_begin, ap_trampoline_end - ap_trampoline_begin);
+
+	auto& params = *reinterpret_cast<TrampolineParams*>(trampoline + (ap_trampoline_params - ap_trampoline_begin));
+	params.cr3 = kernel_page_table();
+	params.efer = read_msr(msr_efer) & ~efer_lma;
+	params.cr0 = get_cr0();
+	params.cr4 = get_cr4();
+	params.entry = reinterpret_cast<std::uint64_t>(ap_main);
+
+	const auto bsp_id = lapic::id();
+	for (int i = 0; i < acpi::num_local_apics(); ++i) {
+		const auto apic_id = acpi::local_apic_id(i);
+		if (apic_id == bsp_id) {
+			continue;
+		}
+		if (cpu::online_count() == cpu::max_count) {
+			log->error(u8"Too many CPUs, not starting APIC ID %u\n", apic_id);
+			break;
+		}
+
+		const auto stack = memory_manager->allocate(ap_stack_frames);
+		if (stack.error) {
+			log->error(u8"Failed to allocate a stack for APIC ID %u: %s\n", apic_id, stack.error.name());
+			break;
+		}
+		params.stack_end = reinterpret_cast<std::uint64_t>(stack.value.frame()) + ap_stack_frames * bytes_per_frame;
+		started_index.store(-1, std::memory_order_relaxed);
+
+		lapic::send_init(apic_id);
+		wait_ns(init_delay_ns);
+		lapic::send_startup(apic_id, trampoline_addr >> 12);
+		if (!wait_started(startup_retry_ns)) {
+			lapic::send_startup(apic_id, trampoline_addr >> 12);
+			if (!wait_started(online_timeout_ns)) {
+				// 遅れて起動したAPが次のAPとスタックを共有しないように、ここで打ち切る
+				log->error(u8"APIC ID %u did not start\n", apic_id);
+				break;
+			}
+		}
+
+		log->debug(u8"CPU %d (APIC ID %u) is online\n", started_index.load(), apic_id);
+	}
+
+	if (auto err = protect_pages(trampoline_addr, 1, PageFlag::writable | PageFlag::global | PageFlag::no_execute)) {
+		log->error(u8"Failed to protect the AP trampoline: %s\n", err.name());
+	}
+
+	return cpu::online_count();
+}
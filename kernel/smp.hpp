@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+// BSP以外のCPU(AP)を起動する
+namespace smp {
+	// APの起動コードを置く物理アドレス。1MiB未満の4KiB境界(asmfunc.sのap_trampoline_addrと合わせる)
+	inline constexpr std::uint64_t trampoline_addr = 0x8000;
+
+	// MADTに載っているAPを1つずつ起動し、オンラインになったCPUの数(BSPを含む)を返す
+	// 起動したAPはセグメント、IDT、TSS、Local APIC、TaskManagerを設定した後、タスクを盗んで実行する
+	// acpi::initialize()とtsc::initialize()とBSPのinitialize_task_manager()の後、割り込みを許可した状態でBSPから呼ぶ
+	int start_application_processors();
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+// 書き込む側と読み出す側がそれぞれ1つだけの固定長リングバッファ
+// ロックもメモリ確保も行わないので割り込みハンドラから使える
+// 書き込む側を複数の割り込みハンドラで共有する場合は、それらが入れ子にならない(同じCPUの割り込みゲート)こと
+template <typename T, std::size_t Capacity>
+class SpscQueue {
+	static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+
+public:
+	// 満杯ならvalueを捨ててfalseを返す
+	bool push(const T& value) {
+		const auto tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) == Capacity) {
+			overflow_count_.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		buffer_[tail & mask] = value;
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	std::optional<T> pop() {
+		const auto head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire)) {
+			return std::nullopt;
+		}
+
+		T value = buffer_[head & mask];
+		head_.store(head + 1, std::memory_order_release);
+		return value;
+	}
+
+	bool empty() const {
+		return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+	}
+
+	// 満杯で捨てた要素の数
+	std::uint64_t overflow_count() const {
+		return overflow_count_.load(std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr std::size_t mask = Capacity - 1;
+
+	T buffer_[Capacity];
+	// 書き込む側と読み出す側で別々のキャッシュラインに置く
+	alignas(64) std::atomic<std::size_t> head_{0};
+	alignas(64) std::atomic<std::size_t> tail_{0};
+	std::atomic<std::uint64_t> overflow_count_{0};
+};
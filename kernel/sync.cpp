@@ -0,0 +1,23 @@
+#include "sync.hpp"
+
+#include "logger.hpp"
+#include "tsc.hpp"
+
+void sync::log_statistics() {
+	for (auto stats = lock_statistics_head.load(); stats != nullptr; stats = stats->next()) {
+		const auto acquisitions = stats->acquisitions();
+		if (acquisitions == 0) {
+			continue;
+		}
+
+		const auto contended = stats->contended();
+		log->debug(
+			u8"lock %s: %lu times, %lu contended, avg wait %lu ns, max wait %lu ns\n",
+			stats->name(),
+			acquisitions,
+			contended,
+			contended == 0 ? 0 : tsc::to_ns(stats->wait_cycles() / contended),
+			tsc::to_ns(stats->max_wait_cycles()));
+		stats->reset();
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+
+#include <kernel_interface/sync.hpp>
+
+#include "cpu.hpp"
+
+namespace sync {
+	using namespace kernel_interface::sync;
+
+	// 同じCPUなら持ったまま入れ子に取れるスピンロック
+	// 描画のように処理の途中から同じ入口に戻ってくる状態に使う
+	// 持っている間にタスクが切り替わると持ち主を見分けられないので、必ずIrqSaveLockGuardで取る
+	class RecursiveSpinLock {
+	public:
+		constexpr explicit RecursiveSpinLock(const char* name) : lock_{name} {}
+
+		void lock() {
+			const int self = cpu::current_index();
+			if (owner_.load(std::memory_order_relaxed) == self) {
+				++depth_;
+				return;
+			}
+
+			lock_.lock();
+			owner_.store(self, std::memory_order_relaxed);
+			depth_ = 1;
+		}
+
+		void unlock() {
+			if (--depth_ == 0) {
+				owner_.store(-1, std::memory_order_relaxed);
+				lock_.unlock();
+			}
+		}
+
+		const LockStatistics& statistics() const {
+			return lock_.statistics();
+		}
+
+	private:
+		SpinLock lock_;
+		std::atomic<int> owner_{-1};
+		int depth_ = 0;
+	};
+
+	// 前回からのロックごとの取得回数と待ち時間をdebugで出力し、集計をやり直す
+	void log_statistics();
+}
@@ -0,0 +1,570 @@
+#include "task.hpp"
+
+#include <cstring>
+
+#include <asmfunc.hpp>
+
+#include "interrupt.hpp"
+#include "irq.hpp"
+#include "lapic.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "segment.hpp"
+#include "timer.hpp"
+#include "tsc.hpp"
+
+namespace {
+	constexpr std::uint64_t rflags_reserved = 1u << 1;
+	constexpr std::uint64_t rflags_interrupt_enable = 1u << 9;
+
+	// FXSAVE領域のx87制御ワードとMXCSRの初期値
+	constexpr std::uint16_t default_fcw = 0x037f;
+	constexpr std::uint32_t default_mxcsr = 0x1f80;
+	constexpr std::size_t fxsave_fcw_offset = 0;
+	constexpr std::size_t fxsave_mxcsr_offset = 24;
+
+	std::atomic<std::uint64_t> next_task_id{0};
+	// アイドルタスクを実行しているCPUのビットマップ。タスクを盗ませるCPUを選ぶのに使う
+	std::atomic<std::uint64_t> idle_cpus{0};
+	std::atomic<void (*)()> idle_work{nullptr};
+
+	void idle_main(std::uint64_t) {
+		TaskManager::run_idle();
+	}
+
+	void on_task_wakeup(void*) {
+		current_task_manager()->on_wakeup_ipi();
+	}
+}
+
+TaskManager::TaskManager(const char* name, TaskPriority priority) :
+	cpu_index_{cpu::current_index()},
+	// Local APICタイマはBSPにだけ設定している
+	has_tick_{cpu_index_ == 0} {
+	auto task = std::make_unique<Task>();
+	task->id_ = next_task_id++;
+	task->name_ = name;
+	task->priority_ = priority;
+	task->affinity_ = only_cpu(cpu_index_);
+	task->state_ = Task::State::Running;
+	task->cpu_ = cpu_index_;
+	task->context_.on_cpu = 1;
+	current_ = main_ = task.get();
+	tasks_.push_back(std::move(task));
+	run_start_ = tsc::now();
+
+	slice_timer_.handler = on_slice_timeout;
+	task_managers[cpu_index_] = this;
+
+	if (priority == TaskPriority::Idle) {
+		idle_ = main_;
+		return;
+	}
+
+	idle_ = new_task("idle", idle_main, 0, TaskPriority::Idle, only_cpu(cpu_index_));
+	if (idle_ == nullptr) {
+		log->panic(u8"Failed to create the idle task\n");
+	}
+}
+
+Task* TaskManager::new_task(
+	const char* name,
+	Task::Function function,
+	std::uint64_t data,
+	TaskPriority priority,
+	std::uint64_t affinity) {
+	InterruptGuard guard;
+	auto& self = *current_task_manager();
+
+	// affinityにこのCPUが含まれなければ、含まれる最初のCPUの実行待ちにする
+	TaskManager* owner = (affinity & only_cpu(self.cpu_index_)) != 0 ? &self : nullptr;
+	for (int i = 0; i < cpu::online_count() && owner == nullptr; ++i) {
+		if ((affinity & only_cpu(i)) != 0) {
+			owner = task_managers[i];
+		}
+	}
+	if (owner == nullptr) {
+		log->error(u8"No CPU can run task %s (affinity %#lx)\n", name, affinity);
+		return nullptr;
+	}
+
+	// 終了して他のCPUが切り替え終えたタスクがあれば、スタックごと使い回す
+	Task* task = nullptr;
+	for (const auto& t : self.tasks_) {
+		if (t->stack_end_ != 0 && t->context_.on_cpu == 0) {
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (t->state_ == Task::State::Exited) {
+				task = t.get();
+				break;
+			}
+		}
+	}
+
+	if (task == nullptr) {
+		const auto stack = memory_manager->allocate(stack_frames);
+		if (stack.error) {
+			log->error(u8"Failed to allocate a stack for task %s: %s\n", name, stack.error.name());
+			return nullptr;
+		}
+
+		auto created = std::make_unique<Task>();
+		created->stack_end_ = reinterpret_cast<std::uint64_t>(stack.value.frame()) + stack_frames * bytes_per_frame;
+		task = created.get();
+		self.tasks_.push_back(std::move(created));
+	}
+
+	task->id_ = next_task_id++;
+	task->name_ = name;
+	task->priority_ = priority;
+	task->affinity_ = affinity;
+	task->cpu_ = owner->cpu_index_;
+	task->wakeup_pending_ = false;
+	task->function_ = function;
+	task->data_ = data;
+	task->run_ns_ = 0;
+	task->switch_count_ = 0;
+
+	// task_entry(task)を呼んだ直後の状態にする。関数の入口ではrsp + 8が16の倍数になる
+	auto& context = task->context_;
+	context.regs = {};
+	context.regs.rip = reinterpret_cast<std::uint64_t>(task_entry);
+	context.regs.rdi = reinterpret_cast<std::uint64_t>(task);
+	context.regs.rsp = task->stack_end_ - 8;
+	context.regs.cs = kernel_cs;
+	context.regs.ss = kernel_ss;
+	context.regs.rflags = rflags_reserved | rflags_interrupt_enable;
+	context.cr3 = get_cr3();
+	context.fxsave_area.fill(0);
+	std::memcpy(&context.fxsave_area[fxsave_fcw_offset], &default_fcw, sizeof(default_fcw));
+	std::memcpy(&context.fxsave_area[fxsave_mxcsr_offset], &default_mxcsr, sizeof(default_mxcsr));
+
+	owner->lock();
+	const int target = owner->make_runnable(*task);
+	owner->unlock();
+
+	if (target >= 0) {
+		self.send_wakeup_ipi(target);
+	}
+	if (self.need_resched_ && guard.was_enabled()) {
+		self.lock();
+		self.switch_to_next();
+	}
+	return task;
+}
+
+Task& TaskManager::current_task() {
+	InterruptGuard guard;
+	return *current_task_manager()->current_;
+}
+
+void TaskManager::sleep() {
+	InterruptGuard guard;
+	auto& self = *current_task_manager();
+	self.lock();
+
+	// 条件を確認してから眠るまでの間に他のCPUから起こされていたら眠らない
+	const auto task = self.current_;
+	if (task->wakeup_pending_) {
+		task->wakeup_pending_ = false;
+		self.unlock();
+		return;
+	}
+
+	task->state_ = Task::State::Sleeping;
+	self.switch_to_next();
+}
+
+void TaskManager::wakeup(Task& task) {
+	InterruptGuard guard;
+
+	// 実行待ちのタスクは盗まれてCPUが変わることがあるので、ロックを取ってから確かめる
+	TaskManager* manager;
+	while (true) {
+		manager = task_managers[task.cpu_];
+		manager->lock();
+		if (task.cpu_ == manager->cpu_index_) {
+			break;
+		}
+		manager->unlock();
+	}
+
+	int target = -1;
+	if (task.state_ == Task::State::Sleeping) {
+		target = manager->make_runnable(task);
+	} else if (task.state_ != Task::State::Exited) {
+		task.wakeup_pending_ = true;
+	}
+	manager->unlock();
+
+	auto& self = *current_task_manager();
+	if (target >= 0) {
+		self.send_wakeup_ipi(target);
+	}
+
+	// 割り込みハンドラの中なら出口で切り替える
+	if (manager == &self && self.need_resched_ && guard.was_enabled()) {
+		self.lock();
+		self.switch_to_next();
+	}
+}
+
+void TaskManager::yield() {
+	InterruptGuard guard;
+	auto& self = *current_task_manager();
+	self.lock();
+	self.switch_to_next();
+}
+
+void TaskManager::exit() {
+	__asm__("cli");
+	auto& self = *current_task_manager();
+	self.lock();
+	// 自分のスタックの上で動いているので、スタックは次にnew_task()で使い回すまで残す
+	self.current_->state_ = Task::State::Exited;
+	self.switch_to_next();
+	while (true) {
+		__asm__("hlt");
+	}
+}
+
+void TaskManager::run_idle() {
+	while (true) {
+		// 実行待ちのタスクが積まれれば、割り込みから戻る時にそちらへ切り替わる
+		if (const auto work = idle_work.load(std::memory_order_acquire)) {
+			work();
+		}
+
+		__asm__("cli");
+		auto& self = *current_task_manager();
+		const auto bit = only_cpu(self.cpu_index_);
+
+		// 空いていることを先に知らせてから確認するので、その後に積まれたタスクはIPIで知らされる
+		idle_cpus.fetch_or(bit);
+
+		self.lock();
+		const bool has_work = self.statistics_.runnable > 0;
+		self.unlock();
+
+		if (has_work || self.steal()) {
+			idle_cpus.fetch_and(~bit);
+			self.lock();
+			self.switch_to_next();
+			__asm__("sti");
+			continue;
+		}
+
+		// stiの直後の命令までは割り込みが入らないので、確認してからhltまでの間のIPIで起き損ねることはない
+		__asm__("sti\n\thlt");
+	}
+}
+
+void TaskManager::set_idle_work(void (*work)()) {
+	idle_work.store(work, std::memory_order_release);
+}
+
+void TaskManager::log_statistics(std::uint64_t period_ns) {
+	for (int i = 0; i < cpu::online_count(); ++i) {
+		const auto manager = task_managers[i];
+		if (manager == nullptr) {
+			continue;
+		}
+
+		const auto stats = manager->statistics();
+		const auto idle = manager->idle_ns();
+		const auto& last = manager->last_logged_;
+		const auto idle_delta = idle - manager->last_logged_idle_ns_;
+		const auto busy = idle_delta >= period_ns ? 0 : 100 - idle_delta * 100 / period_ns;
+		log->debug(
+			u8"cpu %d: busy %3lu%%, %d runnable, %lu switches, %lu steals, %lu stolen, IPI %lu sent %lu received\n",
+			i,
+			busy,
+			stats.runnable,
+			stats.switches - last.switches,
+			stats.steals - last.steals,
+			stats.stolen - last.stolen,
+			stats.ipis_sent - last.ipis_sent,
+			stats.ipis_received - last.ipis_received);
+
+		manager->last_logged_ = stats;
+		manager->last_logged_idle_ns_ = idle;
+	}
+
+	// 他のCPUのtasks_は出力している間に伸びることがあるので、このCPUで作ったタスクだけ出す
+	for (const auto& task : current_task_manager()->tasks_) {
+		if (task->state_ == Task::State::Exited) {
+			continue;
+		}
+		log->debug(
+			u8"task %lu %s: %lu ms, %lu switches\n",
+			task->id_,
+			task->name_,
+			task->run_ns_ / 1'000'000,
+			task->switch_count_);
+	}
+}
+
+std::uint64_t TaskManager::idle_ns() const {
+	InterruptGuard guard;
+	lock();
+	auto ns = idle_->run_ns_;
+	if (current_ == idle_) {
+		ns += tsc::now() - run_start_;
+	}
+	unlock();
+	return ns;
+}
+
+TaskManager::Statistics TaskManager::statistics() const {
+	InterruptGuard guard;
+	lock();
+	const auto stats = statistics_;
+	unlock();
+	return stats;
+}
+
+void TaskManager::on_interrupt_exit(const InterruptContext& context, const void* fxsave_area) {
+	if (!need_resched_.load(std::memory_order_relaxed)) {
+		return;
+	}
+
+	lock();
+	const auto prev = current_;
+	const auto next = pick_next();
+	unlock();
+	if (next == prev) {
+		return;
+	}
+
+	// 割り込まれた時点の状態を保存し、割り込み用のスタックは捨てて次のタスクから再開する
+	prev->context_.regs = context;
+	prev->context_.cr3 = get_cr3();
+	std::memcpy(prev->context_.fxsave_area.data(), fxsave_area, prev->context_.fxsave_area.size());
+	std::atomic_thread_fence(std::memory_order_release);
+	prev->context_.on_cpu = 0;
+	restore_context(&next->context_);
+}
+
+void TaskManager::on_wakeup_ipi() {
+	lock();
+	++statistics_.ipis_received;
+	// 他のCPUが積んだタスクのためにタイムスライスのタイマを掛ける
+	update_slice_timer(false);
+	unlock();
+}
+
+void TaskManager::lock() const {
+	lock_.lock();
+}
+
+void TaskManager::unlock() const {
+	lock_.unlock();
+}
+
+void TaskManager::enqueue(Task& task) {
+	const auto priority = static_cast<int>(task.priority_);
+	task.next_ = nullptr;
+	task.prev_ = queue_tail_[priority];
+	if (queue_tail_[priority] == nullptr) {
+		queue_head_[priority] = &task;
+	} else {
+		queue_tail_[priority]->next_ = &task;
+	}
+	queue_tail_[priority] = &task;
+
+	if (task.priority_ != TaskPriority::Idle) {
+		++statistics_.runnable;
+	}
+}
+
+Task* TaskManager::dequeue() {
+	for (int priority = num_task_priorities - 1; priority >= 0; --priority) {
+		const auto task = queue_head_[priority];
+		if (task != nullptr) {
+			remove(*task);
+			return task;
+		}
+	}
+	return nullptr;
+}
+
+void TaskManager::remove(Task& task) {
+	const auto priority = static_cast<int>(task.priority_);
+	if (task.prev_ == nullptr) {
+		queue_head_[priority] = task.next_;
+	} else {
+		task.prev_->next_ = task.next_;
+	}
+	if (task.next_ == nullptr) {
+		queue_tail_[priority] = task.prev_;
+	} else {
+		task.next_->prev_ = task.prev_;
+	}
+	task.next_ = nullptr;
+	task.prev_ = nullptr;
+
+	if (task.priority_ != TaskPriority::Idle) {
+		--statistics_.runnable;
+	}
+}
+
+bool TaskManager::has_runnable(TaskPriority priority) const {
+	return queue_head_[static_cast<int>(priority)] != nullptr;
+}
+
+Task* TaskManager::pick_next() {
+	const auto prev = current_;
+	if (prev->state_ == Task::State::Running) {
+		prev->state_ = Task::State::Runnable;
+		enqueue(*prev);
+	}
+
+	// アイドルタスクは眠らないので、必ず何かが選ばれる
+	const auto next = dequeue();
+	next->state_ = Task::State::Running;
+	need_resched_ = false;
+
+	if (next != prev) {
+		const auto now = tsc::now();
+		prev->run_ns_ += now - run_start_;
+		run_start_ = now;
+		++next->switch_count_;
+		++statistics_.switches;
+		next->context_.on_cpu = 1;
+		current_ = next;
+
+		if (prev == idle_) {
+			idle_cpus.fetch_and(~only_cpu(cpu_index_), std::memory_order_relaxed);
+		}
+	}
+	update_slice_timer(next != prev);
+	return next;
+}
+
+void TaskManager::update_slice_timer(bool restart) {
+	if (!has_tick_) {
+		return;
+	}
+
+	if (!has_runnable(current_->priority_)) {
+		timer_wheel->cancel(slice_timer_);
+		return;
+	}
+
+	if (restart || !slice_timer_.pending) {
+		slice_timer_.timeout = current_tick() + time_slice;
+		timer_wheel->add(slice_timer_);
+	}
+}
+
+void TaskManager::switch_to_next() {
+	const auto prev = current_;
+	const auto next = pick_next();
+	unlock();
+
+	// prevはswitch_contextが保存し終えるまでon_cpuが立っているので、その間に他のCPUに盗まれることはない
+	if (next != prev) {
+		switch_context(&next->context_, &prev->context_);
+	}
+}
+
+int TaskManager::make_runnable(Task& task) {
+	task.state_ = Task::State::Runnable;
+	enqueue(task);
+	if (task.priority_ > current_->priority_) {
+		need_resched_ = true;
+	}
+
+	const bool is_local = cpu_index_ == cpu::current_index();
+	if (is_local) {
+		update_slice_timer(false);
+	} else if (need_resched_ || has_tick_) {
+		return cpu_index_;
+	}
+
+	// このCPUで実行を待つタスクができるなら、空いている他のCPUに盗ませる
+	const int waiting = statistics_.runnable - (current_ == idle_ ? 1 : 0);
+	if (waiting > 0) {
+		return find_idle_cpu(task.affinity_);
+	}
+	return -1;
+}
+
+bool TaskManager::steal() {
+	const auto self_bit = only_cpu(cpu_index_);
+	const int num_cpus = cpu::online_count();
+
+	for (int i = 1; i < num_cpus; ++i) {
+		const auto victim = task_managers[(cpu_index_ + i) % num_cpus];
+		if (victim == nullptr) {
+			continue;
+		}
+
+		// 持ち主が次に実行するのは先頭なので、末尾の最も新しいタスクから盗む
+		Task* found = nullptr;
+		victim->lock();
+		for (int priority = num_task_priorities - 1; priority > static_cast<int>(TaskPriority::Idle); --priority) {
+			for (auto task = victim->queue_tail_[priority]; task != nullptr; task = task->prev_) {
+				if ((task->affinity_ & self_bit) != 0 && task->context_.on_cpu == 0) {
+					found = task;
+					break;
+				}
+			}
+			if (found != nullptr) {
+				break;
+			}
+		}
+		if (found != nullptr) {
+			victim->remove(*found);
+			found->cpu_ = cpu_index_;
+			++victim->statistics_.stolen;
+		}
+		victim->unlock();
+
+		if (found != nullptr) {
+			lock();
+			enqueue(*found);
+			++statistics_.steals;
+			unlock();
+			return true;
+		}
+	}
+	return false;
+}
+
+int TaskManager::find_idle_cpu(std::uint64_t affinity) const {
+	const auto candidates = idle_cpus.load() & affinity & ~only_cpu(cpu_index_) & ~only_cpu(cpu::current_index());
+	if (candidates == 0) {
+		return -1;
+	}
+	return __builtin_ctzll(candidates);
+}
+
+void TaskManager::send_wakeup_ipi(int cpu_index) {
+	lapic::send_ipi(cpu::lapic_id_of(cpu_index), InterruptVector::task_wakeup);
+	++statistics_.ipis_sent;
+}
+
+void TaskManager::task_entry(Task* task) {
+	task->function_(task->data_);
+	exit();
+}
+
+void TaskManager::on_slice_timeout(Timer&) {
+	// 割り込みハンドラの中なので、切り替えは割り込みの出口で行う
+	auto& self = *current_task_manager();
+	self.lock();
+	if (self.has_runnable(self.current_->priority_)) {
+		self.need_resched_ = true;
+	}
+	self.unlock();
+}
+
+void initialize_task_manager(const char* name, TaskPriority priority) {
+	if (cpu::current_index() == 0) {
+		if (auto err = irq::register_handler(InterruptVector::task_wakeup, on_task_wakeup)) {
+			log->panic(u8"Failed to register the task wakeup IPI: %s\n", err.name());
+		}
+	}
+
+	new TaskManager(name, priority);
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "cpu.hpp"
+#include "sync.hpp"
+#include "timer_wheel.hpp"
+
+// asmfunc.sのirq_common_entryが積むレジスタ。低いアドレスから順に並ぶ
+struct InterruptContext {
+	std::uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+	std::uint64_t rbp, rdi, rsi, rdx, rcx, rbx, rax;
+	std::uint64_t vector;
+	// CPUが積む割り込みフレーム
+	std::uint64_t rip, cs, rflags, rsp, ss;
+};
+
+// タスクが止まっている間のレジスタ。asmfunc.sのswitch_context, restore_contextと並びを合わせる
+struct alignas(16) TaskContext {
+	InterruptContext regs;
+	std::uint64_t cr3;
+	alignas(16) std::array<std::uint8_t, 512> fxsave_area;
+	// 0でなければタスクのレジスタとスタックはまだどこかのCPUが使っていて、この構造体の内容は古い
+	// 切り替えで保存し終えたCPUが0にする
+	volatile std::uint64_t on_cpu;
+};
+
+static_assert(sizeof(InterruptContext) == 168);
+static_assert(offsetof(TaskContext, cr3) == 168);
+static_assert(offsetof(TaskContext, fxsave_area) == 176);
+static_assert(offsetof(TaskContext, on_cpu) == 688);
+
+// 大きいほど優先して実行する。同じ優先度のタスクはタイムスライスごとに順番に実行する
+enum class TaskPriority {
+	Idle,
+	Normal,
+	High,
+};
+
+inline constexpr int num_task_priorities = 3;
+
+// タスクを実行してよいCPUのビットマップ
+inline constexpr std::uint64_t any_cpu = ~0ull;
+constexpr std::uint64_t only_cpu(int index) {
+	return 1ull << index;
+}
+
+static_assert(cpu::max_count <= 64);
+
+class Task {
+public:
+	using Function = void (*)(std::uint64_t data);
+
+	enum class State {
+		Running,
+		Runnable,
+		Sleeping,
+		Exited,
+	};
+
+	std::uint64_t id() const {
+		return id_;
+	}
+	const char* name() const {
+		return name_;
+	}
+	TaskPriority priority() const {
+		return priority_;
+	}
+	State state() const {
+		return state_;
+	}
+	std::uint64_t affinity() const {
+		return affinity_;
+	}
+	// 実行中か実行待ちのCPU。眠っていれば最後に実行したCPU
+	int cpu() const {
+		return cpu_;
+	}
+
+	// 実行した時間(ns)と、CPUを割り当てられた回数
+	std::uint64_t run_ns() const {
+		return run_ns_;
+	}
+	std::uint64_t switch_count() const {
+		return switch_count_;
+	}
+
+private:
+	friend class TaskManager;
+
+	// 終了したタスクは作り直さずに次のnew_task()で使い回す
+	std::uint64_t id_ = 0;
+	const char* name_ = nullptr;
+	TaskPriority priority_ = TaskPriority::Normal;
+	std::uint64_t affinity_ = any_cpu;
+	State state_ = State::Sleeping;
+	int cpu_ = 0;
+	// 実行中か実行待ちの間に起こされた。次のsleep()はすぐに戻る
+	bool wakeup_pending_ = false;
+
+	Function function_ = nullptr;
+	std::uint64_t data_ = 0;
+	// new_task()で割り当てたスタックの終わり。最初から動いていたタスクは0
+	std::uint64_t stack_end_ = 0;
+	TaskContext context_{};
+
+	// 同じ優先度の実行待ちの列。持ち主のCPUは先頭から取り出し、他のCPUは末尾から盗む
+	Task* next_ = nullptr;
+	Task* prev_ = nullptr;
+
+	std::uint64_t run_ns_ = 0;
+	std::uint64_t switch_count_ = 0;
+};
+
+// 1つのCPUの上でタスクを切り替える。CPUごとに1つずつ作り、実行待ちの列もCPUごとに持つ
+// 割り込みの出口で切り替えの要求を確認するので、割り込みハンドラの中から起こしたタスクにもすぐ切り替わる
+// 実行するタスクが無くなったCPUは、他のCPUの実行待ちの列からタスクを盗んで実行する
+class TaskManager {
+public:
+	// これより長く同じ優先度の他のタスクを待たせない(tick)
+	// タイマ割り込みはBSPにしか来ないので、他のCPUのタスクはブロックするか終わるまで切り替わらない
+	static constexpr std::uint64_t time_slice = 10;
+	// 各タスクのスタックのフレーム数
+	static constexpr std::size_t stack_frames = 16;
+
+	// CPUの負荷の集計。起動してからの累計
+	struct Statistics {
+		std::uint64_t switches;
+		// 他のCPUから盗んだタスクの数と、他のCPUに盗まれたタスクの数
+		std::uint64_t steals;
+		std::uint64_t stolen;
+		// タスクを実行させるために送った/受け取ったIPIの数
+		std::uint64_t ipis_sent;
+		std::uint64_t ipis_received;
+		// 実行待ちのタスクの数(実行中のタスクとアイドルタスクを除く)
+		int runnable;
+	};
+
+	// initialize_task_manager()から呼ぶ
+	TaskManager(const char* name, TaskPriority priority);
+
+	// 以下は実行中のCPUのTaskManagerに対して操作する
+
+	// functionをdataを引数にして実行するタスクを作り、このCPUの実行待ちにする
+	// affinityにこのCPUが含まれなければ、含まれるCPUのうち番号が最も小さいCPUの実行待ちにする
+	// functionから戻るとタスクは終了する。affinityに含まれる他のCPUが空いていれば、そのCPUに盗ませる
+	static Task* new_task(
+		const char* name,
+		Task::Function function,
+		std::uint64_t data,
+		TaskPriority priority,
+		std::uint64_t affinity = any_cpu);
+
+	static Task& current_task();
+	// 実行中のタスクをwakeup()されるまで眠らせる
+	// 割り込みを禁止して条件を確認してから呼べば、その間の起床を取りこぼさない
+	static void sleep();
+	// taskを最後に実行したCPUの実行待ちにする。割り込みハンドラや他のCPUからも呼べる
+	// そのCPUの実行中より優先度が高ければ切り替える。他のCPUならIPIを送って切り替えさせる
+	static void wakeup(Task& task);
+	// 同じ優先度の他のタスクに順番を譲る
+	static void yield();
+	// 実行中のタスクを終了する
+	[[noreturn]] static void exit();
+	// アイドルタスクの本体。実行待ちのタスクが無ければ他のCPUから盗み、それも無ければhltで待つ
+	[[noreturn]] static void run_idle();
+	// アイドルタスクが休む前に割り込みを許可したまま呼ぶ処理を設定する。どのCPUのアイドルタスクからも呼ばれる
+	static void set_idle_work(void (*work)());
+
+	// 全てのCPUの前回からの負荷と、タスクごとの実行時間をdebugで出力する
+	static void log_statistics(std::uint64_t period_ns);
+
+	// initialize_task_manager()を呼んだ時に動いていたタスク
+	Task& main_task() {
+		return *main_;
+	}
+	// アイドルタスクが実行した時間(ns)
+	std::uint64_t idle_ns() const;
+	Statistics statistics() const;
+
+	// irq_dispatchの最後に呼ばれる。切り替えが必要なら割り込まれたタスクの状態を保存して次のタスクに移る
+	void on_interrupt_exit(const InterruptContext& context, const void* fxsave_area);
+	// 他のCPUがタスクを実行させるために送ったIPIを受け取った
+	void on_wakeup_ipi();
+
+private:
+	const int cpu_index_;
+	// タイマ割り込みを受けるCPUだけがタイムスライスで切り替える
+	const bool has_tick_;
+	// 以下の実行待ちの列、current_、タスクの状態はlock_を取って触る
+	// 他のCPUがwakeup()や盗む時にも取るので、持つ間は割り込みを禁止する
+	mutable sync::SpinLock lock_{"task_manager"};
+	// このCPUで作ったタスク。終了したタスクの置き場も兼ねる
+	std::vector<std::unique_ptr<Task>> tasks_;
+	Task* current_;
+	Task* main_;
+	Task* idle_;
+	std::array<Task*, num_task_priorities> queue_head_{};
+	std::array<Task*, num_task_priorities> queue_tail_{};
+	std::atomic<bool> need_resched_{false};
+	// currentが実行を始めた時刻(ns)
+	std::uint64_t run_start_;
+	Timer slice_timer_;
+	Statistics statistics_{};
+	// log_statistics()で前回出力した時の値
+	Statistics last_logged_{};
+	std::uint64_t last_logged_idle_ns_ = 0;
+
+	void lock() const;
+	void unlock() const;
+
+	void enqueue(Task& task);
+	Task* dequeue();
+	void remove(Task& task);
+	bool has_runnable(TaskPriority priority) const;
+	// 実行中のcurrent_を実行待ちの列に戻し、次に実行するタスクを選んでcurrent_にする
+	// current_を眠らせる時は先に状態をSleepingにしておく
+	Task* pick_next();
+	// 同じ優先度で待っているタスクがあればタイムスライスの終わりにタイマを掛ける
+	// restartがtrueなら、掛かっていても今からtime_sliceに掛け直す
+	void update_slice_timer(bool restart);
+	// currentをpick_next()で選んだタスクに切り替える。割り込みを禁止し、lock_を取って呼ぶ
+	// 切り替える前にlock_を放す
+	void switch_to_next();
+
+	// taskをこのCPUの実行待ちにし、必要ならこのCPUか空いている他のCPUを起こす。lock_を取って呼ぶ
+	// 他のCPUを起こすならそのCPUの番号を返す
+	int make_runnable(Task& task);
+	// 他のCPUの実行待ちの列からこのCPUで実行できるタスクを1つ取り、このCPUの実行待ちにする
+	bool steal();
+	// affinityに含まれ、アイドルタスクを実行中の他のCPUを1つ選ぶ。無ければ-1
+	int find_idle_cpu(std::uint64_t affinity) const;
+	void send_wakeup_ipi(int cpu_index);
+
+	static void task_entry(Task* task);
+	static void on_slice_timeout(Timer& timer);
+};
+
+// 各CPUのTaskManager。CPU番号で引く
+inline std::array<TaskManager*, cpu::max_count> task_managers{};
+
+// 実行中のCPUのTaskManager。まだ作っていなければnullptr
+inline TaskManager* current_task_manager() {
+	return task_managers[cpu::current_index()];
+}
+
+// 実行中のCPUにTaskManagerを作り、今の実行の流れをnameのタスクとしてこのCPUに固定する
+// priorityがIdleならそのタスクをアイドルタスクとし、呼び出し側はそのままTaskManager::run_idle()に入る
+// BSPではtimer_wheelを作った後に最初に呼ぶ
+void initialize_task_manager(const char* name, TaskPriority priority);
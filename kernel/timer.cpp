@@ -1,28 +1,141 @@
 #include "timer.hpp"
 
+#include <algorithm>
 #include <limits>
 
+#include <asmfunc.hpp>
+
+#include "interrupt.hpp"
+#include "irq.hpp"
+#include "timer_wheel.hpp"
+#include "tsc.hpp"
+
 namespace {
 	const std::uint32_t count_max = std::numeric_limits<std::uint32_t>::max();
 	volatile std::uint32_t& lvt_timer = *reinterpret_cast<std::uint32_t*>(0xfee00320);
 	volatile std::uint32_t& initial_count = *reinterpret_cast<std::uint32_t*>(0xfee00380);
 	volatile std::uint32_t& current_count = *reinterpret_cast<std::uint32_t*>(0xfee00390);
 	volatile std::uint32_t& divide_config = *reinterpret_cast<std::uint32_t*>(0xfee003e0);
+
+	constexpr std::uint32_t lvt_masked = 1u << 16;
+	constexpr std::uint32_t lvt_periodic = 0b01u << 17;
+	constexpr std::uint64_t ns_per_tick = 1'000'000'000 / timer_frequency;
+
+	constexpr std::uint16_t pit_channel2_data = 0x42;
+	constexpr std::uint16_t pit_command = 0x43;
+	constexpr std::uint16_t pit_channel2_gate = 0x61;
+	constexpr std::uint64_t pit_frequency = 1'193'182;
+	constexpr std::uint64_t calibration_ms = 10;
+
+	std::uint64_t frequency;
+	std::uint32_t period_count;
+	volatile std::uint64_t tick;
+	bool tickless = false;
+
+	// PITのチャネル2をcalibration_msだけ数えさせ、その間に減ったLocal APICタイマのカウントを測る
+	std::uint64_t measure_lapic_timer_frequency() {
+		constexpr auto pit_count = pit_frequency * calibration_ms / 1000;
+
+		// スピーカーへの出力を切ってゲートを閉じておく
+		const auto gate = io_in_8(pit_channel2_gate);
+		io_out_8(pit_channel2_gate, gate & ~0b11);
+
+		// チャネル2, 下位・上位バイトの順, モード0(カウント終了で出力がHighになる)
+		io_out_8(pit_command, 0b1011'0000);
+		io_out_8(pit_channel2_data, pit_count & 0xff);
+		io_out_8(pit_channel2_data, (pit_count >> 8) & 0xff);
+
+		lvt_timer = lvt_masked | InterruptVector::lapic_timer;
+		io_out_8(pit_channel2_gate, (gate & ~0b11) | 0b01);
+		initial_count = count_max;
+
+		while ((io_in_8(pit_channel2_gate) & 0b10'0000) == 0) {
+		}
+
+		const auto elapsed = count_max - current_count;
+		initial_count = 0;
+		io_out_8(pit_channel2_gate, gate);
+
+		return elapsed * 1000 / calibration_ms;
+	}
+
+	// deadline_nsに割り込みが起きるようにする
+	void set_oneshot(std::uint64_t deadline_ns) {
+		if (tsc::is_deadline_supported()) {
+			tsc::set_deadline(deadline_ns, InterruptVector::lapic_timer);
+			return;
+		}
+
+		// TSC-deadlineモードが無ければワンショットモードで残り時間を数える
+		// 32ビットに収まらなければ途中で一度起きて設定し直す
+		const auto now = tsc::now();
+		// 掛け算が64ビットから溢れないように、count_maxを超える分は先に切り捨てる
+		const auto max_delta_ns = static_cast<std::uint64_t>(count_max) * 1'000'000'000 / frequency;
+		const auto delta_ns = std::min(deadline_ns > now ? deadline_ns - now : 0, max_delta_ns);
+		const auto count = delta_ns * frequency / 1'000'000'000;
+		lvt_timer = InterruptVector::lapic_timer;
+		initial_count = count == 0 ? 1 : count > count_max ? count_max : count;
+	}
+
+	void stop_oneshot() {
+		if (tsc::is_deadline_supported()) {
+			tsc::cancel_deadline();
+		} else {
+			initial_count = 0;
+		}
+	}
+
+	void on_lapic_timer(void*) {
+		if (tickless) {
+			timer_wheel->advance(current_tick());
+			update_timer_deadline();
+		} else {
+			tick = tick + 1;
+		}
+	}
 }
 
 void initialize_lapic_timer() {
 	divide_config = 0b1011;
-	lvt_timer = (0b001 << 16) | 0b10'0000;
+
+	frequency = measure_lapic_timer_frequency();
+	period_count = frequency / timer_frequency;
+
+	irq::register_handler(InterruptVector::lapic_timer, on_lapic_timer);
+
+	lvt_timer = lvt_periodic | InterruptVector::lapic_timer;
+	initial_count = period_count;
 }
 
-void start_lapic_timer() {
-	initial_count = count_max;
+void start_tickless_timer() {
+	initial_count = 0;
+	lvt_timer = lvt_masked | InterruptVector::lapic_timer;
+
+	tickless = true;
+	timer_wheel = new TimerWheel(current_tick());
+	update_timer_deadline();
+}
+
+void update_timer_deadline() {
+	if (!tickless) {
+		return;
+	}
+
+	const auto next = timer_wheel->next_timeout();
+	if (next == TimerWheel::no_timeout) {
+		stop_oneshot();
+	} else {
+		set_oneshot(next * ns_per_tick);
+	}
 }
 
-std::uint32_t lapic_timer_elapsed() {
-	return count_max - current_count;
+std::uint64_t current_tick() {
+	if (tickless) {
+		return tsc::now() / ns_per_tick;
+	}
+	return tick;
 }
 
-void stop_lapic_timer() {
-	initial_count = 0;
+std::uint64_t lapic_timer_frequency() {
+	return frequency;
 }
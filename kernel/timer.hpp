@@ -2,7 +2,19 @@
 
 #include <cstdint>
 
+// Local APICタイマ割り込みの周波数(Hz)
+constexpr std::uint64_t timer_frequency = 1000;
+
+// PITでLocal APICタイマの周波数を測り、timer_frequencyの周期割り込みを開始する
 void initialize_lapic_timer();
-void start_lapic_timer();
-std::uint32_t lapic_timer_elapsed();
-void stop_lapic_timer();
+
+// 周期割り込みを止めてtimer_wheelを作り、以降はその次の期限にだけ割り込みを起こす
+// tsc::initialize()が済んでいる必要がある
+void start_tickless_timer();
+// timer_wheelの次の期限に合わせて割り込みの時刻を設定し直す
+void update_timer_deadline();
+
+// 起動してからの時刻(1 / timer_frequency秒単位)
+std::uint64_t current_tick();
+// 1秒あたりのLocal APICタイマのカウント数
+std::uint64_t lapic_timer_frequency();
@@ -0,0 +1,180 @@
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+
+#include "interrupt.hpp"
+#include "message.hpp"
+#include "timer.hpp"
+
+namespace {
+	constexpr std::uint64_t slot_mask = TimerWheel::slots_per_level - 1;
+
+	std::size_t slot_index(std::uint64_t tick, int level) {
+		return (tick >> (level * TimerWheel::slot_bits)) & slot_mask;
+	}
+}
+
+TimerWheel::TimerWheel(std::uint64_t current_tick) : current_tick_(current_tick) {}
+
+void TimerWheel::add(Timer& timer) {
+	InterruptGuard guard;
+	if (timer.pending) {
+		unlink(timer);
+	}
+	// 割り込みが来るまでcurrent_tick_は古いままなので、先に今のtickまで進めてから置く
+	// 古いtickから数えると、期限までの距離を長く見積もって上のレベルに置き、期限より遅れて処理してしまう
+	// advance()から呼ばれたhandlerが掛け直す時は進めている途中なので、そのまま置く
+	if (!advancing_) {
+		advance(current_tick());
+	}
+	// 今のtickは処理済みなので、過ぎた期限は次のtickで処理する
+	place(timer, current_tick_ + 1);
+
+	// 今の予定より早い期限かもしれないので割り込みの時刻を設定し直す
+	update_timer_deadline();
+}
+
+void TimerWheel::cancel(Timer& timer) {
+	InterruptGuard guard;
+	if (timer.pending) {
+		unlink(timer);
+	}
+}
+
+void TimerWheel::advance(std::uint64_t now_tick) {
+	advancing_ = true;
+	while (current_tick_ < now_tick) {
+		// next_timeout()までは期限も配り直しも無いので、1tickずつではなく一度に進める
+		const auto previous_tick = current_tick_;
+		current_tick_ = std::min(now_tick, next_timeout());
+
+		// 上のレベルの境界をまたいだら、そのスロットのタイマを下のレベルに配り直す
+		// 空でないスロットの境界はnext_timeout()で止まるので、またいだ途中のスロットは全て空になっている
+		for (int level = 1; level < levels; ++level) {
+			if ((previous_tick >> (level * slot_bits)) == (current_tick_ >> (level * slot_bits))) {
+				break;
+			}
+			cascade(level);
+		}
+
+		expire_slot(slot_index(current_tick_, 0));
+	}
+	advancing_ = false;
+}
+
+std::uint64_t TimerWheel::next_timeout() const {
+	std::uint64_t next = no_timeout;
+
+	for (int level = 0; level < levels; ++level) {
+		if (occupied_[level] == 0) {
+			continue;
+		}
+
+		// 今のスロットの次から数えて最初に空でないスロットまでの距離(1〜64)
+		const auto shift = (slot_index(current_tick_, level) + 1) & slot_mask;
+		const auto rotated = (occupied_[level] >> shift) | (occupied_[level] << ((slots_per_level - shift) & slot_mask));
+		const auto distance = static_cast<std::uint64_t>(__builtin_ctzll(rotated)) + 1;
+
+		// 上のレベルはスロットの先頭で下のレベルに移すので、その時刻に起きればよい
+		const auto tick = ((current_tick_ >> (level * slot_bits)) + distance) << (level * slot_bits);
+		if (tick < next) {
+			next = tick;
+		}
+	}
+
+	return next;
+}
+
+void TimerWheel::place(Timer& timer, std::uint64_t earliest) {
+	const auto timeout = timer.timeout < earliest ? earliest : timer.timeout;
+	auto delta = timeout - current_tick_;
+	auto placed = timeout;
+	if (delta > max_delta) {
+		delta = max_delta;
+		placed = current_tick_ + max_delta;
+	}
+
+	int level = 0;
+	while (level < levels - 1 && delta >= (1ull << ((level + 1) * slot_bits))) {
+		++level;
+	}
+
+	const auto index = slot_index(placed, level);
+	auto& slot = slots_[level][index];
+
+	timer.prev = nullptr;
+	timer.next = slot.head;
+	if (slot.head != nullptr) {
+		slot.head->prev = &timer;
+	}
+	slot.head = &timer;
+	timer.level = level;
+	timer.slot = index;
+	timer.pending = true;
+	occupied_[level] |= 1ull << index;
+}
+
+void TimerWheel::unlink(Timer& timer) {
+	if (timer.next != nullptr) {
+		timer.next->prev = timer.prev;
+	}
+
+	if (timer.prev != nullptr) {
+		timer.prev->next = timer.next;
+	} else {
+		auto& slot = slots_[timer.level][timer.slot];
+		slot.head = timer.next;
+		if (slot.head == nullptr) {
+			occupied_[timer.level] &= ~(1ull << timer.slot);
+		}
+	}
+
+	timer.prev = nullptr;
+	timer.next = nullptr;
+	timer.pending = false;
+}
+
+void TimerWheel::cascade(int level) {
+	const auto index = slot_index(current_tick_, level);
+	auto& slot = slots_[level][index];
+
+	auto timer = slot.head;
+	slot.head = nullptr;
+	occupied_[level] &= ~(1ull << index);
+
+	while (timer != nullptr) {
+		const auto next = timer->next;
+		// 今のtickが期限のタイマはこの後すぐにレベル0で処理される
+		place(*timer, current_tick_);
+		timer = next;
+	}
+}
+
+void TimerWheel::expire_slot(std::size_t index) {
+	auto& slot = slots_[0][index];
+
+	// handlerやメインタスクの起床が他のタイマを掛け直すことがあるので、1つずつスロットから外して処理する
+	// 掛け直したタイマは次のtick以降に置かれるので、このスロットには戻らない
+	while (slot.head != nullptr) {
+		const auto timer = slot.head;
+		unlink(*timer);
+
+		if (timer->handler != nullptr) {
+			timer->handler(*timer);
+		} else {
+			Message msg{Message::Type::TimerTimeout};
+			msg.arg.timer.timeout = timer->timeout;
+			msg.arg.timer.value = timer->value;
+			post_message(msg);
+		}
+
+		if (timer->period != 0 && !timer->pending) {
+			// 処理が遅れて期限を過ぎていたら、過ぎた分は飛ばす
+			timer->timeout += timer->period;
+			if (timer->timeout <= current_tick_) {
+				timer->timeout = current_tick_ + timer->period;
+			}
+			place(*timer, current_tick_ + 1);
+		}
+	}
+}
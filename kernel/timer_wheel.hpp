@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+// TimerWheelに登録するタイマ。登録中は呼び出し側が生存させておく
+struct Timer {
+	// 期限(tick)
+	std::uint64_t timeout = 0;
+	// 0でなければ期限が来るたびにこの間隔(tick)で登録し直す
+	std::uint64_t period = 0;
+	// 期限が来た時のMessageに入れる値
+	int value = 0;
+	// nullptrでなければ、期限が来た時にMessageを送る代わりに割り込みハンドラの中で呼ぶ
+	void (*handler)(Timer& timer) = nullptr;
+
+	// 以下はTimerWheelが管理する
+	Timer* prev = nullptr;
+	Timer* next = nullptr;
+	int level = 0;
+	std::size_t slot = 0;
+	bool pending = false;
+};
+
+// 階層化したタイマホイール。登録と取り消しはタイマの数によらずO(1)
+// レベルLのスロットは64^L tickの幅を持ち、期限が近づくと下のレベルに移される
+class TimerWheel {
+public:
+	static constexpr int levels = 4;
+	static constexpr int slot_bits = 6;
+	static constexpr std::size_t slots_per_level = 1u << slot_bits;
+	// これより先の期限は最上位レベルで繰り返し待たせる
+	static constexpr std::uint64_t max_delta = (1ull << (levels * slot_bits)) - 1;
+	static constexpr std::uint64_t no_timeout = ~0ull;
+
+	TimerWheel(std::uint64_t current_tick);
+
+	void add(Timer& timer);
+	void cancel(Timer& timer);
+
+	// 時刻をnow_tickまで進め、期限が来たタイマをTimerTimeoutのMessageとしてmain_queueに送る
+	// handlerのあるタイマはhandlerを呼ぶ。タイマの無い間は飛ばすので、かかる時間は経過したtickの数によらない
+	void advance(std::uint64_t now_tick);
+	// 次に処理が必要になるtick。タイマが無ければno_timeout
+	std::uint64_t next_timeout() const;
+
+private:
+	struct Slot {
+		Timer* head = nullptr;
+	};
+
+	std::uint64_t current_tick_;
+	// advance()の途中
+	bool advancing_ = false;
+	std::array<std::array<Slot, slots_per_level>, levels> slots_{};
+	// 空でないスロットのビットマップ
+	std::array<std::uint64_t, levels> occupied_{};
+
+	void place(Timer& timer, std::uint64_t earliest);
+	void unlink(Timer& timer);
+	void cascade(int level);
+	void expire_slot(std::size_t index);
+};
+
+inline TimerWheel* timer_wheel;
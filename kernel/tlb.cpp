@@ -0,0 +1,179 @@
+#include "tlb.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+
+#include <asmfunc.hpp>
+
+#include "cpu.hpp"
+#include "interrupt.hpp"
+#include "irq.hpp"
+#include "lapic.hpp"
+#include "paging.hpp"
+
+namespace {
+	constexpr std::size_t max_ranges = 16;
+	constexpr std::uint64_t cr4_pge = 1u << 7;
+
+	struct Range {
+		std::uint64_t begin;
+		std::uint64_t end;
+	};
+
+	struct Batch {
+		std::array<Range, max_ranges> ranges;
+		std::size_t num_ranges;
+		std::size_t num_pages;
+		bool full_flush;
+
+		void clear() {
+			num_ranges = 0;
+			num_pages = 0;
+			full_flush = false;
+		}
+	};
+
+	struct alignas(64) PerCpu {
+		Batch pending;
+		tlb::Statistics statistics;
+	};
+
+	std::array<PerCpu, cpu::max_count> per_cpu{};
+
+	// 他のCPUに処理してもらっているバッチ
+	// 同時に1つしか出さないのでrequest_lockで排他する
+	std::atomic_flag request_lock = ATOMIC_FLAG_INIT;
+	const Batch* volatile request_batch = nullptr;
+	// request_batchをまだ反映していないCPUのビットマップ。反映したCPUが自分のビットを消す
+	std::atomic<std::uint64_t> request_pending_cpus{0};
+
+	void flush_all_local() {
+		// グローバルページはCR4.PGEを切り替えないと消えない
+		const auto cr4 = get_cr4();
+		if ((cr4 & cr4_pge) != 0) {
+			set_cr4(cr4 & ~cr4_pge);
+			set_cr4(cr4);
+		} else {
+			set_cr3(get_cr3());
+		}
+	}
+
+	void apply_local(const Batch& batch) {
+		if (batch.full_flush) {
+			flush_all_local();
+			return;
+		}
+
+		for (std::size_t i = 0; i < batch.num_ranges; ++i) {
+			for (auto addr = batch.ranges[i].begin; addr < batch.ranges[i].end; addr += page_size_4k) {
+				invlpg(addr);
+			}
+		}
+	}
+
+	// 他のCPUからの要求が自分に残っていれば反映して応える
+	// IPIのハンドラの他に、割り込みを禁止したまま待っている間にも呼び、要求したCPUと待ち合って止まらないようにする
+	// 待っている間に反映した要求のIPIも後で届くが、ビットが消えていれば何もしない
+	void serve_request() {
+		const auto bit = std::uint64_t{1} << cpu::current_index();
+		if ((request_pending_cpus.load(std::memory_order_acquire) & bit) == 0) {
+			return;
+		}
+
+		apply_local(*request_batch);
+		request_pending_cpus.fetch_and(~bit, std::memory_order_release);
+	}
+
+	void on_tlb_shootdown(void*) {
+		++per_cpu[cpu::current_index()].statistics.ipis_received;
+		serve_request();
+	}
+}
+
+void tlb::initialize() {
+	irq::register_handler(InterruptVector::tlb_shootdown, on_tlb_shootdown);
+}
+
+void tlb::queue_invalidate(std::uint64_t addr, std::size_t size) {
+	auto& batch = per_cpu[cpu::current_index()].pending;
+	if (batch.full_flush || size == 0) {
+		return;
+	}
+
+	const auto begin = addr & ~(page_size_4k - 1);
+	const auto end = (addr + size + page_size_4k - 1) & ~(page_size_4k - 1);
+
+	// 重なるか隣接する範囲があればまとめる
+	Range merged{begin, end};
+	std::size_t i = 0;
+	while (i < batch.num_ranges) {
+		const auto& r = batch.ranges[i];
+		if (r.end < merged.begin || merged.end < r.begin) {
+			++i;
+			continue;
+		}
+
+		merged = {std::min(r.begin, merged.begin), std::max(r.end, merged.end)};
+		batch.num_pages -= (r.end - r.begin) / page_size_4k;
+		batch.ranges[i] = batch.ranges[batch.num_ranges - 1];
+		--batch.num_ranges;
+	}
+
+	batch.num_pages += (merged.end - merged.begin) / page_size_4k;
+	if (batch.num_ranges == batch.ranges.size() || batch.num_pages > full_flush_threshold) {
+		batch.full_flush = true;
+		return;
+	}
+
+	batch.ranges[batch.num_ranges] = merged;
+	++batch.num_ranges;
+}
+
+void tlb::queue_flush_all() {
+	per_cpu[cpu::current_index()].pending.full_flush = true;
+}
+
+void tlb::flush() {
+	InterruptGuard guard;
+	auto& self = per_cpu[cpu::current_index()];
+	auto& batch = self.pending;
+	if (!batch.full_flush && batch.num_ranges == 0) {
+		return;
+	}
+
+	++self.statistics.flushes;
+	if (batch.full_flush) {
+		++self.statistics.full_flushes;
+	}
+
+	apply_local(batch);
+
+	const auto others = ((std::uint64_t{1} << cpu::online_count()) - 1) & ~(std::uint64_t{1} << cpu::current_index());
+	if (others != 0) {
+		while (request_lock.test_and_set(std::memory_order_acquire)) {
+			serve_request();
+			__asm__("pause");
+		}
+
+		request_batch = &batch;
+		request_pending_cpus.store(others, std::memory_order_release);
+		lapic::send_ipi_all_excluding_self(InterruptVector::tlb_shootdown);
+		++self.statistics.ipis_sent;
+
+		while (request_pending_cpus.load(std::memory_order_acquire) != 0) {
+			// 待っている間は割り込みを禁止していても他のCPUの要求に応える
+			serve_request();
+			__asm__("pause");
+		}
+
+		request_batch = nullptr;
+		request_lock.clear(std::memory_order_release);
+	}
+
+	batch.clear();
+}
+
+tlb::Statistics tlb::statistics(int cpu_index) {
+	return per_cpu[cpu_index].statistics;
+}
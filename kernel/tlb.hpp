@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 複数CPUのTLBをまとめて無効化する(TLB shootdown)
+// ページテーブルを書き換えたら無効化する範囲を予約しておき、最後にflush()で全CPUに反映する
+namespace tlb {
+	// この数より多いページを無効化する時はTLB全体を捨てる
+	inline constexpr std::size_t full_flush_threshold = 32;
+
+	// IPIハンドラを登録する
+	void initialize();
+
+	// 実行中のCPUのバッチにaddrからsizeバイトの無効化を追加する
+	// 予約からflush()までの間に他のCPUへ移らないように、呼び出し側で割り込みを禁止しておく
+	void queue_invalidate(std::uint64_t addr, std::size_t size);
+	// 実行中のCPUのバッチにTLB全体の無効化を追加する
+	void queue_flush_all();
+
+	// 予約した無効化を自分のTLBに反映し、他のCPUにはIPIを送って反映し終わるまで待つ
+	// 割り込みを禁止したまま呼んでもよい。待っている間も他のCPUからの要求には応える
+	void flush();
+
+	struct Statistics {
+		std::uint64_t flushes;
+		std::uint64_t full_flushes;
+		std::uint64_t ipis_sent;
+		std::uint64_t ipis_received;
+	};
+
+	Statistics statistics(int cpu_index);
+}
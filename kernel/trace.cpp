@@ -0,0 +1,31 @@
+#include "trace.hpp"
+
+#include <array>
+
+#include "cpu.hpp"
+#include "logger.hpp"
+#include "tsc.hpp"
+
+namespace {
+	// QEMUのモニタでまとめて保存できるように全てのCPUの分を並べておく
+	std::array<trace::Buffer, cpu::max_count> buffers;
+}
+
+void trace::initialize() {
+	for (int i = 0; i < cpu::max_count; ++i) {
+		auto& buffer = buffers[i];
+		buffer.magic = buffer_magic;
+		buffer.cpu_index = i;
+		buffer.num_records = records_per_cpu;
+		buffer.tsc_frequency = tsc::frequency();
+		buffer.boot_tsc = tsc::boot_count();
+		buffer.head = 0;
+		cpu::of(i).trace = &buffer;
+	}
+	enabled = true;
+
+	log->debug(
+		u8"trace: %lu bytes of buffers at %016lx\n",
+		sizeof(buffers),
+		reinterpret_cast<std::uintptr_t>(buffers.data()));
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <kernel_interface/trace.hpp>
+
+// KERNEL_TRACE()の記録先をCPUごとに用意する
+namespace trace {
+	using namespace kernel_interface::trace;
+
+	// 全てのCPUのBufferを用意して記録を始める。バッファの場所はdebugで出力する
+	// tsc::initialize()の後、APを起動する前にBSPから呼ぶ
+	void initialize();
+}
@@ -0,0 +1,114 @@
+#include "tsc.hpp"
+
+#include <asmfunc.hpp>
+
+#include "timer.hpp"
+
+namespace {
+	constexpr std::uint32_t msr_tsc_deadline = 0x6e0;
+	volatile std::uint32_t& lvt_timer = *reinterpret_cast<std::uint32_t*>(0xfee00320);
+	constexpr std::uint32_t lvt_tsc_deadline = 0b10u << 17;
+
+	// 校正にかけるタイマ割り込みの回数
+	constexpr std::uint64_t calibration_ticks = 50;
+
+	bool invariant;
+	bool deadline_supported;
+	std::uint64_t tsc_frequency;
+	std::uint64_t boot_tsc;
+	// ns = (tsc * ns_mult) >> 32
+	std::uint64_t ns_mult;
+
+	// CPUID 0x15が水晶の周波数を返せば、それからTSCの周波数が分かる
+	std::uint64_t frequency_from_cpuid() {
+		std::uint32_t eax, ebx, ecx, edx;
+		get_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+		if (eax < 0x15) {
+			return 0;
+		}
+
+		get_cpuid(0x15, 0, &eax, &ebx, &ecx, &edx);
+		if (eax == 0 || ebx == 0 || ecx == 0) {
+			return 0;
+		}
+		return static_cast<std::uint64_t>(ecx) * ebx / eax;
+	}
+
+	std::uint64_t measure_frequency() {
+		// タイマ割り込みの直後から数え始める
+		const auto start_tick = current_tick() + 1;
+		while (current_tick() < start_tick) {
+		}
+		const auto start = read_tsc();
+
+		while (current_tick() < start_tick + calibration_ticks) {
+		}
+		const auto elapsed = read_tsc() - start;
+
+		return elapsed * timer_frequency / calibration_ticks;
+	}
+}
+
+void tsc::initialize() {
+	std::uint32_t eax, ebx, ecx, edx;
+	get_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	deadline_supported = (ecx & (1u << 24)) != 0;
+
+	get_cpuid(0x8000'0000, 0, &eax, &ebx, &ecx, &edx);
+	if (eax >= 0x8000'0007) {
+		get_cpuid(0x8000'0007, 0, &eax, &ebx, &ecx, &edx);
+		invariant = (edx & (1u << 8)) != 0;
+	}
+
+	tsc_frequency = frequency_from_cpuid();
+	if (tsc_frequency == 0) {
+		tsc_frequency = measure_frequency();
+	}
+
+	// 1e9 << 32は2^62より小さいので64ビットで割れる。128ビットの割り算は__udivti3が要るので使わない
+	ns_mult = (1'000'000'000ull << 32) / tsc_frequency;
+	boot_tsc = read_tsc();
+}
+
+bool tsc::is_invariant() {
+	return invariant;
+}
+
+std::uint64_t tsc::frequency() {
+	return tsc_frequency;
+}
+
+std::uint64_t tsc::boot_count() {
+	return boot_tsc;
+}
+
+std::uint64_t tsc::now() {
+	return to_ns(read_tsc() - boot_tsc);
+}
+
+std::uint64_t tsc::to_ns(std::uint64_t tsc_count) {
+	return (static_cast<unsigned __int128>(tsc_count) * ns_mult) >> 32;
+}
+
+std::uint64_t tsc::from_ns(std::uint64_t ns) {
+	// 秒と秒未満に分けて、64ビットの割り算だけで溢れないようにする
+	return ns / 1'000'000'000 * tsc_frequency + ns % 1'000'000'000 * tsc_frequency / 1'000'000'000;
+}
+
+bool tsc::is_deadline_supported() {
+	return deadline_supported;
+}
+
+void tsc::set_deadline(std::uint64_t deadline_ns, std::uint8_t vector) {
+	lvt_timer = lvt_tsc_deadline | vector;
+	// モードを切り替えてからMSRに書き込むまでの順序を保証する
+	__asm__ volatile("mfence" ::: "memory");
+
+	// 0を書き込むと取り消しになるので、過去の時刻でも1以上にする
+	const auto deadline = boot_tsc + from_ns(deadline_ns);
+	write_msr(msr_tsc_deadline, deadline == 0 ? 1 : deadline);
+}
+
+void tsc::cancel_deadline() {
+	write_msr(msr_tsc_deadline, 0);
+}
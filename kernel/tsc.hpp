@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+
+// TSCを使った高分解能の時計
+namespace tsc {
+	// TSCの周波数を求める。Local APICタイマの周期割り込みが動いている必要がある
+	void initialize();
+
+	// 電源状態や周波数の変化によらず一定の速さで進むならtrue
+	bool is_invariant();
+	// 1秒あたりのTSCのカウント数
+	std::uint64_t frequency();
+	// now()が0になるTSCの値
+	std::uint64_t boot_count();
+
+	// 起動してからの時刻(ナノ秒)
+	std::uint64_t now();
+	std::uint64_t to_ns(std::uint64_t tsc_count);
+	std::uint64_t from_ns(std::uint64_t ns);
+
+	// Local APICタイマをTSC-deadlineモードにできるならtrue
+	bool is_deadline_supported();
+	// Local APICタイマをTSC-deadlineモードにし、時刻deadline_nsにvectorの割り込みを1回起こす
+	// 周期割り込みは止まる
+	void set_deadline(std::uint64_t deadline_ns, std::uint8_t vector);
+	// まだ起きていない割り込みを取り消す
+	void cancel_deadline();
+}
@@ -1,5 +1,7 @@
 #include "usb/device.hpp"
 
+#include <kernel_interface/trace.hpp>
+
 #include "usb/classdriver/base.hpp"
 #include "usb/classdriver/keyboard.hpp"
 #include "usb/classdriver/mouse.hpp"
@@ -139,11 +141,8 @@ namespace usb {
 	}
 
 	Error Device::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void* buf, int len) {
-		Log(kDebug,
-			"Device::OnControlCompleted: buf 0x%08x, len %d, dir %d\n",
-			buf,
-			len,
-			setup_data.request_type.bits.direction);
+		KERNEL_TRACE(
+			"Device::OnControlCompleted: buf %p, len %d, dir %u", buf, len, setup_data.request_type.bits.direction);
 		if (is_initialized_) {
 			if (auto w = event_waiters_.Get(setup_data)) {
 				return w.value()->OnControlCompleted(ep_id, setup_data, buf, len);
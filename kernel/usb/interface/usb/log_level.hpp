@@ -0,0 +1,21 @@
+//! @file usb/log_level.hpp
+//!
+//! USB ドライバのログの優先度．
+
+#pragma once
+
+namespace usb::logger {
+	enum LogLevel {
+		kError = 3,
+		kWarn = 4,
+		kInfo = 6,
+		kDebug = 7,
+	};
+
+	//! @brief USB ドライバが記録するログの優先度のしきい値を設定する．
+	//!
+	//! カーネルのロガーのしきい値とは別に，USB ドライバのログだけを絞るのに使う．
+	//! コンパイル時に取り除いた優先度（KERNEL_LOG_LEVEL）のログは，しきい値を下げても記録されない．
+	void SetLogLevel(LogLevel level);
+	LogLevel GetLogLevel();
+}
@@ -42,6 +42,11 @@ namespace usb::xhci {
 			return slot_id_;
 		}
 
+		//! 割り込み転送の完了イベントを送るインタラプタを設定する．
+		void SetInterruptTransferInterrupter(uint16_t interrupter) {
+			interrupt_transfer_interrupter_ = interrupter;
+		}
+
 		void SelectForSlotAssignment();
 		Ring* AllocTransferRing(DeviceContextIndex index, size_t buf_size);
 
@@ -62,6 +67,7 @@ namespace usb::xhci {
 
 		enum State state_;
 		std::array<Ring*, 31> transfer_rings_; // index = dci - 1
+		uint16_t interrupt_transfer_interrupter_ = 0;
 
 		//! コントロール転送が完了した際に DataStageTRB や StatusStageTRB
 		//! から対応する SetupStageTRB を検索するためのマップ．
@@ -23,6 +23,25 @@ namespace usb::xhci {
 		EventRing* PrimaryEventRing() {
 			return &er_;
 		}
+		//! @brief interrupter 番目のインタラプタに対応するイベントリングを返す．
+		//!
+		//! @return 有効になっていないインタラプタなら nullptr
+		EventRing* EventRingAt(uint16_t interrupter) {
+			if (interrupter == kPrimaryInterrupter) {
+				return &er_;
+			} else if (interrupter == kInterruptTransferInterrupter && num_interrupters_ > 1) {
+				return &interrupt_er_;
+			}
+			return nullptr;
+		}
+		//! 有効にしたインタラプタの数．
+		uint16_t NumInterrupters() const {
+			return num_interrupters_;
+		}
+		//! 割り込み転送の完了イベントを受け取るインタラプタの番号．
+		uint16_t InterruptTransferInterrupter() const {
+			return num_interrupters_ > 1 ? kInterruptTransferInterrupter : kPrimaryInterrupter;
+		}
 		DoorbellRegister* DoorbellRegisterAt(uint8_t index);
 		Port PortAt(uint8_t port_num) {
 			return Port{port_num, PortRegisterSets()[port_num - 1]};
@@ -34,6 +53,12 @@ namespace usb::xhci {
 			return &devmgr_;
 		}
 
+		//! コマンド完了やポートの状態変化，コントロール転送のイベントを受けるインタラプタ．
+		static const uint16_t kPrimaryInterrupter = 0;
+		//! HID などの割り込み転送の完了イベントを受けるインタラプタ．
+		//! コントロール転送やコマンドの処理待ちに入力イベントが詰まらないように分ける．
+		static const uint16_t kInterruptTransferInterrupter = 1;
+
 	private:
 		static const size_t kDeviceSize = 8;
 
@@ -45,6 +70,8 @@ namespace usb::xhci {
 		class DeviceManager devmgr_;
 		Ring cr_;
 		EventRing er_;
+		EventRing interrupt_er_;
+		uint16_t num_interrupters_ = 1;
 
 		InterrupterRegisterSetArray InterrupterRegisterSets() const {
 			return {mmio_base_ + cap_->RTSOFF.Read().Offset() + 0x20u, 1024};
@@ -69,4 +96,12 @@ namespace usb::xhci {
 	//!
 	//! @return イベントを正常に処理できたら Error::kSuccess
 	usb::Error ProcessEvent(Controller& xhc);
+
+	//! @brief er の先頭のイベントを高々1つ処理する．
+	//!
+	//! er は xhc のいずれかのインタラプタのイベントリング．
+	//! イベントが無ければ即座に Error::kSuccess を返す．
+	//!
+	//! @return イベントを正常に処理できたら Error::kSuccess
+	usb::Error ProcessEvent(Controller& xhc, EventRing& er);
 }
@@ -5,8 +5,20 @@
 
 #include <kernel_interface/logger.hpp>
 
+namespace {
+	usb::logger::LogLevel log_level = usb::logger::kDebug;
+}
+
 namespace usb::logger {
-	int Log(LogLevel level, const char* format, ...) {
+	void SetLogLevel(LogLevel level) {
+		log_level = level;
+	}
+
+	LogLevel GetLogLevel() {
+		return log_level;
+	}
+
+	int LogFormat(LogLevel level, const char* format, ...) {
 		using KLogLevel = kernel_interface::logger::LogLevel;
 		KLogLevel k_log_level;
 
@@ -36,7 +48,7 @@ namespace usb::logger {
 		char s[1024];
 
 		va_start(ap, format);
-		result = vsprintf(s, format, ap);
+		result = vsnprintf(s, sizeof(s), format, ap);
 		va_end(ap);
 
 		kernel_interface::logger::default_logger->log(k_log_level, s);
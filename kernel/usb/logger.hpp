@@ -4,22 +4,34 @@
 
 #pragma once
 
+#include <kernel_interface/logger.hpp>
+
+#include "usb/log_level.hpp"
+
 namespace usb::logger {
-	enum LogLevel {
-		kError = 3,
-		kWarn = 4,
-		kInfo = 6,
-		kDebug = 7,
-	};
+	//! @brief level のログがコンパイル時に取り除かれていなければ true．
+	constexpr bool IsCompiled(LogLevel level) {
+		return static_cast<int>(level) <= static_cast<int>(kernel_interface::logger::compiled_log_level);
+	}
+
+	//! @brief 書式に従ってログを記録する．Log() から呼ぶ．
+	int LogFormat(LogLevel level, const char* format, ...);
 
 	//! @brief ログを指定された優先度で記録する．
 	//!
 	//! 指定された優先度がしきい値以上ならば記録する．
 	//! 優先度がしきい値未満ならログは捨てられる．
+	//! level が定数でコンパイル時に取り除く優先度なら，呼び出しごと消える．
 	//!
 	//! @param level  ログの優先度．しきい値以上の優先度のログのみが記録される．
 	//! @param format  書式文字列．printk と互換．
-	int Log(LogLevel level, const char* format, ...);
+	template <typename... Args>
+	[[gnu::always_inline]] inline int Log(LogLevel level, const char* format, Args... args) {
+		if (!IsCompiled(level) || level > GetLogLevel()) {
+			return 0;
+		}
+		return LogFormat(level, format, args...);
+	}
 }
 
 using namespace usb::logger;
@@ -2,6 +2,8 @@
 
 #include <cstdint>
 
+#include <kernel_interface/sync.hpp>
+
 namespace {
 	template <class T>
 	T Ceil(T value, unsigned int alignment) {
@@ -17,8 +19,12 @@ namespace {
 namespace usb {
 	alignas(64) uint8_t memory_pool[kMemoryPoolSize];
 	uintptr_t alloc_ptr = reinterpret_cast<uintptr_t>(memory_pool);
+	// xHCIのタスクと初期化中のメインタスクが同時に確保しても、同じ領域を渡さないようにする
+	kernel_interface::sync::SpinLock alloc_lock{"usb_memory"};
 
 	void* AllocMem(size_t size, unsigned int alignment, unsigned int boundary) {
+		kernel_interface::sync::IrqSaveLockGuard guard(alloc_lock);
+
 		if (alignment > 0) {
 			alloc_ptr = Ceil(alloc_ptr, alignment);
 		}
@@ -1,5 +1,7 @@
 #include "usb/xhci/device.hpp"
 
+#include <kernel_interface/trace.hpp>
+
 #include "logger.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/ring.hpp"
@@ -107,7 +109,7 @@ namespace usb::xhci {
 			return err;
 		}
 
-		Log(kDebug, "Device::ControlIn: ep addr %d, buf 0x%08x, len %d\n", ep_id.Address(), buf, len);
+		KERNEL_TRACE("Device::ControlIn: ep addr %d, buf %p, len %d", ep_id.Address(), buf, len);
 		if (ep_id.Number() < 0 || 15 < ep_id.Number()) {
 			return USB_MAKE_ERROR(Error::kInvalidEndpointNumber);
 		}
@@ -152,7 +154,7 @@ namespace usb::xhci {
 			return err;
 		}
 
-		Log(kDebug, "Device::ControlOut: ep addr %d, buf 0x%08x, len %d\n", ep_id.Address(), buf, len);
+		KERNEL_TRACE("Device::ControlOut: ep addr %d, buf %p, len %d", ep_id.Address(), buf, len);
 		if (ep_id.Number() < 0 || 15 < ep_id.Number()) {
 			return USB_MAKE_ERROR(Error::kInvalidEndpointNumber);
 		}
@@ -210,6 +212,7 @@ namespace usb::xhci {
 		normal.bits.trb_transfer_length = len;
 		normal.bits.interrupt_on_short_packet = true;
 		normal.bits.interrupt_on_completion = true;
+		normal.bits.interrupter_target = interrupt_transfer_interrupter_;
 
 		tr->Push(normal);
 		dbreg_->Ring(dci.value);
@@ -237,7 +240,14 @@ namespace usb::xhci {
 			Log(kDebug, trb);
 			return USB_MAKE_ERROR(Error::kTransferFailed);
 		}
-		Log(kDebug, trb);
+		KERNEL_TRACE(
+			"Transfer event: issuer %p, event data %u, completion code %u, residual length %u, slot %u, ep addr %d",
+			trb.Pointer(),
+			trb.bits.event_data,
+			trb.bits.completion_code,
+			residual_length,
+			trb.bits.slot_id,
+			trb.EndpointID().Address());
 
 		TRB* issuer_trb = trb.Pointer();
 		if (auto normal_trb = TRBDynamicCast<NormalTRB>(issuer_trb)) {
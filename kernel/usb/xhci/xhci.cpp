@@ -3,6 +3,9 @@
 #include "usb/device.hpp"
 #include "usb/setupdata.hpp"
 
+#include <kernel_interface/profile.hpp>
+#include <kernel_interface/trace.hpp>
+
 #include "descriptor.hpp"
 #include "logger.hpp"
 #include "xhci/speed.hpp"
@@ -133,6 +136,7 @@ namespace {
 		if (dev == nullptr) {
 			return USB_MAKE_ERROR(Error::kInvalidSlotID);
 		}
+		dev->SetInterruptTransferInterrupter(xhc.InterruptTransferInterrupter());
 
 		memset(&dev->InputContext()->input_control_context, 0, sizeof(InputControlContext));
 
@@ -220,10 +224,7 @@ namespace {
 	Error OnEvent(Controller& xhc, CommandCompletionEventTRB& trb) {
 		const auto issuer_type = trb.Pointer()->bits.trb_type;
 		const auto slot_id = trb.bits.slot_id;
-		Log(kDebug,
-			"CommandCompletionEvent: slot_id = %d, issuer = %s\n",
-			trb.bits.slot_id,
-			kTRBTypeToName[issuer_type]);
+		KERNEL_TRACE("CommandCompletionEvent: slot_id = %d, issuer type = %u", slot_id, issuer_type);
 
 		if (issuer_type == EnableSlotCommandTRB::Type) {
 			if (port_config_phase[addressing_port] != ConfigPhase::kEnablingSlot) {
@@ -379,6 +380,23 @@ namespace usb::xhci {
 		iman.bits.interrupt_enable = true;
 		primary_interrupter->IMAN.Write(iman);
 
+		// 割り込み転送用のインタラプタが使えれば有効にする．
+		// 使えなければ割り込み転送のイベントもプライマリに届ける．
+		num_interrupters_ = 1;
+		if (cap_->HCSPARAMS1.Read().bits.max_interrupters > kInterruptTransferInterrupter) {
+			auto interrupter = &InterrupterRegisterSets()[kInterruptTransferInterrupter];
+			if (auto err = interrupt_er_.Initialize(32, interrupter)) {
+				return err;
+			}
+
+			iman = interrupter->IMAN.Read();
+			iman.bits.interrupt_pending = true;
+			iman.bits.interrupt_enable = true;
+			interrupter->IMAN.Write(iman);
+			num_interrupters_ = 2;
+		}
+		Log(kDebug, "Interrupters enabled: %u\n", num_interrupters_);
+
 		// Enable interrupt for the controller
 		usbcmd = op_->USBCMD.Read();
 		usbcmd.bits.interrupter_enable = true;
@@ -476,12 +494,17 @@ namespace usb::xhci {
 	}
 
 	Error ProcessEvent(Controller& xhc) {
-		if (!xhc.PrimaryEventRing()->HasFront()) {
+		return ProcessEvent(xhc, *xhc.PrimaryEventRing());
+	}
+
+	Error ProcessEvent(Controller& xhc, EventRing& er) {
+		if (!er.HasFront()) {
 			return USB_MAKE_ERROR(Error::kSuccess);
 		}
+		kernel_interface::profile::count<kernel_interface::profile::Event::xhci_process_event>();
 
 		Error err = USB_MAKE_ERROR(Error::kNotImplemented);
-		auto event_trb = xhc.PrimaryEventRing()->Front();
+		auto event_trb = er.Front();
 		if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
 			err = OnEvent(xhc, *trb);
 		} else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
@@ -489,7 +512,7 @@ namespace usb::xhci {
 		} else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb)) {
 			err = OnEvent(xhc, *trb);
 		}
-		xhc.PrimaryEventRing()->Pop();
+		er.Pop();
 
 		return err;
 	}
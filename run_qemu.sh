@@ -34,6 +34,8 @@ qemu-system-x86_64 \
 	-monitor stdio \
 	-enable-kvm \
 	-m 2G \
+	-smp "${QEMU_SMP:-1}" \
+	-serial "${QEMU_SERIAL:-file:serial.log}" \
 	-device nec-usb-xhci,id=xhci \
 	-device usb-mouse \
 	-device usb-kbd \
@@ -0,0 +1,104 @@
+#!/usr/bin/python3
+
+import argparse
+import os
+import re
+import struct
+import subprocess
+import sys
+import tempfile
+
+
+# kernel_interface/trace.hpp の Buffer と Record に合わせる
+BUFFER_MAGIC = 0x4655424543415254
+HEADER = struct.Struct('<QIIQQQ')
+HEADER_SIZE = 64
+RECORD = struct.Struct('<QII6Q')
+CONVERSION_PATTERN = re.compile(r'%([-+ #0]*)(\d*)(?:\.(\d+))?(hh|h|ll|l|z|j|t)?([diouxXcp%])')
+LENGTH_BITS = {'hh': 8, 'h': 16, None: 32, 'l': 64, 'll': 64, 'z': 64, 'j': 64, 't': 64}
+
+
+def load_formats(elf: str) -> bytes:
+    with tempfile.TemporaryDirectory() as d:
+        path = os.path.join(d, 'trace_formats.bin')
+        subprocess.run(
+            ['objcopy', '-O', 'binary', '--only-section=.trace_formats', elf, path],
+            check=True)
+        with open(path, 'rb') as f:
+            return f.read()
+
+
+def format_record(format_string: str, arguments: list[int]) -> str:
+    it = iter(arguments)
+
+    def convert(m: re.Match) -> str:
+        flags, width, precision, length, conversion = m.groups()
+        if conversion == '%':
+            return '%'
+
+        value = next(it, 0)
+        if conversion == 'p':
+            return f'{value:#018x}'
+        if conversion == 'c':
+            return chr(value & 0xff)
+
+        bits = LENGTH_BITS[length]
+        value &= (1 << bits) - 1
+        if conversion in 'di' and value >> (bits - 1):
+            value -= 1 << bits
+        spec = '%' + flags + width + ('.' + precision if precision else '') + {'u': 'd', 'i': 'd'}.get(conversion, conversion)
+        return spec % value
+
+    return CONVERSION_PATTERN.sub(convert, format_string)
+
+
+def parse_dump(data: bytes):
+    # 全てのCPUのBufferが並んでいるので、先頭から順に読む
+    offset = 0
+    while offset + HEADER_SIZE <= len(data):
+        magic, cpu_index, num_records, tsc_frequency, boot_tsc, head = HEADER.unpack_from(data, offset)
+        if magic != BUFFER_MAGIC:
+            offset += HEADER_SIZE
+            continue
+
+        records = data[offset + HEADER_SIZE:offset + HEADER_SIZE + num_records * RECORD.size]
+        offset += HEADER_SIZE + num_records * RECORD.size
+        if tsc_frequency == 0:
+            continue
+
+        # 溢れていれば、最も古い記録はheadの位置にある
+        first = max(head - num_records, 0)
+        for i in range(first, head):
+            tsc, format_offset, num_arguments, *arguments = RECORD.unpack_from(records, i % num_records * RECORD.size)
+            time_ns = (tsc - boot_tsc) * 1_000_000_000 // tsc_frequency
+            yield time_ns, cpu_index, format_offset, arguments[:num_arguments]
+
+
+def read_format(formats: bytes, offset: int) -> str:
+    end = formats.find(b'\0', offset)
+    if offset >= len(formats) or end < 0:
+        return f'(unknown format {offset:#x})'
+    return formats[offset:end].decode(errors='replace')
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='decode the KERNEL_TRACE() buffers saved with pmemsave of the QEMU monitor')
+    parser.add_argument('elf', help='path to kernel.elf')
+    parser.add_argument('dump', help='path to the saved trace buffers')
+    ns = parser.parse_args()
+
+    formats = load_formats(ns.elf)
+    with open(ns.dump, 'rb') as f:
+        events = sorted(parse_dump(f.read()))
+
+    if not events:
+        sys.exit('no trace records found')
+
+    for time_ns, cpu_index, format_offset, arguments in events:
+        text = format_record(read_format(formats, format_offset), arguments)
+        print(f'[{time_ns // 1_000_000_000:5}.{time_ns // 1000 % 1_000_000:06}] cpu{cpu_index:<2} {text.rstrip()}')
+
+
+if __name__ == '__main__':
+    main()
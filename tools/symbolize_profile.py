@@ -0,0 +1,75 @@
+#!/usr/bin/python3
+
+import argparse
+import bisect
+import re
+import subprocess
+import sys
+
+
+HEADER_PATTERN = re.compile(r'profile: (\d+) samples')
+ENTRY_PATTERN = re.compile(r'profile:\s+(\d+)\s+[\d.]+%\s+([0-9a-f]{16})')
+NM_PATTERN = re.compile(r'([0-9a-f]+) [TtWw] (.+)')
+
+
+def load_symbols(elf: str) -> tuple[list[int], list[str]]:
+    out = subprocess.run(
+        ['nm', '--demangle', '--defined-only', '--numeric-sort', elf],
+        check=True, capture_output=True, text=True).stdout
+
+    addrs, names = [], []
+    for line in out.splitlines():
+        m = NM_PATTERN.match(line)
+        if m:
+            addrs.append(int(m.group(1), 16))
+            names.append(m.group(2))
+    return addrs, names
+
+
+def parse_log(lines) -> tuple[int, list[tuple[int, int]]]:
+    # 最後に出力された集計だけを使う
+    total, entries = 0, []
+    for line in lines:
+        m = HEADER_PATTERN.search(line)
+        if m:
+            total, entries = int(m.group(1)), []
+            continue
+        m = ENTRY_PATTERN.search(line)
+        if m:
+            entries.append((int(m.group(2), 16), int(m.group(1))))
+    return total, entries
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='aggregate the kernel profile dump (KERNEL_PROFILE) by function')
+    parser.add_argument('elf', help='path to kernel.elf')
+    parser.add_argument('log', nargs='?', help='path to a kernel log (default: stdin)')
+    ns = parser.parse_args()
+
+    addrs, names = load_symbols(ns.elf)
+    if ns.log:
+        with open(ns.log, errors='replace') as f:
+            total, entries = parse_log(f)
+    else:
+        total, entries = parse_log(sys.stdin)
+
+    if total == 0:
+        sys.exit('no profile dump found')
+
+    functions = {}
+    for rip, count in entries:
+        i = bisect.bisect_right(addrs, rip) - 1
+        name = names[i] if i >= 0 else f'{rip:#x}'
+        functions[name] = functions.get(name, 0) + count
+
+    # 出力されたのは多い順の一部のアドレスだけなので、残りはまとめて表示する
+    shown = sum(functions.values())
+    for name, count in sorted(functions.items(), key=lambda x: -x[1]):
+        print(f'{count:8} {100 * count / total:5.1f}%  {name}')
+    if shown < total:
+        print(f'{total - shown:8} {100 * (total - shown) / total:5.1f}%  (other addresses)')
+
+
+if __name__ == '__main__':
+    main()